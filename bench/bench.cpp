@@ -0,0 +1,384 @@
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <libbag.hpp>
+
+#ifndef LIBBAG_BENCH_BAG_PATH
+#define LIBBAG_BENCH_BAG_PATH "bag"
+#endif
+
+#ifndef LIBBAG_BENCH_UNBAG_PATH
+#define LIBBAG_BENCH_UNBAG_PATH "unbag"
+#endif
+
+using item_type = std::pair<libbag::unit_string_type, libbag::unit_string_type>;
+using clock_type = std::chrono::steady_clock;
+
+/// A sink growing a vector, so packing is measured without the cost of a stream.
+class vector_sink_t
+{
+private:
+    libbag::unit_vector_type &units;
+
+public:
+    explicit vector_sink_t(libbag::unit_vector_type &p_units)
+        : units(p_units) {}
+
+    auto write(libbag::unit_span_type p_units) -> void { units.insert(units.end(), p_units.begin(), p_units.end()); }
+};
+
+struct dataset_t
+{
+    std::string name;
+    std::vector<item_type> items;
+
+    auto byte_count() const -> libbag::size_type
+    {
+        libbag::size_type result = 0;
+        for (const auto &[key, content] : items)
+            result += key.size() + content.size();
+        return result;
+    }
+};
+
+/// Content that compresses somewhat, like text and structured assets do.
+auto generate_content(std::mt19937_64 &p_generator, libbag::size_type p_byte_count) -> libbag::unit_string_type
+{
+    static constexpr std::string_view words[] = {"texture", "mesh", "shader", "0.125", "vertex", "{\"id\": ", "null", "\n", "  ", "material"};
+    libbag::unit_string_type content;
+    content.reserve(p_byte_count);
+    while (content.size() < p_byte_count)
+    {
+        const auto value = p_generator();
+        if (value % 4 == 0)
+            content.push_back(static_cast<libbag::unit_type>(value >> 8));
+        else
+            content.append(words[(value >> 8) % std::size(words)]);
+    }
+    content.resize(p_byte_count);
+    return content;
+}
+
+auto generate_tiny(double p_scale) -> dataset_t
+{
+    std::mt19937_64 generator(1);
+    dataset_t dataset{"tiny", {}};
+    const auto count = static_cast<libbag::size_type>(200000 * p_scale);
+    for (libbag::size_type i = 0; i < count; ++i)
+        dataset.items.emplace_back("tiny/" + std::to_string(i), generate_content(generator, 16 + generator() % 240));
+    return dataset;
+}
+
+auto generate_huge(double p_scale) -> dataset_t
+{
+    std::mt19937_64 generator(2);
+    dataset_t dataset{"huge", {}};
+    const auto byte_count = static_cast<libbag::size_type>((64 << 20) * p_scale);
+    for (libbag::size_type i = 0; i < 4; ++i)
+        dataset.items.emplace_back("huge/" + std::to_string(i), generate_content(generator, byte_count));
+    return dataset;
+}
+
+auto generate_shared_prefix(double p_scale) -> dataset_t
+{
+    std::mt19937_64 generator(3);
+    dataset_t dataset{"shared_prefix", {}};
+    const libbag::unit_string_type prefix = "assets/" + std::string(200, 'p') + "/textures/environment/";
+    const auto count = static_cast<libbag::size_type>(50000 * p_scale);
+    for (libbag::size_type i = 0; i < count; ++i)
+        dataset.items.emplace_back(prefix + std::to_string(i) + ".ktx", generate_content(generator, 64 + generator() % 1024));
+    return dataset;
+}
+
+/// Mostly small files with a long tail of large ones, spread over directories.
+auto generate_mixed(double p_scale) -> dataset_t
+{
+    std::mt19937_64 generator(4);
+    dataset_t dataset{"mixed", {}};
+    const auto count = static_cast<libbag::size_type>(1000 * p_scale);
+    for (libbag::size_type i = 0; i < count; ++i)
+    {
+        const auto bucket = generator() % 100;
+        const libbag::size_type byte_count = bucket < 70 ? generator() % 4096 : bucket < 95 ? 4096 + generator() % (1 << 20) : (1 << 20) + generator() % (8 << 20);
+        dataset.items.emplace_back("mixed/" + std::to_string(generator() % 50) + "/" + std::to_string(generator() % 20) + "/" + std::to_string(i) + ".bin", generate_content(generator, byte_count));
+    }
+    return dataset;
+}
+
+/// Reset the peak resident set size, where the kernel allows it, so each measure reports its own.
+auto reset_peak_rss() -> void
+{
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    if (clear_refs)
+        clear_refs << "5";
+}
+
+auto get_peak_rss_kb(int p_who = RUSAGE_SELF) -> long
+{
+    std::ifstream status("/proc/self/status");
+    for (std::string line; p_who == RUSAGE_SELF && std::getline(status, line);)
+        if (line.starts_with("VmHWM:"))
+            return std::strtol(line.c_str() + 6, nullptr, 10);
+
+    rusage usage{};
+    ::getrusage(p_who, &usage);
+    return usage.ru_maxrss;
+}
+
+class report_t
+{
+private:
+    std::ostream &output;
+    bool is_first = true;
+
+public:
+    explicit report_t(std::ostream &p_output)
+        : output(p_output) { output << "[\n"; }
+
+    ~report_t() { output << "\n]" << std::endl; }
+
+    /// Write one measure as a JSON object.
+    auto add(const std::string &p_dataset, const std::string &p_operation, libbag::size_type p_entry_count, libbag::size_type p_byte_count, double p_seconds, long p_peak_rss_kb, const std::vector<double> &p_latencies_ns = {}) -> void
+    {
+        output << (is_first ? "  " : ",\n  ");
+        is_first = false;
+
+        output << "{\"dataset\": \"" << p_dataset << "\", \"operation\": \"" << p_operation << "\""
+               << ", \"entries\": " << p_entry_count << ", \"bytes\": " << p_byte_count << ", \"seconds\": " << p_seconds
+               << ", \"mb_per_s\": " << (p_seconds > 0 ? static_cast<double>(p_byte_count) / 1e6 / p_seconds : 0)
+               << ", \"entries_per_s\": " << (p_seconds > 0 ? static_cast<double>(p_entry_count) / p_seconds : 0)
+               << ", \"peak_rss_kb\": " << p_peak_rss_kb;
+
+        if (!p_latencies_ns.empty())
+        {
+            auto latencies_ns = p_latencies_ns;
+            std::sort(latencies_ns.begin(), latencies_ns.end());
+            const auto percentile = [&](double p_fraction)
+            { return latencies_ns[static_cast<std::size_t>(p_fraction * static_cast<double>(latencies_ns.size() - 1))]; };
+            output << ", \"p50_ns\": " << percentile(0.5) << ", \"p90_ns\": " << percentile(0.9) << ", \"p99_ns\": " << percentile(0.99) << ", \"max_ns\": " << latencies_ns.back();
+        }
+
+        output << "}" << std::flush;
+    }
+};
+
+template <typename F>
+auto measure(F p_function) -> double
+{
+    reset_peak_rss();
+    const auto start = clock_type::now();
+    p_function();
+    return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+auto run_command(const std::string &p_command) -> void
+{
+    if (std::system(p_command.c_str()) != 0)
+        throw std::runtime_error("Command failed: " + p_command);
+}
+
+auto bench_dataset(const dataset_t &p_dataset, const std::filesystem::path &p_work_path, report_t &p_report) -> void
+{
+    const auto entry_count = p_dataset.items.size();
+    const auto byte_count = p_dataset.byte_count();
+    libbag::pack_options_t options;
+    options.lookup_index = true;
+
+    libbag::unit_vector_type packed;
+    packed.reserve(byte_count + byte_count / 8 + (1 << 20));
+    const double pack_seconds = measure([&]
+                                        {
+        vector_sink_t sink(packed);
+        libbag::pack(p_dataset.items, sink, options); });
+    p_report.add(p_dataset.name, "pack", entry_count, byte_count, pack_seconds, get_peak_rss_kb());
+
+    const auto bag = libbag::bag_type(packed.data(), packed.size());
+
+    const double attributes_seconds = measure([&]
+                                              {
+        std::vector<libbag::attribute_type> attributes;
+        libbag::get_attributes(bag, std::inserter(attributes, attributes.end())); });
+    p_report.add(p_dataset.name, "get_attributes", entry_count, 0, attributes_seconds, get_peak_rss_kb());
+
+    const double unpack_seconds = measure([&]
+                                          {
+        std::vector<libbag::unpack_result_type> unpacked;
+        libbag::unpack_all(bag, std::inserter(unpacked, unpacked.end())); });
+    p_report.add(p_dataset.name, "unpack", entry_count, byte_count, unpack_seconds, get_peak_rss_kb());
+
+    // Take one item in ten.
+    libbag::size_type filtered_count = 0;
+    const double filtered_seconds = measure([&]
+                                            {
+        std::vector<libbag::unpack_result_type> unpacked;
+        libbag::unpack(bag, [](const libbag::attribute_type &p_attribute)
+                       { return p_attribute.second.byte_offset % 10 == 0; }, std::inserter(unpacked, unpacked.end()));
+        filtered_count = unpacked.size(); });
+    p_report.add(p_dataset.name, "unpack_filtered", filtered_count, 0, filtered_seconds, get_peak_rss_kb());
+
+    std::mt19937_64 generator(5);
+    std::vector<double> latencies_ns;
+    const libbag::size_type lookup_count = std::min<libbag::size_type>(entry_count * 4, 100000);
+    latencies_ns.reserve(lookup_count);
+    const double lookup_seconds = measure([&]
+                                          {
+        for (libbag::size_type i = 0; i < lookup_count; ++i)
+        {
+            const auto &key = p_dataset.items[generator() % entry_count].first;
+            const auto start = clock_type::now();
+            const auto content = libbag::find(bag, key);
+            latencies_ns.push_back(std::chrono::duration<double, std::nano>(clock_type::now() - start).count());
+            if (!content)
+                throw std::runtime_error("Missing key.");
+        } });
+    p_report.add(p_dataset.name, "find", lookup_count, 0, lookup_seconds, get_peak_rss_kb(), latencies_ns);
+
+    // Check the structure once, then unpack and look up without checking it again.
+    std::optional<libbag::validated_bag_t> validated;
+    const double validate_seconds = measure([&]
+                                            { validated.emplace(bag, libbag::verify_mode_t::off); });
+    p_report.add(p_dataset.name, "validate", entry_count, 0, validate_seconds, get_peak_rss_kb());
+
+    const double validated_unpack_seconds = measure([&]
+                                                    {
+        std::vector<libbag::unpack_result_type> unpacked;
+        libbag::unpack_all(*validated, std::inserter(unpacked, unpacked.end())); });
+    p_report.add(p_dataset.name, "unpack_validated", entry_count, byte_count, validated_unpack_seconds, get_peak_rss_kb());
+
+    latencies_ns.clear();
+    const double validated_lookup_seconds = measure([&]
+                                                    {
+        for (libbag::size_type i = 0; i < lookup_count; ++i)
+        {
+            const auto &key = p_dataset.items[generator() % entry_count].first;
+            const auto start = clock_type::now();
+            const auto content = validated->find(key);
+            latencies_ns.push_back(std::chrono::duration<double, std::nano>(clock_type::now() - start).count());
+            if (!content)
+                throw std::runtime_error("Missing key.");
+        } });
+    p_report.add(p_dataset.name, "find_validated", lookup_count, 0, validated_lookup_seconds, get_peak_rss_kb(), latencies_ns);
+
+    const auto bag_path = p_work_path / (p_dataset.name + ".bag");
+    const auto extract_path = p_work_path / (p_dataset.name + "_extract");
+    {
+        std::ofstream stream(bag_path, std::ios::binary);
+        stream.write(packed.data(), static_cast<std::streamsize>(packed.size()));
+    }
+    packed = libbag::unit_vector_type();
+
+    const double extract_seconds = measure([&]
+                                           {
+        const libbag::mapped_bag_t mapped_bag(bag_path, libbag::access_advice_t::will_need);
+        libbag::extract(mapped_bag, extract_path, {.thread_count = std::max(1u, std::thread::hardware_concurrency())}); });
+    p_report.add(p_dataset.name, "extract", entry_count, byte_count, extract_seconds, get_peak_rss_kb());
+
+    // Extract again over the same files with batched opens, writes and closes, where the kernel has io_uring.
+    const double batched_extract_seconds = measure([&]
+                                                   {
+        const libbag::mapped_bag_t mapped_bag(bag_path, libbag::access_advice_t::will_need);
+        libbag::extract(mapped_bag, extract_path, {.thread_count = std::max(1u, std::thread::hardware_concurrency()), .io_backend = libbag::io_backend_t::automatic}); });
+    p_report.add(p_dataset.name, "extract_batched", entry_count, byte_count, batched_extract_seconds, get_peak_rss_kb());
+
+    // The CLI packs the extracted files and unpacks them again, relative to the extraction directory.
+    const auto cli_bag_path = p_work_path / (p_dataset.name + "_cli.bag");
+    const auto cli_unbag_path = p_work_path / (p_dataset.name + "_cli");
+    std::filesystem::create_directories(cli_unbag_path);
+    const double bag_seconds = measure([&]
+                                       { run_command("cd '" + extract_path.string() + "' && '" LIBBAG_BENCH_BAG_PATH "' --lookup-index '" + cli_bag_path.string() + "' ."); });
+    p_report.add(p_dataset.name, "cli_bag", entry_count, byte_count, bag_seconds, get_peak_rss_kb(RUSAGE_CHILDREN));
+
+    const double batched_bag_seconds = measure([&]
+                                               { run_command("cd '" + extract_path.string() + "' && '" LIBBAG_BENCH_BAG_PATH "' --lookup-index --io auto '" + cli_bag_path.string() + "' ."); });
+    p_report.add(p_dataset.name, "cli_bag_batched", entry_count, byte_count, batched_bag_seconds, get_peak_rss_kb(RUSAGE_CHILDREN));
+
+    const double unbag_seconds = measure([&]
+                                         { run_command("cd '" + cli_unbag_path.string() + "' && '" LIBBAG_BENCH_UNBAG_PATH "' '" + cli_bag_path.string() + "'"); });
+    p_report.add(p_dataset.name, "cli_unbag", entry_count, byte_count, unbag_seconds, get_peak_rss_kb(RUSAGE_CHILDREN));
+
+    const double batched_unbag_seconds = measure([&]
+                                                 { run_command("cd '" + cli_unbag_path.string() + "' && '" LIBBAG_BENCH_UNBAG_PATH "' --io auto '" + cli_bag_path.string() + "'"); });
+    p_report.add(p_dataset.name, "cli_unbag_batched", entry_count, byte_count, batched_unbag_seconds, get_peak_rss_kb(RUSAGE_CHILDREN));
+
+    std::filesystem::remove_all(extract_path);
+    std::filesystem::remove_all(cli_unbag_path);
+    std::filesystem::remove(bag_path);
+    std::filesystem::remove(cli_bag_path);
+}
+
+int main(int p_argument_count, const char *p_argument_values[])
+try
+{
+    std::span<const char *> arguments{p_argument_values, static_cast<std::size_t>(p_argument_count)};
+
+    double scale = 1;
+    std::vector<std::string> dataset_names;
+    std::optional<std::filesystem::path> output_path;
+    for (auto argument_it = std::next(arguments.begin()); argument_it != arguments.end(); ++argument_it)
+    {
+        const std::string_view option(*argument_it);
+        if ((option == "--scale" || option == "--dataset" || option == "--output") && std::next(argument_it) == arguments.end())
+        {
+            std::stringstream message;
+            message << "Missing value for option '" << option << "'.";
+            throw std::runtime_error(message.str());
+        }
+
+        if (option == "--scale")
+            scale = std::strtod(*++argument_it, nullptr);
+        else if (option == "--dataset")
+            dataset_names.emplace_back(*++argument_it);
+        else if (option == "--output")
+            output_path = *++argument_it;
+        else
+        {
+            std::cout << "usage: libbag_bench [--scale X] [--dataset {tiny|huge|shared_prefix|mixed}]... [--output {json_path}]" << std::endl;
+            return option == "--help" ? 0 : 1;
+        }
+    }
+
+    if (scale <= 0)
+        throw std::runtime_error("Invalid scale.");
+
+    const std::vector<std::pair<std::string, dataset_t (*)(double)>> generators{
+        {"tiny", generate_tiny},
+        {"huge", generate_huge},
+        {"shared_prefix", generate_shared_prefix},
+        {"mixed", generate_mixed}};
+
+    const auto work_path = std::filesystem::temp_directory_path() / ("libbag_bench_" + std::to_string(::getpid()));
+    std::filesystem::create_directories(work_path);
+
+    std::ofstream output_file;
+    if (output_path)
+        output_file.open(*output_path);
+
+    {
+        report_t report(output_path ? output_file : std::cout);
+        for (const auto &[name, generate] : generators)
+        {
+            if (!dataset_names.empty() && std::find(dataset_names.begin(), dataset_names.end(), name) == dataset_names.end())
+                continue;
+
+            bench_dataset(generate(scale), work_path, report);
+        }
+    }
+
+    std::filesystem::remove_all(work_path);
+    return 0;
+}
+catch (const std::exception &e)
+{
+    std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
+}
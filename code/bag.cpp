@@ -3,7 +3,12 @@
 #include <sstream>
 #include <filesystem>
 #include <map>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <fcntl.h>
 #include <libbag.hpp>
+#include "option.hpp"
 
 template <typename T>
 concept file_path_list_iterator_c = requires {
@@ -21,78 +26,247 @@ class file_list_reader_iterator_t
 {
 public:
     using iterator_type = Iterator;
-    using difference_type = void;
-    using value_type = std::pair<libbag::unit_string_type, libbag::unit_vector_type>;
-    using pointer = const value_type *;
-    using reference = const value_type &;
-    using iterator_category = std::output_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = std::pair<libbag::unit_string_type, libbag::file_source_t>;
+    using reference = value_type;
+    using iterator_category = std::input_iterator_tag;
 
 private:
     iterator_type it;
-    mutable value_type cache;
 
-    static auto read_file(const char *p_path_c_str) -> libbag::unit_vector_type
+public:
+    constexpr file_list_reader_iterator_t() = default;
+
+    file_list_reader_iterator_t(iterator_type p_it)
+        : it(p_it) {}
+
+    /// Open the file as a content source, so its content is streamed instead of read into memory.
+    auto operator*() const -> reference
+    {
+        const std::filesystem::path path = *it;
+        return value_type{libbag::unit_string_type(path.generic_string()), libbag::file_source_t(path)};
+    }
+
+    auto operator++() -> file_list_reader_iterator_t &
+    {
+        ++it;
+        return *this;
+    }
+
+    auto operator++(int) -> file_list_reader_iterator_t
+    {
+        file_list_reader_iterator_t temp = *this;
+        ++(*this);
+        return temp;
+    }
+
+    auto operator==(const file_list_reader_iterator_t &p_reader) const -> bool
+    {
+        return p_reader.it == it;
+    }
+};
+
+/// A prefetched input, held in memory when small and streamed from its file otherwise.
+/// It may also be the stored content of an unchanged file in a base bag.
+class prefetched_content_t
+{
+private:
+    libbag::unit_vector_type buffer;
+    std::optional<libbag::file_source_t> file;
+    std::optional<libbag::stored_item_source_t> stored;
+    std::optional<libbag::content_hash_t> content_hash;
+    std::optional<libbag::stamp_t> stamp;
+
+public:
+    static constexpr libbag::size_type in_memory_byte_limit = 1 << 20;
+
+    /// Read the file, and hash it when asked so the writer does not have to.
+    prefetched_content_t(const std::filesystem::path &p_path, bool p_is_hashed)
     {
-        std::basic_ifstream<libbag::unit_type> stream(p_path_c_str, std::ios::binary | std::ios::ate);
-        std::streamsize size = stream.tellg();
-        stream.seekg(0, std::ios::beg);
+        libbag::file_source_t source(p_path);
+        stamp = source.get_stamp();
+        if (source.size() > in_memory_byte_limit)
+        {
+            ::posix_fadvise(source.get_descriptor(), 0, 0, POSIX_FADV_WILLNEED);
+            if (p_is_hashed)
+            {
+                libbag::unit_vector_type hash_buffer;
+                content_hash = libbag::hash_content_source(source, hash_buffer);
+                stamp->content_hash = *content_hash;
+            }
+            file.emplace(std::move(source));
+            return;
+        }
 
-        libbag::unit_vector_type content(size);
-        if (!stream.read(content.data(), size))
+        buffer.resize(source.size());
+        for (libbag::size_type byte_offset = 0; byte_offset < buffer.size();)
         {
-            std::stringstream message;
-            message << "Fail to read the content of the file '" << p_path_c_str << "'.";
-            throw std::runtime_error(message.str());
+            const auto read_byte_count = source.read(byte_offset, std::span(buffer).subspan(byte_offset));
+            if (read_byte_count == 0)
+            {
+                std::stringstream message;
+                message << "Fail to read the content of the file '" << p_path.string() << "'.";
+                throw std::runtime_error(message.str());
+            }
+            byte_offset += read_byte_count;
         }
 
-        return content;
+        if (p_is_hashed)
+        {
+            content_hash = libbag::hash_content(buffer);
+            stamp->content_hash = *content_hash;
+        }
     }
 
-    auto update_cache() const -> void
+    /// Take a file read in a batch, or open it to stream it when it was too large to be read.
+    prefetched_content_t(libbag::read_file_t p_file, const std::filesystem::path &p_path, bool p_is_hashed)
     {
-        const std::filesystem::path path = *it;
-        if (cache.first == libbag::unit_string_type(path.generic_string()))
+        if (!p_file.content)
+        {
+            *this = prefetched_content_t(p_path, p_is_hashed);
             return;
+        }
 
-        const libbag::unit_vector_type content = read_file(path.c_str());
-        cache = value_type{libbag::unit_string_type(path.generic_string()), std::move(content)};
+        buffer = std::move(*p_file.content);
+        stamp = p_file.stamp;
+        if (p_is_hashed)
+        {
+            content_hash = libbag::hash_content(buffer);
+            stamp->content_hash = *content_hash;
+        }
     }
 
-public:
-    constexpr file_list_reader_iterator_t() = default;
+    explicit prefetched_content_t(const libbag::stored_item_source_t &p_stored)
+        : stored(p_stored), stamp(p_stored.get_stamp()) {}
 
-    file_list_reader_iterator_t(iterator_type p_it)
-        : it(p_it) {}
+    auto size() const -> libbag::size_type { return file ? file->size() : stored ? stored->size() : buffer.size(); }
 
-    auto operator*() const -> reference
+    auto get_descriptor() const -> int { return file ? file->get_descriptor() : stored ? stored->get_descriptor() : -1; }
+
+    auto get_descriptor_offset() const -> libbag::size_type { return stored ? stored->get_descriptor_offset() : 0; }
+
+    auto read(libbag::size_type p_byte_offset, std::span<libbag::unit_type> p_buffer) const -> libbag::size_type
     {
-        update_cache();
-        return cache;
+        if (file)
+            return file->read(p_byte_offset, p_buffer);
+        if (stored)
+            return stored->read(p_byte_offset, p_buffer);
+
+        const auto byte_count = std::min<libbag::size_type>(p_buffer.size(), buffer.size() - p_byte_offset);
+        std::copy_n(buffer.begin() + p_byte_offset, byte_count, p_buffer.begin());
+        return byte_count;
     }
 
-    auto operator->() const -> pointer
+    auto get_content_hash() const -> std::optional<libbag::content_hash_t> { return content_hash; }
+
+    auto get_stamp() const -> std::optional<libbag::stamp_t> { return stamp; }
+
+    auto get_stored_encoding() const -> std::optional<libbag::encoding_t> { return stored ? stored->get_stored_encoding() : std::nullopt; }
+
+    auto get_stored_checksum() const -> std::optional<uint32_t> { return stored ? stored->get_stored_checksum() : std::nullopt; }
+
+    auto in_memory_byte_count() const -> libbag::size_type { return buffer.size(); }
+};
+
+static_assert(libbag::hashed_content_source_c<prefetched_content_t>);
+static_assert(libbag::stored_content_source_c<prefetched_content_t>);
+
+/// A previous bag, whose contents are reused for the files that did not change since.
+class base_bag_t
+{
+private:
+    libbag::mapped_bag_t bag;
+    libbag::file_source_t file;
+    libbag::layout_t layout;
+    std::unordered_map<libbag::key_type, libbag::size_type> ordinals;
+
+public:
+    explicit base_bag_t(const std::filesystem::path &p_path)
+        : bag(p_path, libbag::access_advice_t::random), file(p_path), layout(libbag::get_layout(bag))
     {
-        update_cache();
-        return &cache;
+        if (layout.stamps.empty())
+            std::cerr << "Warning: The base bag '" << p_path.string() << "' has no stamps, so every file is packed again." << std::endl;
+
+        for (libbag::size_type ordinal = 0; ordinal < layout.indices.size(); ++ordinal)
+            ordinals.emplace(libbag::get_item(layout, ordinal).first, ordinal);
     }
 
-    auto operator++() -> file_list_reader_iterator_t &
+    /// Get the stored content of a file when its size and modification time are as recorded,
+    /// or when its content hash is, if asked to compare it.
+    auto find_unchanged(const std::filesystem::path &p_path, libbag::key_type p_key, bool p_is_hash_compared) const -> std::optional<libbag::stored_item_source_t>
     {
-        ++it;
+        const auto ordinal_it = ordinals.find(p_key);
+        if (layout.stamps.empty() || ordinal_it == ordinals.end())
+            return std::nullopt;
+
+        struct stat status;
+        if (::stat(p_path.c_str(), &status) != 0)
+            return std::nullopt;
+
+        const libbag::stamp_t &base_stamp = layout.stamps[ordinal_it->second];
+        const auto modification_time = libbag::get_modification_time(status);
+        const auto byte_count = static_cast<libbag::size_type>(status.st_size);
+        if (base_stamp.content_hash.byte_count != byte_count)
+            return std::nullopt;
+
+        bool is_unchanged = base_stamp.modification_time != 0 && base_stamp.modification_time == modification_time;
+        if (!is_unchanged && p_is_hash_compared && base_stamp.has_content_hash())
+        {
+            libbag::unit_vector_type hash_buffer;
+            is_unchanged = libbag::hash_content_source(libbag::file_source_t(p_path), hash_buffer) == base_stamp.content_hash;
+        }
+        if (!is_unchanged)
+            return std::nullopt;
+
+        auto stored = libbag::get_stored_item_source(bag, layout, ordinal_it->second, file.get_descriptor());
+        stored.set_stamp(libbag::stamp_t{modification_time, base_stamp.content_hash});
+        return stored;
+    }
+};
+
+using prefetched_item_type = std::pair<libbag::unit_string_type, prefetched_content_t>;
+using prefetched_batch_type = std::vector<prefetched_item_type>;
+
+/// Walk the items of prefetched batches in order, as one sequence.
+class prefetched_batch_iterator_t
+{
+public:
+    using difference_type = std::ptrdiff_t;
+    using value_type = prefetched_item_type;
+    using reference = const prefetched_item_type &;
+    using iterator_category = std::input_iterator_tag;
+
+private:
+    libbag::prefetcher_t<prefetched_batch_type> *prefetcher = nullptr;
+    libbag::size_type batch = 0;
+    libbag::size_type index = 0;
+
+public:
+    prefetched_batch_iterator_t() = default;
+
+    prefetched_batch_iterator_t(libbag::prefetcher_t<prefetched_batch_type> &p_prefetcher, libbag::size_type p_batch)
+        : prefetcher(&p_prefetcher), batch(p_batch) {}
+
+    auto operator*() const -> reference { return prefetcher->get(batch)[index]; }
+
+    auto operator++() -> prefetched_batch_iterator_t &
+    {
+        if (++index == prefetcher->get(batch).size())
+        {
+            ++batch;
+            index = 0;
+        }
         return *this;
     }
 
-    auto operator++(int) -> file_list_reader_iterator_t &
+    auto operator++(int) -> prefetched_batch_iterator_t
     {
-        file_list_reader_iterator_t temp = *this;
+        prefetched_batch_iterator_t temp = *this;
         ++(*this);
         return temp;
     }
 
-    auto operator==(const file_list_reader_iterator_t &p_reader) const -> bool
-    {
-        return p_reader.it == it;
-    }
+    auto operator==(const prefetched_batch_iterator_t &p_other) const -> bool { return batch == p_other.batch && index == p_other.index; }
 };
 
 auto glob_regular_file_path(const std::vector<std::filesystem::path> &p_paths) -> std::vector<std::filesystem::path>
@@ -119,28 +293,326 @@ try
 
     std::span<const char *> arguments{p_argument_values, static_cast<std::size_t>(p_argument_count)};
 
-    if (arguments.size() <= 2)
+    libbag::pack_options_t options;
+    libbag::size_type job_count = 1;
+    libbag::io_backend_t io_backend = libbag::io_backend_t::threads;
+    bool is_appending = false;
+    bool is_compacting = false;
+    std::vector<libbag::unit_string_type> removed_keys;
+    std::optional<std::filesystem::path> base_path;
+    bool is_base_hash_compared = false;
+    libbag::size_type shard_byte_count = 0;
+    bool is_emitting_cpp = false;
+    bool is_reporting_stats = false;
+    bool is_reporting_stats_json = false;
+    auto argument_it = std::next(arguments.begin());
+    for (; argument_it != arguments.end() && std::string_view(*argument_it).starts_with("--"); ++argument_it)
+    {
+        const std::string_view option(*argument_it);
+        if (option == "--lookup-index")
+            options.lookup_index = true;
+        else if (option == "--compress")
+            options.codec = libbag::lz_codec_t();
+        else if (option == "--deduplicate")
+            options.deduplicate = true;
+        else if (option == "--checksum")
+            options.checksum = true;
+        else if (option == "--align")
+        {
+            ++argument_it;
+            options.content_alignment = parse_count(option, argument_it == arguments.end() ? nullptr : *argument_it);
+        }
+        else if (option == "--append")
+            is_appending = true;
+        else if (option == "--remove")
+        {
+            ++argument_it;
+            if (argument_it == arguments.end())
+                throw std::runtime_error("Missing key for option '--remove'.");
+            removed_keys.emplace_back(*argument_it);
+        }
+        else if (option == "--compact")
+            is_compacting = true;
+        else if (option == "--stamp")
+            options.stamp = true;
+        else if (option == "--key-table")
+            options.key_table = true;
+        else if (option == "--stream")
+            options.stream = true;
+        else if (option == "--emit-cpp")
+            is_emitting_cpp = true;
+        else if (option == "--stats")
+            is_reporting_stats = true;
+        else if (option == "--stats-json")
+            is_reporting_stats_json = true;
+        else if (option == "--base")
+        {
+            ++argument_it;
+            if (argument_it == arguments.end())
+                throw std::runtime_error("Missing path for option '--base'.");
+            base_path = *argument_it;
+            options.stamp = true;
+        }
+        else if (option == "--base-hash")
+            is_base_hash_compared = true;
+        else if (option == "--shard-size")
+        {
+            ++argument_it;
+            shard_byte_count = parse_count(option, argument_it == arguments.end() ? nullptr : *argument_it);
+        }
+        else if (option == "--jobs")
+        {
+            ++argument_it;
+            job_count = parse_count(option, argument_it == arguments.end() ? nullptr : *argument_it);
+        }
+        else if (option == "--io")
+        {
+            ++argument_it;
+            io_backend = parse_io_backend(option, argument_it == arguments.end() ? nullptr : *argument_it);
+        }
+        else
+        {
+            std::stringstream message;
+            message << "Unknown option '" << option << "'.";
+            throw std::runtime_error(message.str());
+        }
+    }
+
+    if (std::distance(argument_it, arguments.end()) < (is_appending ? 1 : 2))
+    {
+        std::cout << "usage: bag [--lookup-index] [--compress] [--deduplicate] [--checksum] [--align N] [--stamp] [--key-table] [--stream] [--stats] [--stats-json] [--jobs N] [--io {threads|uring|auto}] {output_path} {paths...}" << std::endl
+                  << "       bag --base {base_path} [--base-hash] [options] {output_path} {paths...}" << std::endl
+                  << "       bag --shard-size N [options] {manifest_path} {paths...}" << std::endl
+                  << "       bag --emit-cpp [options] {header_path} {paths...}" << std::endl
+                  << "       bag --append [--remove KEY]... [options] {bag_path} {paths...}" << std::endl
+                  << "       bag --compact [options] {output_path} {bag_path}" << std::endl;
+        return 0;
+    }
+
+    if (is_appending && is_compacting)
+        throw std::runtime_error("Option '--append' does not apply to '--compact'.");
+    if (!removed_keys.empty() && !is_appending)
+        throw std::runtime_error("Option '--remove' only applies to '--append'.");
+    if (shard_byte_count != 0 && (is_appending || is_compacting))
+        throw std::runtime_error("Option '--shard-size' does not apply to '--append' and '--compact'.");
+    if (is_emitting_cpp && (is_appending || is_compacting || shard_byte_count != 0 || base_path || options.codec))
+        throw std::runtime_error("Option '--emit-cpp' does not apply to '--append', '--compact', '--shard-size', '--base' and '--compress'.");
+    if (base_path && (is_appending || is_compacting))
+        throw std::runtime_error("Option '--base' does not apply to '--append' and '--compact'.");
+
+    if (is_compacting)
     {
-        std::cout << "usage: bag {output_path} {paths...}" << std::endl;
+        const libbag::mapped_bag_t input_bag(*std::next(argument_it), libbag::access_advice_t::sequential);
+        libbag::file_sink_t file(*argument_it);
+        libbag::buffered_sink_t sink(file);
+        libbag::compact(input_bag, sink, options);
         return 0;
     }
 
-    std::basic_ofstream<libbag::unit_type> stream(arguments[1], std::ios::binary);
+    // Report where the time went on the standard error once packing is done.
+    libbag::stats_observer_t observer;
+    const auto report_stats = [&]
+    {
+        if (is_reporting_stats)
+            observer.write_text(std::cerr);
+        if (is_reporting_stats_json)
+            observer.write_json(std::cerr);
+    };
+
+    // When appending, the bag is mapped before its file grows, and cut back to its size when packing fails.
+    std::optional<libbag::mapped_bag_t> appended_bag;
+    if (is_appending)
+        appended_bag.emplace(*argument_it, libbag::access_advice_t::random);
+    const std::set<libbag::key_type> removed_key_set(removed_keys.begin(), removed_keys.end());
+
+    // When rebuilding from a base bag, which may be the output, the output is written aside then renamed.
+    const std::filesystem::path output_path(*argument_it);
+    std::optional<base_bag_t> base_bag;
+    if (base_path)
+        base_bag.emplace(*base_path);
 
     std::vector<std::filesystem::path> input_paths;
-    std::transform(std::next(arguments.begin(), 2), arguments.end(), std::back_inserter(input_paths), [](const char *p_argument)
+    std::transform(std::next(argument_it), arguments.end(), std::back_inserter(input_paths), [](const char *p_argument)
                    { return std::filesystem::path(p_argument); });
 
     std::vector<std::filesystem::path> input_regular_file_paths = glob_regular_file_path(input_paths);
 
-    libbag::pack(
-        file_list_reader_iterator_t(input_regular_file_paths.begin()),
-        file_list_reader_iterator_t(input_regular_file_paths.end()),
-        stream);
+    // Pack the files in memory, then write them as a header named after it.
+    if (is_emitting_cpp)
+    {
+        libbag::unit_stringstream_type stream;
+        libbag::ostream_sink_t stream_sink(stream);
+        libbag::pack(
+            file_list_reader_iterator_t(input_regular_file_paths.begin()),
+            file_list_reader_iterator_t(input_regular_file_paths.end()),
+            stream_sink,
+            options,
+            observer);
+        const libbag::unit_string_type packed = stream.str();
+
+        std::string namespace_name;
+        for (const auto unit : output_path.stem().string())
+            namespace_name.push_back(std::isalnum(static_cast<unsigned char>(unit)) ? unit : '_');
+        if (namespace_name.empty() || std::isdigit(static_cast<unsigned char>(namespace_name.front())))
+            namespace_name.insert(namespace_name.begin(), '_');
+
+        std::ofstream header(output_path, std::ios::binary);
+        libbag::write_embedded_header(libbag::bag_type(packed.data(), packed.size()), namespace_name, header);
+        if (!header.flush())
+            throw std::runtime_error("Fail to write the header '" + output_path.string() + "'.");
+        report_stats();
+        return 0;
+    }
+
+    // Pack the files into a bag, or append them to it.
+    const auto pack_paths = [&](const std::vector<std::filesystem::path> &p_paths, const std::filesystem::path &p_output_path)
+    {
+        const std::filesystem::path written_path = base_bag ? std::filesystem::path(p_output_path.string() + ".partial") : p_output_path;
+        libbag::file_sink_t file(written_path, is_appending ? libbag::file_sink_mode_t::append : libbag::file_sink_mode_t::truncate);
+        libbag::buffered_sink_t sink(file);
+        const auto write_bag = [&](auto p_begin, auto p_end)
+        {
+            if (!appended_bag)
+            {
+                libbag::pack(p_begin, p_end, sink, options, observer);
+                if (base_bag)
+                    std::filesystem::rename(written_path, p_output_path);
+                return;
+            }
+
+            try
+            {
+                libbag::append(*appended_bag, p_begin, p_end, sink, options, removed_key_set, observer);
+            }
+            catch (...)
+            {
+                if (::ftruncate(file.get_descriptor(), static_cast<off_t>(appended_bag->size_bytes())) != 0)
+                    std::cerr << "Error: Fail to restore the bag." << std::endl;
+                throw;
+            }
+        };
+
+        if (job_count <= 1 && !base_bag && io_backend == libbag::io_backend_t::threads)
+        {
+            write_bag(
+                file_list_reader_iterator_t(p_paths.begin()),
+                file_list_reader_iterator_t(p_paths.end()));
+            return;
+        }
+
+        // Read inputs ahead on a pool of threads, while this thread writes them in order.
+        // Unchanged inputs are taken from the base bag instead.
+        constexpr libbag::size_type in_flight_byte_limit = 256 << 20;
+        const bool is_hashed = options.deduplicate || options.stamp;
+        if (io_backend != libbag::io_backend_t::threads)
+        {
+            // Each batch of small files is read with a few system calls rather than a few for each file.
+            constexpr libbag::size_type batch_file_count = 256;
+            const libbag::size_type batch_count = (p_paths.size() + batch_file_count - 1) / batch_file_count;
+            libbag::prefetcher_t<prefetched_batch_type> prefetcher(
+                batch_count,
+                [&](libbag::size_type p_batch)
+                {
+                    const auto paths = std::span(p_paths).subspan(p_batch * batch_file_count, std::min(batch_file_count, p_paths.size() - p_batch * batch_file_count));
+                    std::vector<std::optional<libbag::stored_item_source_t>> stored_items(paths.size());
+                    std::vector<std::filesystem::path> read_paths;
+                    for (libbag::size_type index = 0; index < paths.size(); ++index)
+                    {
+                        if (base_bag)
+                            stored_items[index] = base_bag->find_unchanged(paths[index], libbag::unit_string_type(paths[index].generic_string()), is_base_hash_compared);
+                        if (!stored_items[index])
+                            read_paths.push_back(paths[index]);
+                    }
+
+                    auto files = libbag::read_files(read_paths, prefetched_content_t::in_memory_byte_limit, io_backend);
+                    prefetched_batch_type items;
+                    items.reserve(paths.size());
+                    for (libbag::size_type index = 0, read_index = 0; index < paths.size(); ++index)
+                    {
+                        auto key = libbag::unit_string_type(paths[index].generic_string());
+                        if (stored_items[index])
+                            items.emplace_back(std::move(key), prefetched_content_t(*stored_items[index]));
+                        else
+                            items.emplace_back(std::move(key), prefetched_content_t(std::move(files[read_index++]), paths[index], is_hashed));
+                    }
+                    return items;
+                },
+                [](const prefetched_batch_type &p_items)
+                {
+                    libbag::size_type byte_count = 0;
+                    for (const auto &item : p_items)
+                        byte_count += item.second.in_memory_byte_count();
+                    return byte_count;
+                },
+                job_count,
+                in_flight_byte_limit);
+
+            write_bag(prefetched_batch_iterator_t(prefetcher, 0), prefetched_batch_iterator_t(prefetcher, batch_count));
+            return;
+        }
+
+        libbag::prefetcher_t<prefetched_item_type> prefetcher(
+            p_paths.size(),
+            [&](libbag::size_type p_ordinal)
+            {
+                const std::filesystem::path &path = p_paths[p_ordinal];
+                auto key = libbag::unit_string_type(path.generic_string());
+                if (base_bag)
+                    if (const auto stored = base_bag->find_unchanged(path, key, is_base_hash_compared))
+                        return prefetched_item_type{std::move(key), prefetched_content_t(*stored)};
+
+                return prefetched_item_type{std::move(key), prefetched_content_t(path, is_hashed)};
+            },
+            [](const prefetched_item_type &p_item)
+            { return p_item.second.in_memory_byte_count(); },
+            job_count,
+            in_flight_byte_limit);
+
+        write_bag(prefetcher.begin(), prefetcher.end());
+    };
+
+    if (shard_byte_count == 0)
+    {
+        pack_paths(input_regular_file_paths, output_path);
+        report_stats();
+        return 0;
+    }
+
+    // Split the files into shards of about the shard size, each a bag of its own, then map their keys in the manifest.
+    std::vector<std::vector<std::filesystem::path>> shard_paths(1);
+    libbag::size_type current_shard_byte_count = 0;
+    for (const auto &path : input_regular_file_paths)
+    {
+        const libbag::size_type byte_count = std::filesystem::file_size(path);
+        if (current_shard_byte_count != 0 && current_shard_byte_count + byte_count > shard_byte_count)
+        {
+            shard_paths.emplace_back();
+            current_shard_byte_count = 0;
+        }
+        shard_paths.back().push_back(path);
+        current_shard_byte_count += byte_count;
+    }
+
+    std::vector<libbag::mapped_bag_t> shards;
+    for (libbag::size_type shard = 0; shard < shard_paths.size(); ++shard)
+    {
+        const auto shard_path = libbag::get_shard_path(output_path, shard);
+        pack_paths(shard_paths[shard], shard_path);
+        shards.emplace_back(shard_path, libbag::access_advice_t::sequential);
+    }
+
+    const std::vector<libbag::bag_type> shard_bags(shards.begin(), shards.end());
+    libbag::file_sink_t manifest_file(output_path);
+    libbag::buffered_sink_t manifest_sink(manifest_file);
+    libbag::pack_options_t manifest_options;
+    manifest_options.checksum = options.checksum;
+    libbag::pack_manifest(shard_bags, manifest_sink, manifest_options);
+    report_stats();
 
     return 0;
 }
 catch (const std::exception &e)
 {
     std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
 }
\ No newline at end of file
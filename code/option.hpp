@@ -0,0 +1,41 @@
+#ifndef LIBBAG_CODE_OPTION_HPP
+#define LIBBAG_CODE_OPTION_HPP
+
+#include <charconv>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <libbag.hpp>
+
+/// Parse the value of an option as a count, throwing for a missing value as for an invalid one.
+inline auto parse_count(std::string_view p_option, const char *p_value) -> libbag::size_type
+{
+    libbag::size_type count = 0;
+    const std::string_view value(p_value == nullptr ? "" : p_value);
+    const auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), count);
+    if (value.empty() || error != std::errc() || end != value.data() + value.size())
+    {
+        std::stringstream message;
+        message << "Invalid value for option '" << p_option << "'.";
+        throw std::runtime_error(message.str());
+    }
+    return count;
+}
+
+/// Parse the value of an option as an I/O backend, throwing for a missing value as for an invalid one.
+inline auto parse_io_backend(std::string_view p_option, const char *p_value) -> libbag::io_backend_t
+{
+    const std::string_view value(p_value == nullptr ? "" : p_value);
+    if (value == "threads")
+        return libbag::io_backend_t::threads;
+    if (value == "uring")
+        return libbag::io_backend_t::uring;
+    if (value == "auto")
+        return libbag::io_backend_t::automatic;
+
+    std::stringstream message;
+    message << "Invalid value for option '" << p_option << "'.";
+    throw std::runtime_error(message.str());
+}
+
+#endif // LIBBAG_CODE_OPTION_HPP
@@ -1,62 +1,166 @@
 #include <iostream>
 #include <libbag.hpp>
+#include "option.hpp"
 #include <filesystem>
 #include <iterator>
 #include <fstream>
 #include <sstream>
 #include <map>
 #include <ranges>
-
-using unpack_result_container_type = std::map<libbag::key_type, libbag::content_type>;
+#include <optional>
 
 int main(int p_argument_count, const char *p_argument_values[])
 try
 {
     std::span<const char *> arguments{p_argument_values, static_cast<std::size_t>(p_argument_count)};
 
-    if (arguments.size() <= 1)
+    libbag::extract_options_t options;
+    bool is_verify_only = false;
+    std::optional<std::string> listed_prefix;
+    bool is_reporting_stats = false;
+    bool is_reporting_stats_json = false;
+    auto argument_it = std::next(arguments.begin());
+    for (; argument_it != arguments.end() && std::string_view(*argument_it).starts_with("-") && std::string_view(*argument_it) != "-"; ++argument_it)
+    {
+        const std::string_view option(*argument_it);
+        if (option == "-j" || option == "--jobs")
+        {
+            ++argument_it;
+            options.thread_count = parse_count(option, argument_it == arguments.end() ? nullptr : *argument_it);
+        }
+        else if (option == "--preallocate")
+            options.preallocate = true;
+        else if (option == "--io")
+        {
+            ++argument_it;
+            options.io_backend = parse_io_backend(option, argument_it == arguments.end() ? nullptr : *argument_it);
+        }
+        else if (option == "--verify")
+            is_verify_only = true;
+        else if (option == "--stats")
+            is_reporting_stats = true;
+        else if (option == "--stats-json")
+            is_reporting_stats_json = true;
+        else if (option == "--list")
+        {
+            ++argument_it;
+            if (argument_it == arguments.end())
+                throw std::runtime_error("Missing prefix for option '--list'.");
+            listed_prefix = *argument_it;
+        }
+        else
+        {
+            std::stringstream message;
+            message << "Unknown option '" << option << "'.";
+            throw std::runtime_error(message.str());
+        }
+    }
+
+    if (argument_it == arguments.end())
     {
-        std::cout << "usage: unbag {bags...}" << std::endl;
+        std::cout << "usage: unbag [-j N] [--preallocate] [--io {threads|uring|auto}] [--verify] [--list PREFIX] [--stats] [--stats-json] {bags...}" << std::endl
+                  << "A bag path of '-' reads a streamed bag from the standard input." << std::endl;
         return 0;
     }
 
-    for (const auto bag_path_c_str : arguments | std::views::drop(1))
+    bool is_corrupted = false;
+    libbag::stats_observer_t observer;
+    for (const auto bag_path_c_str : std::ranges::subrange(argument_it, arguments.end()))
     {
+        if (std::string_view(bag_path_c_str) == "-")
+        {
+            if (listed_prefix)
+                throw std::runtime_error("Cannot list a streamed bag from the standard input.");
+
+            if (is_verify_only)
+            {
+                try
+                {
+                    libbag::stream_unpack(std::cin, [](const libbag::stream_chunk_t &) {}, {.verify_mode = libbag::verify_mode_t::all});
+                }
+                catch (const std::runtime_error &e)
+                {
+                    std::cerr << "-: " << e.what() << std::endl;
+                    is_corrupted = true;
+                }
+                continue;
+            }
+
+            libbag::extract_stream(std::cin, std::filesystem::current_path(), options, observer);
+            continue;
+        }
+
         std::filesystem::path path(bag_path_c_str);
         if (!std::filesystem::exists(path))
             continue;
 
         path.make_preferred();
 
-        std::basic_ifstream<libbag::unit_type> input_file(path.c_str(), std::ios::binary | std::ios::ate);
-        std::streamsize size = input_file.tellg();
-        input_file.seekg(0, std::ios::beg);
-
-        libbag::unit_vector_type input_content(size);
-        if (!input_file.read(input_content.data(), size))
+        if (listed_prefix)
         {
-            std::stringstream message;
-            message << "Fail to read the content of the file '" << bag_path_c_str << "'.";
-            throw std::runtime_error(message.str());
+            const libbag::mapped_bag_t input_bag(path, libbag::access_advice_t::random);
+            std::vector<libbag::listing_type> listings;
+            libbag::list(input_bag, *listed_prefix, std::inserter(listings, listings.end()));
+            for (const auto &[key, ordinal] : listings)
+                std::cout << key << std::endl;
+            continue;
         }
 
-        unpack_result_container_type unpacked;
-        libbag::unpack_all(libbag::bag_type(input_content.begin(), input_content.end()), std::inserter(unpacked, unpacked.end()));
+        // A manifest stands for its shards.
+        const auto advice = is_verify_only || options.thread_count <= 1 ? libbag::access_advice_t::sequential : libbag::access_advice_t::will_need;
+        const libbag::mapped_bag_t input_bag(path, advice);
+        std::optional<libbag::multi_bag_t> sharded_bag;
+        if (libbag::is_manifest(input_bag))
+            sharded_bag.emplace(path, advice);
 
-        for (const auto &[key, content] : unpacked)
+        if (is_verify_only)
         {
-            std::filesystem::path output_path(key);
-            output_path.make_preferred();
-            std::filesystem::path output_directory_path = output_path.parent_path();
-            std::filesystem::create_directories(output_directory_path);
-            std::basic_ofstream<libbag::unit_type> output_file(output_path, std::ios::binary);
-            output_file.write(content.data(), content.size_bytes());
+            // A bag whose pages are broken, or that cannot be verified, is reported and the next one is verified.
+            const auto verify_bag = [&](const std::filesystem::path &p_path, const auto &p_get_bag)
+            {
+                try
+                {
+                    for (const auto key : libbag::verify(p_get_bag()))
+                    {
+                        std::cerr << p_path.generic_string() << ": Checksum mismatch for '" << libbag::unit_string_type(key) << "'." << std::endl;
+                        is_corrupted = true;
+                    }
+                }
+                catch (const std::runtime_error &e)
+                {
+                    std::cerr << p_path.generic_string() << ": " << e.what() << std::endl;
+                    is_corrupted = true;
+                }
+            };
+
+            verify_bag(path, [&]
+                       { return input_bag.bag(); });
+            for (libbag::size_type shard = 0; sharded_bag && shard < sharded_bag->get_shard_count(); ++shard)
+                verify_bag(libbag::get_shard_path(path, shard), [&]
+                           { return sharded_bag->get_shard(shard); });
+            continue;
+        }
+
+        if (!sharded_bag)
+        {
+            libbag::extract(input_bag, std::filesystem::current_path(), options, observer);
+            continue;
         }
+
+        for (libbag::size_type shard = 0; shard < sharded_bag->get_shard_count(); ++shard)
+            libbag::extract(sharded_bag->get_shard(shard), std::filesystem::current_path(), options, observer);
     }
 
-    return 0;
+    // Report where the time went on the standard error.
+    if (is_reporting_stats)
+        observer.write_text(std::cerr);
+    if (is_reporting_stats_json)
+        observer.write_json(std::cerr);
+
+    return is_corrupted ? 1 : 0;
 }
 catch (const std::exception &e)
 {
     std::cerr << "Error: " << e.what() << std::endl;
+    return 1;
 }
\ No newline at end of file
@@ -1,12 +1,66 @@
 #ifndef LIBBAG_HPP
 #define LIBBAG_HPP
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cctype>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <cstdint>
+#include <cstring>
+#include <istream>
 #include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <ranges>
+#include <set>
 #include <ostream>
 #include <span>
 #include <stdexcept>
 #include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 #include <filesystem>
+#include <future>
+#include <system_error>
+#include <thread>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LIBBAG_HAS_SSE42_CRC32C 1
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#define LIBBAG_HAS_ARM_CRC32C 1
+#include <arm_acle.h>
+#endif
+
+#if __has_include(<sys/mman.h>) && __has_include(<unistd.h>)
+#define LIBBAG_HAS_POSIX 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <climits>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define LIBBAG_HAS_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#include <unistd.h>
+#endif
 
 /// libbag
 /// A bundling algorithm.
@@ -18,6 +72,22 @@
 /// The indices stores the location and size of each item.
 /// An item has a key and content, separated by a null byte.
 /// This also means the key with the null byte forms a C string.
+///
+/// Extended memory map:
+/// | key | null byte | content | ... | indices | pages ... | extension_t | extension byte count | metadata_t |
+///
+/// A bag with an extension is marked with extended_identifier_mark instead.
+/// The extension_t is versioned and specify the optional pages, such as the lookup page.
+/// Readers copy as much of the extension_t as they know, so fields are only ever appended.
+///
+/// With a content page, an index only covers the key and null byte of an item.
+/// The content page, parallel to the indices, locates the content instead, which items may share.
+///
+/// Streamed memory map:
+/// | stream_identifier_mark | stream_header_t | padding | key | null byte | content | ... | empty stream_header_t | indices | pages ... |
+///
+/// A streamed bag is extended, with the streamed flag, and can be unpacked in one pass from its start.
+/// The indices still locate the keys, so it is read at random like any other bag.
 
 namespace libbag
 {
@@ -40,6 +110,203 @@ namespace libbag
 
     constexpr const unit_type null_unit = '\0';
     constexpr const size_type identifier_mark = 0xBABAFAFA;
+    constexpr const size_type extended_identifier_mark = 0xBABAFAFB;
+    constexpr const size_type stream_identifier_mark = 0xBABAFAFC;
+    constexpr const size_type format_version = 1;
+
+    /// A fast non-cryptographic hash, stable across platforms as it is part of the format.
+    /// It takes the total byte count up front, so contents can be hashed in chunks.
+    class units_hasher_t
+    {
+    private:
+        static constexpr size_type prime_1 = 0x9E3779B185EBCA87;
+        static constexpr size_type prime_2 = 0xC2B2AE3D27D4EB4F;
+
+        size_type hash;
+        unit_type pending_units[sizeof(size_type)] = {};
+        size_type pending_unit_count = 0;
+
+        static constexpr auto mix(size_type p_value) -> size_type
+        {
+            p_value ^= p_value >> 33;
+            p_value *= 0xFF51AFD7ED558CCD;
+            p_value ^= p_value >> 33;
+            p_value *= 0xC4CEB9FE1A85EC53;
+            p_value ^= p_value >> 33;
+            return p_value;
+        }
+
+        /// Load up to a word in little endian.
+        static constexpr auto load(const unit_type *p_units, size_type p_count) -> size_type
+        {
+            size_type word = 0;
+            if (!std::is_constant_evaluated() && p_count == sizeof(size_type) && std::endian::native == std::endian::little)
+            {
+                std::memcpy(&word, p_units, sizeof(word));
+                return word;
+            }
+
+            for (size_type i = 0; i < p_count; ++i)
+                word |= static_cast<size_type>(static_cast<unsigned char>(p_units[i])) << (i * 8);
+            return word;
+        }
+
+        constexpr auto consume(size_type p_word) -> void
+        {
+            hash ^= p_word * prime_1;
+            hash = ((hash << 31) | (hash >> 33)) * prime_2;
+        }
+
+    public:
+        constexpr explicit units_hasher_t(size_type p_byte_count, size_type p_seed = 0)
+            : hash(prime_2 ^ p_seed ^ (p_byte_count * prime_1)) {}
+
+        constexpr auto update(unit_span_type p_units) -> units_hasher_t &
+        {
+            size_type offset = 0;
+            if (pending_unit_count != 0)
+            {
+                for (; offset < p_units.size() && pending_unit_count < sizeof(size_type); ++offset)
+                    pending_units[pending_unit_count++] = p_units[offset];
+                if (pending_unit_count < sizeof(size_type))
+                    return *this;
+
+                consume(load(pending_units, sizeof(size_type)));
+                pending_unit_count = 0;
+            }
+
+            for (; offset + sizeof(size_type) <= p_units.size(); offset += sizeof(size_type))
+                consume(load(p_units.data() + offset, sizeof(size_type)));
+
+            for (; offset < p_units.size(); ++offset)
+                pending_units[pending_unit_count++] = p_units[offset];
+
+            return *this;
+        }
+
+        constexpr auto finish() const -> size_type
+        {
+            size_type result = hash;
+            if (pending_unit_count != 0)
+                result ^= load(pending_units, pending_unit_count) * prime_2;
+            return mix(result);
+        }
+    };
+
+    constexpr auto hash_units(unit_span_type p_units, size_type p_seed = 0) -> size_type
+    {
+        return units_hasher_t(p_units.size(), p_seed).update(p_units).finish();
+    }
+
+    /// Identify a content by its size and a 128-bit hash.
+    struct content_hash_t
+    {
+        size_type byte_count;
+        size_type low;
+        size_type high;
+
+        auto operator==(const content_hash_t &) const -> bool = default;
+    };
+
+    constexpr const size_type content_hash_high_seed = 0x5851F42D4C957F2D;
+
+    struct content_hash_hasher_t
+    {
+        auto operator()(const content_hash_t &p_hash) const -> std::size_t { return static_cast<std::size_t>(p_hash.low); }
+    };
+
+    /// CRC32C (Castagnoli) tables for slicing by 8.
+    constexpr auto make_crc32c_tables() -> std::array<std::array<uint32_t, 256>, 8>
+    {
+        std::array<std::array<uint32_t, 256>, 8> tables{};
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+            tables[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; ++i)
+            for (size_type slice = 1; slice < 8; ++slice)
+                tables[slice][i] = (tables[slice - 1][i] >> 8) ^ tables[0][tables[slice - 1][i] & 0xFF];
+        return tables;
+    }
+
+    inline constexpr auto crc32c_tables = make_crc32c_tables();
+
+    template <typename = void>
+    auto crc32c_portable(uint32_t p_crc, const unit_type *p_units, size_type p_count) -> uint32_t
+    {
+        for (; p_count >= 8; p_units += 8, p_count -= 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, p_units, sizeof(word));
+            if constexpr (std::endian::native == std::endian::big)
+                word = ((word & 0xFF) << 56) | ((word & 0xFF00) << 40) | ((word & 0xFF0000) << 24) | ((word & 0xFF000000) << 8) |
+                       ((word >> 8) & 0xFF000000) | ((word >> 24) & 0xFF0000) | ((word >> 40) & 0xFF00) | (word >> 56);
+            word ^= p_crc;
+            p_crc = crc32c_tables[7][word & 0xFF] ^ crc32c_tables[6][(word >> 8) & 0xFF] ^
+                    crc32c_tables[5][(word >> 16) & 0xFF] ^ crc32c_tables[4][(word >> 24) & 0xFF] ^
+                    crc32c_tables[3][(word >> 32) & 0xFF] ^ crc32c_tables[2][(word >> 40) & 0xFF] ^
+                    crc32c_tables[1][(word >> 48) & 0xFF] ^ crc32c_tables[0][word >> 56];
+        }
+        for (; p_count != 0; ++p_units, --p_count)
+            p_crc = (p_crc >> 8) ^ crc32c_tables[0][(p_crc ^ static_cast<unsigned char>(*p_units)) & 0xFF];
+        return p_crc;
+    }
+
+#if LIBBAG_HAS_SSE42_CRC32C
+    template <typename = void>
+    __attribute__((target("sse4.2"))) auto crc32c_hardware(uint32_t p_crc, const unit_type *p_units, size_type p_count) -> uint32_t
+    {
+        uint64_t crc = p_crc;
+        for (; p_count >= 8; p_units += 8, p_count -= 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, p_units, sizeof(word));
+            crc = _mm_crc32_u64(crc, word);
+        }
+        for (; p_count != 0; ++p_units, --p_count)
+            crc = _mm_crc32_u8(static_cast<uint32_t>(crc), static_cast<unsigned char>(*p_units));
+        return static_cast<uint32_t>(crc);
+    }
+#elif LIBBAG_HAS_ARM_CRC32C
+    template <typename = void>
+    auto crc32c_hardware(uint32_t p_crc, const unit_type *p_units, size_type p_count) -> uint32_t
+    {
+        for (; p_count >= 8; p_units += 8, p_count -= 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, p_units, sizeof(word));
+            p_crc = __crc32cd(p_crc, word);
+        }
+        for (; p_count != 0; ++p_units, --p_count)
+            p_crc = __crc32cb(p_crc, static_cast<unsigned char>(*p_units));
+        return p_crc;
+    }
+#endif
+
+    /// CRC32C of units, continuing from the CRC32C of the units before them.
+    /// It uses the CPU instructions when there are, and tables otherwise.
+    template <typename = void>
+    auto crc32c(unit_span_type p_units, uint32_t p_crc = 0) -> uint32_t
+    {
+        const uint32_t crc = ~p_crc;
+#if LIBBAG_HAS_SSE42_CRC32C
+        static const bool has_hardware = __builtin_cpu_supports("sse4.2");
+        if (has_hardware)
+            return ~crc32c_hardware(crc, p_units.data(), p_units.size());
+#elif LIBBAG_HAS_ARM_CRC32C
+        return ~crc32c_hardware(crc, p_units.data(), p_units.size());
+#endif
+        return ~crc32c_portable(crc, p_units.data(), p_units.size());
+    }
+
+    template <typename = void>
+    auto hash_content(content_type p_content) -> content_hash_t
+    {
+        return content_hash_t{p_content.size(), hash_units(p_content), hash_units(p_content, content_hash_high_seed)};
+    }
 
     template <typename T>
     concept unique_object_representations_c = std::has_unique_object_representations_v<T>;
@@ -66,6 +333,133 @@ namespace libbag
     };
     static_assert(unique_object_representations_c<metadata_t>);
 
+    struct extension_t
+    {
+        size_type version;
+        size_type flags;
+        slice_t lookup_page;
+        slice_t encoding_page;
+        slice_t content_page;
+        slice_t checksum_page;
+        /// CRC32C of the bytes from the index page to the end of the checksum page, when there is one.
+        size_type page_checksum;
+        /// Every stored content starts at a multiple of this many bytes from the origin, zero when unaligned.
+        size_type content_alignment;
+        /// The footer of the generation this one was appended to, from its index page to its metadata_t,
+        /// which are the last bytes of the bag before the append.
+        slice_t previous_footer;
+        slice_t stamp_page;
+        slice_t key_page;
+        /// The keys removed from the generations before this one, each ending with a null byte.
+        slice_t tombstone_page;
+
+        constexpr extension_t()
+            : version(format_version), flags(0), lookup_page(0, 0), encoding_page(0, 0), content_page(0, 0), checksum_page(0, 0), page_checksum(0), content_alignment(0), previous_footer(0, 0), stamp_page(0, 0), key_page(0, 0), tombstone_page(0, 0) {}
+    };
+    static_assert(unique_object_representations_c<extension_t>);
+
+    /// Flags of features a reader must understand to read the bag.
+    constexpr const size_type encoded_flag = 1 << 0;
+    constexpr const size_type separated_flag = 1 << 1;
+    constexpr const size_type streamed_flag = 1 << 2;
+    /// The contents are shard_location_t of items in shards, rather than contents of their own.
+    constexpr const size_type manifest_flag = 1 << 3;
+    /// The footer is a generation appended to the one at the previous footer, whose items it shadows by key.
+    constexpr const size_type chained_flag = 1 << 4;
+    constexpr const size_type supported_flags = encoded_flag | separated_flag | streamed_flag | manifest_flag | chained_flag;
+
+    /// How the content of an item is encoded, parallel to the indices in the encoding page.
+    /// The byte count is the one of the decoded content.
+    struct encoding_t
+    {
+        size_type codec;
+        size_type byte_count;
+
+        constexpr encoding_t(size_type p_codec, size_type p_byte_count)
+            : codec(p_codec), byte_count(p_byte_count) {}
+    };
+    static_assert(unique_object_representations_c<encoding_t>);
+
+    /// CRC32C of the key with its null byte and of the stored content of an item, parallel to the indices in the checksum page.
+    struct checksum_t
+    {
+        uint32_t key;
+        uint32_t content;
+
+        constexpr checksum_t(uint32_t p_key, uint32_t p_content)
+            : key(p_key), content(p_content) {}
+    };
+    static_assert(unique_object_representations_c<checksum_t>);
+
+    /// The header before each item of a streamed bag, so it can be unpacked in one pass.
+    /// A header with a zero key byte count ends the items.
+    struct stream_header_t
+    {
+        size_type padding_byte_count;
+        /// With the null byte.
+        size_type key_byte_count;
+        /// Of the stored content.
+        size_type content_byte_count;
+        encoding_t encoding;
+        checksum_t checksum;
+        size_type flags;
+
+        constexpr stream_header_t()
+            : padding_byte_count(0), key_byte_count(0), content_byte_count(0), encoding(0, 0), checksum(0, 0), flags(0) {}
+    };
+    static_assert(unique_object_representations_c<stream_header_t>);
+
+    /// The checksum of a stream header is set.
+    constexpr const size_type checksummed_stream_flag = 1 << 0;
+
+    /// What an item was packed from, parallel to the indices in the stamp page, to tell whether it changed since.
+    /// A zero modification time or content hash is unknown.
+    struct stamp_t
+    {
+        /// Nanoseconds since the epoch.
+        int64_t modification_time = 0;
+        /// Of the decoded content, whose byte count is the size.
+        content_hash_t content_hash{0, 0, 0};
+
+        auto has_content_hash() const -> bool { return content_hash.low != 0 || content_hash.high != 0; }
+    };
+    static_assert(unique_object_representations_c<stamp_t>);
+
+    /// Where an item of a sharded bag is, as the content of its key in the manifest.
+    struct shard_location_t
+    {
+        size_type shard;
+        size_type ordinal;
+        /// The index of the item in the shard, to tell whether the shard is still the one the manifest was packed from.
+        slice_t index;
+
+        constexpr shard_location_t(size_type p_shard, size_type p_ordinal, slice_t p_index)
+            : shard(p_shard), ordinal(p_ordinal), index(p_index) {}
+    };
+    static_assert(unique_object_representations_c<shard_location_t>);
+
+    enum class verify_mode_t
+    {
+        /// Never verify checksums.
+        off,
+        /// Verify the checksums of the items being unpacked.
+        on_access,
+        /// Verify the pages and every item whenever the bag is unpacked.
+        all
+    };
+
+    /// A slot of the open addressing hash table in the lookup page.
+    /// The ordinal is one-based so zero marks an empty slot.
+    struct lookup_slot_t
+    {
+        uint32_t tag;
+        uint32_t ordinal;
+
+        constexpr lookup_slot_t(uint32_t p_tag, uint32_t p_ordinal)
+            : tag(p_tag), ordinal(p_ordinal) {}
+    };
+    static_assert(unique_object_representations_c<lookup_slot_t>);
+
     template <typename T>
     class memory_view_iterator_t
     {
@@ -142,22 +536,27 @@ namespace libbag
     template <typename = void>
     auto operator<<(std::basic_ostream<unit_type> &p_stream, const unit_span_type &p_units) -> std::basic_ostream<unit_type> &
     {
-        for (const auto &e : p_units)
-            p_stream << e;
-
-        return p_stream;
+        return p_stream.write(p_units.data(), static_cast<std::streamsize>(p_units.size()));
     }
 
+    /// View the object representation of an object.
     template <unique_object_representations_c T>
-    auto serialize(std::basic_ostream<unit_type> &p_stream, const T &p_object) -> std::basic_ostream<unit_type> &
+    auto as_units(const T &p_object) -> unit_span_type
     {
-        const auto object_unit_pointer = reinterpret_cast<const unit_type *>(&p_object);
-        const auto object_end_unit_pointer = object_unit_pointer + sizeof(p_object);
+        return unit_span_type(reinterpret_cast<const unit_type *>(&p_object), sizeof(p_object));
+    }
 
-        for (auto it = object_unit_pointer; it != object_end_unit_pointer; ++it)
-            p_stream << *it;
+    /// View the object representation of contiguous objects.
+    template <unique_object_representations_c T>
+    auto as_units(std::span<const T> p_objects) -> unit_span_type
+    {
+        return unit_span_type(reinterpret_cast<const unit_type *>(p_objects.data()), p_objects.size_bytes());
+    }
 
-        return p_stream;
+    template <unique_object_representations_c T>
+    auto serialize(std::basic_ostream<unit_type> &p_stream, const T &p_object) -> std::basic_ostream<unit_type> &
+    {
+        return p_stream << as_units(p_object);
     }
 
     template <typename = void>
@@ -172,6 +571,18 @@ namespace libbag
         return serialize(p_stream, p_slice_t);
     }
 
+    template <typename = void>
+    auto operator<<(std::basic_ostream<unit_type> &p_stream, const extension_t &p_extension) -> std::basic_ostream<unit_type> &
+    {
+        return serialize(p_stream, p_extension);
+    }
+
+    template <typename = void>
+    auto operator<<(std::basic_ostream<unit_type> &p_stream, const lookup_slot_t &p_slot) -> std::basic_ostream<unit_type> &
+    {
+        return serialize(p_stream, p_slot);
+    }
+
     template <typename T>
     concept slice_iterator_c = std::same_as<std::iter_value_t<T>, slice_t>;
 
@@ -184,142 +595,4325 @@ namespace libbag
     template <slice_container_c C>
     auto operator<<(std::basic_ostream<unit_type> &p_stream, const C &p_slices) -> std::basic_ostream<unit_type> &
     {
+        if constexpr (std::ranges::contiguous_range<C>)
+            return p_stream << as_units(slice_view_type(p_slices));
+
         for (const auto &slice : p_slices)
             p_stream << slice;
 
         return p_stream;
     }
 
+    /// An output sink receives the bag in blocks.
     template <typename T>
-    concept packing_iterator_c = requires {
-        requires std::is_convertible_v<decltype(std::get<0>(std::declval<std::iter_value_t<T>>())), key_type>;
-        requires std::is_convertible_v<decltype(std::get<1>(std::declval<std::iter_value_t<T>>())), content_type>;
+    concept output_sink_c = requires(T &p_sink, unit_span_type p_units) { p_sink.write(p_units); };
+
+    /// A gather output sink receives several blocks in one call.
+    template <typename T>
+    concept gather_output_sink_c = output_sink_c<T> && requires(T &p_sink, std::span<const unit_span_type> p_parts) { p_sink.write_gather(p_parts); };
+
+    /// A transfer output sink copies a region of a file descriptor, possibly without leaving the kernel.
+    template <typename T>
+    concept transfer_output_sink_c = output_sink_c<T> && requires(T &p_sink, int p_descriptor, size_type p_byte_offset, size_type p_byte_count) { p_sink.transfer(p_descriptor, p_byte_offset, p_byte_count); };
+
+    template <output_sink_c S>
+    auto write_parts(S &p_sink, std::span<const unit_span_type> p_parts) -> void
+    {
+        if constexpr (gather_output_sink_c<S>)
+            p_sink.write_gather(p_parts);
+        else
+            for (const auto &part : p_parts)
+                p_sink.write(part);
+    }
+
+    template <output_sink_c S>
+    auto write_parts(S &p_sink, std::initializer_list<unit_span_type> p_parts) -> void
+    {
+        write_parts(p_sink, std::span<const unit_span_type>(p_parts.begin(), p_parts.size()));
+    }
+
+    class ostream_sink_t
+    {
+    private:
+        std::basic_ostream<unit_type> &stream;
+
+    public:
+        explicit ostream_sink_t(std::basic_ostream<unit_type> &p_stream)
+            : stream(p_stream) {}
+
+        auto write(unit_span_type p_units) -> void
+        {
+            if (!(stream << p_units))
+                throw std::runtime_error("Fail to write to the stream.");
+        }
     };
 
-    template <packing_iterator_c Iterator>
-    auto pack(Iterator p_begin, Iterator p_end, std::basic_ostream<unit_type> &p_output) -> void
+    /// A sink over a preallocated buffer.
+    class buffer_sink_t
     {
-        std::vector<slice_t> indices;
-        size_type current_byte_offset = 0;
+    private:
+        std::span<unit_type> buffer;
+        size_type byte_count = 0;
 
-        for (auto it = p_begin; it != p_end; ++it)
+    public:
+        explicit buffer_sink_t(std::span<unit_type> p_buffer)
+            : buffer(p_buffer) {}
+
+        auto write(unit_span_type p_units) -> void
         {
-            const auto &[raw_key, raw_content] = *it;
-            const auto key = key_type(raw_key);
-            const auto content = content_type(raw_content);
+            if (p_units.size() > buffer.size() - byte_count)
+                throw std::length_error("Buffer is too small.");
 
-            p_output << key << null_unit << content;
+            std::copy(p_units.begin(), p_units.end(), buffer.begin() + byte_count);
+            byte_count += p_units.size();
+        }
+
+        auto written() const -> unit_span_type { return unit_span_type(buffer.data(), byte_count); }
+    };
+
+#if LIBBAG_HAS_POSIX
+    /// A sink over a raw file descriptor, which it does not own.
+    class descriptor_sink_t
+    {
+    private:
+        int descriptor;
+
+    public:
+        explicit descriptor_sink_t(int p_descriptor)
+            : descriptor(p_descriptor) {}
 
-            const size_type byte_count = (key.size()) * sizeof(typename decltype(key)::value_type) + sizeof(null_unit) + content.size() * sizeof(typename decltype(content)::value_type);
-            const auto index = slice_t(current_byte_offset, byte_count);
-            indices.push_back(index);
-            current_byte_offset += byte_count;
+        auto get_descriptor() const -> int { return descriptor; }
+
+        auto write(unit_span_type p_units) -> void
+        {
+            while (!p_units.empty())
+            {
+                const auto result = ::write(descriptor, p_units.data(), p_units.size());
+                if (result < 0 && errno == EINTR)
+                    continue;
+                if (result < 0)
+                    throw std::system_error(errno, std::generic_category(), "Fail to write to the descriptor");
+
+                p_units = p_units.subspan(static_cast<size_type>(result));
+            }
         }
 
-        p_output << indices;
+        auto write_gather(std::span<const unit_span_type> p_parts) -> void
+        {
+            std::array<iovec, 64> vectors;
+            while (!p_parts.empty())
+            {
+                size_type vector_count = 0;
+                for (; vector_count < vectors.size() && vector_count < p_parts.size() && vector_count < IOV_MAX; ++vector_count)
+                    vectors[vector_count] = iovec{const_cast<unit_type *>(p_parts[vector_count].data()), p_parts[vector_count].size()};
 
-        const size_type indices_byte_count = indices.size() * sizeof(typename decltype(indices)::value_type);
-        const metadata_t data = metadata_t(identifier_mark, current_byte_offset + indices_byte_count + sizeof(metadata_t), slice_t(current_byte_offset, indices_byte_count));
-        p_output << data;
-    }
+                auto result = ::writev(descriptor, vectors.data(), static_cast<int>(vector_count));
+                if (result < 0 && errno == EINTR)
+                    continue;
+                if (result < 0)
+                    throw std::system_error(errno, std::generic_category(), "Fail to write to the descriptor");
 
-    template <typename T>
-    concept packing_container_c = requires {
-        requires packing_iterator_c<decltype(std::declval<T>().begin())>;
-        requires packing_iterator_c<decltype(std::declval<T>().end())>;
+                // Skip fully written parts and finish a partially written one directly.
+                auto written_byte_count = static_cast<size_type>(result);
+                while (!p_parts.empty() && written_byte_count >= p_parts.front().size())
+                {
+                    written_byte_count -= p_parts.front().size();
+                    p_parts = p_parts.subspan(1);
+                }
+                if (written_byte_count != 0)
+                {
+                    write(p_parts.front().subspan(written_byte_count));
+                    p_parts = p_parts.subspan(1);
+                }
+            }
+        }
+
+        /// Copy a region of another descriptor after what is written so far.
+        /// It tries copy_file_range, then sendfile, then falls back to a bounded copy.
+        auto transfer(int p_descriptor, size_type p_byte_offset, size_type p_byte_count) -> void
+        {
+#if defined(__linux__)
+            for (bool is_copy_file_range_supported = true; p_byte_count != 0;)
+            {
+                auto offset = static_cast<off_t>(p_byte_offset);
+                const auto result = is_copy_file_range_supported
+                                        ? ::copy_file_range(p_descriptor, &offset, descriptor, nullptr, p_byte_count, 0)
+                                        : ::sendfile(descriptor, p_descriptor, &offset, p_byte_count);
+                if (result < 0 && errno == EINTR)
+                    continue;
+                if (result < 0 && is_copy_file_range_supported && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF))
+                {
+                    is_copy_file_range_supported = false;
+                    continue;
+                }
+                if (result < 0 && (errno == EINVAL || errno == ENOSYS))
+                    break;
+                if (result < 0)
+                    throw std::system_error(errno, std::generic_category(), "Fail to transfer to the descriptor");
+                if (result == 0)
+                    throw std::runtime_error("Unexpected end of the transferred file.");
+
+                p_byte_offset += static_cast<size_type>(result);
+                p_byte_count -= static_cast<size_type>(result);
+            }
+#endif
+
+            std::array<unit_type, 1 << 16> buffer;
+            while (p_byte_count != 0)
+            {
+                const auto result = ::pread(p_descriptor, buffer.data(), std::min<size_type>(buffer.size(), p_byte_count), static_cast<off_t>(p_byte_offset));
+                if (result < 0 && errno == EINTR)
+                    continue;
+                if (result < 0)
+                    throw std::system_error(errno, std::generic_category(), "Fail to read the transferred file");
+                if (result == 0)
+                    throw std::runtime_error("Unexpected end of the transferred file.");
+
+                write(unit_span_type(buffer.data(), static_cast<size_type>(result)));
+                p_byte_offset += static_cast<size_type>(result);
+                p_byte_count -= static_cast<size_type>(result);
+            }
+        }
     };
 
-    auto pack(const packing_container_c auto &p_container, std::basic_ostream<unit_type> &p_output) -> void
+    /// A descriptor sink owning a newly created file.
+    enum class file_sink_mode_t
     {
-        pack(p_container.begin(), p_container.end(), p_output);
-    }
+        /// Create the file, or empty it.
+        truncate,
+        /// Write after the end of an existing file.
+        append
+    };
 
-    using attribute_type = std::pair<key_type, slice_t>;
+    class file_sink_t : public descriptor_sink_t
+    {
+    public:
+        explicit file_sink_t(const std::filesystem::path &p_path, file_sink_mode_t p_mode = file_sink_mode_t::truncate)
+            : descriptor_sink_t(::open(p_path.c_str(), p_mode == file_sink_mode_t::truncate ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_WRONLY | O_CLOEXEC, 0644))
+        {
+            if (get_descriptor() < 0)
+                throw std::system_error(errno, std::generic_category(), "Fail to open the file '" + p_path.string() + "'");
 
-    template <typename T>
-    concept attribute_container_c = requires {
-        std::declval<std::insert_iterator<T>>() = std::declval<attribute_type>();
+            // Not O_APPEND, which copy_file_range refuses.
+            if (p_mode == file_sink_mode_t::append && ::lseek(get_descriptor(), 0, SEEK_END) < 0)
+            {
+                const int error = errno;
+                ::close(get_descriptor());
+                throw std::system_error(error, std::generic_category(), "Fail to seek the file '" + p_path.string() + "'");
+            }
+        }
+
+        file_sink_t(const file_sink_t &) = delete;
+        auto operator=(const file_sink_t &) -> file_sink_t & = delete;
+
+        ~file_sink_t()
+        {
+            if (get_descriptor() >= 0)
+                ::close(get_descriptor());
+        }
     };
+#endif
 
-    template <attribute_container_c C>
-    auto get_attributes(const bag_type &p_bag, std::insert_iterator<C> p_output) -> const unit_type *
+    /// A sink coalescing small blocks into a buffer and passing large blocks through without a copy.
+    template <output_sink_c S>
+    class buffered_sink_t
     {
-        const auto bag_unit_pointer = static_cast<const unit_type *>(p_bag.data());
-        const auto bag_byte_count = p_bag.size_bytes();
-        const auto bag_end_unit_pointer = bag_unit_pointer + bag_byte_count;
+    private:
+        S &sink;
+        unit_vector_type buffer;
+        size_type byte_count = 0;
 
-        // Get metadata_t.
-        const metadata_t *data = reinterpret_cast<const metadata_t *>(bag_end_unit_pointer - sizeof(metadata_t));
-        if (data->mark != identifier_mark)
-            throw std::runtime_error("Invalid marking.");
+    public:
+        explicit buffered_sink_t(S &p_sink, size_type p_buffer_byte_count = 1 << 20)
+            : sink(p_sink), buffer(p_buffer_byte_count) {}
 
-        const auto origin = bag_end_unit_pointer - data->true_byte_count;
+        auto write(unit_span_type p_units) -> void
+        {
+            if (p_units.size() <= buffer.size() - byte_count)
+            {
+                std::copy(p_units.begin(), p_units.end(), buffer.begin() + byte_count);
+                byte_count += p_units.size();
+                return;
+            }
 
-        // Get indices.
-        const auto indices = slice_view_type(
-            memory_view_iterator_t(reinterpret_cast<const slice_t *>(origin + data->index_page.byte_offset)),
-            memory_view_iterator_t(reinterpret_cast<const slice_t *>(origin + data->index_page.byte_offset + data->index_page.byte_count)));
+            write_parts(sink, {unit_span_type(buffer.data(), byte_count), p_units});
+            byte_count = 0;
+        }
 
-        // Get attributes.
-        for (const auto &index : indices)
+        auto write_gather(std::span<const unit_span_type> p_parts) -> void
         {
-            if ((index.byte_offset) >= data->true_byte_count)
-                throw std::runtime_error("Invalid byte offset.");
-            if ((index.byte_offset + index.byte_count) >= data->true_byte_count)
-                throw std::runtime_error("Invalid byte count.");
+            for (const auto &part : p_parts)
+                write(part);
+        }
 
-            const auto key_unit_pointer = origin + index.byte_offset;
-            p_output = attribute_type(key_type(key_unit_pointer), index);
+        auto transfer(int p_descriptor, size_type p_byte_offset, size_type p_byte_count) -> void
+            requires transfer_output_sink_c<S>
+        {
+            flush_buffer();
+            sink.transfer(p_descriptor, p_byte_offset, p_byte_count);
         }
 
-        return origin;
-    }
+        auto flush_buffer() -> void
+        {
+            if (byte_count != 0)
+                sink.write(unit_span_type(buffer.data(), byte_count));
+            byte_count = 0;
+        }
 
-    using unpack_result_type = std::pair<key_type, content_type>;
+        auto flush() -> void
+        {
+            flush_buffer();
+
+            if constexpr (requires { sink.flush(); })
+                sink.flush();
+        }
+    };
 
+    /// A content source provides content of a known size in chunks, so it needs not to be in memory.
     template <typename T>
-    concept unpack_result_container_c = requires {
-        std::declval<std::insert_iterator<T>>() = std::declval<unpack_result_type>();
+    concept content_source_c = requires(const T &p_source, size_type p_byte_offset, std::span<unit_type> p_buffer) {
+        { p_source.size() } -> std::convertible_to<size_type>;
+        { p_source.read(p_byte_offset, p_buffer) } -> std::convertible_to<size_type>;
     };
 
-    template <typename F>
-    concept unpack_filter_predicate_c = std::predicate<F, attribute_type>;
+    /// A content source backed by a file descriptor, which sinks may copy from in the kernel.
+    /// A negative descriptor means the content is not backed by a file.
+    /// The content starts at `get_descriptor_offset()` in the descriptor when the source has it, and at zero otherwise.
+    template <typename T>
+    concept descriptor_content_source_c = content_source_c<T> && requires(const T &p_source) {
+        { p_source.get_descriptor() } -> std::convertible_to<int>;
+    };
 
-    template <unpack_result_container_c C, unpack_filter_predicate_c F>
-    auto unpack(const bag_type &p_bag, F p_filter_predicate, std::insert_iterator<C> p_output) -> void
+    /// A content source that knows the hash of its content, such as one hashed ahead on another thread.
+    template <typename T>
+    concept hashed_content_source_c = content_source_c<T> && requires(const T &p_source) {
+        { p_source.get_content_hash() } -> std::convertible_to<std::optional<content_hash_t>>;
+    };
+
+    /// A content source that knows what its content was packed from.
+    template <typename T>
+    concept stamped_content_source_c = content_source_c<T> && requires(const T &p_source) {
+        { p_source.get_stamp() } -> std::convertible_to<std::optional<stamp_t>>;
+    };
+
+    /// A content source that may hold a content as stored in a bag, which is packed again without encoding.
+    /// A content without a stored encoding is packed like any other.
+    template <typename T>
+    concept stored_content_source_c = content_source_c<T> && requires(const T &p_source) {
+        { p_source.get_stored_encoding() } -> std::convertible_to<std::optional<encoding_t>>;
+        { p_source.get_stored_checksum() } -> std::convertible_to<std::optional<uint32_t>>;
+    };
+
+    /// The content of an item as stored in a bag, to pack it into another bag without decoding.
+    /// Sinks copy it in the kernel when it comes with the descriptor of the bag file.
+    class stored_item_source_t
     {
-        std::vector<attribute_type> attributes;
-        const auto origin = get_attributes(p_bag, std::inserter(attributes, attributes.end()));
+    private:
+        content_type stored;
+        encoding_t encoding;
+        std::optional<uint32_t> checksum;
+        std::optional<stamp_t> stamp;
+        int descriptor;
+        size_type descriptor_offset;
 
-        const auto bag_unit_pointer = static_cast<const unit_type *>(p_bag.data());
-        const auto bag_end_unit_pointer = bag_unit_pointer + p_bag.size_bytes();
-        for (const auto &attribute : attributes)
+    public:
+        stored_item_source_t(content_type p_stored, const encoding_t &p_encoding, std::optional<uint32_t> p_checksum, std::optional<stamp_t> p_stamp, int p_descriptor = -1, size_type p_descriptor_offset = 0)
+            : stored(p_stored), encoding(p_encoding), checksum(p_checksum), stamp(p_stamp), descriptor(p_descriptor), descriptor_offset(p_descriptor_offset) {}
+
+        auto size() const -> size_type { return stored.size(); }
+
+        auto read(size_type p_byte_offset, std::span<unit_type> p_buffer) const -> size_type
         {
-            if (!p_filter_predicate(attribute))
-                continue;
+            const auto byte_count = std::min<size_type>(p_buffer.size(), stored.size() - p_byte_offset);
+            std::copy_n(stored.begin() + p_byte_offset, byte_count, p_buffer.begin());
+            return byte_count;
+        }
 
-            const auto &[key, index] = attribute;
-            const auto item_unit_pointer = origin + index.byte_offset;
-            const auto key_unit_pointer = item_unit_pointer;
+        auto get_descriptor() const -> int { return descriptor; }
 
-            if (key != key_type(key_unit_pointer))
-                throw std::logic_error("Contrasting key.");
+        auto get_descriptor_offset() const -> size_type { return descriptor_offset; }
 
-            const auto content_unit_pointer = std::find(item_unit_pointer, bag_end_unit_pointer, null_unit) + sizeof(null_unit);
-            const auto content_end_unit_pointer = content_unit_pointer + index.byte_count - (key.size()) * sizeof(typename decltype(key)::value_type) - sizeof(null_unit);
-            p_output = unpack_result_type(key, content_type(
-                                                   memory_view_iterator_t(content_unit_pointer),
-                                                   memory_view_iterator_t(content_end_unit_pointer)));
-        }
-    }
+        auto get_stored_encoding() const -> std::optional<encoding_t> { return encoding; }
 
-    template <unpack_result_container_c C>
-    auto unpack_all(const bag_type &p_bag, std::insert_iterator<C> p_output) -> void
-    {
-        unpack(p_bag, [](const attribute_type &p_attribute)
-               { return true; }, p_output);
+        auto get_stored_checksum() const -> std::optional<uint32_t> { return checksum; }
+
+        auto get_stamp() const -> std::optional<stamp_t> { return stamp; }
+
+        auto set_stamp(const stamp_t &p_stamp) -> void { stamp = p_stamp; }
+    };
+
+    /// A content in memory with the stamp of what it was packed from, to keep the stamp when it is packed again.
+    class stamped_content_source_t
+    {
+    private:
+        content_type content;
+        stamp_t stamp;
+
+    public:
+        stamped_content_source_t(content_type p_content, const stamp_t &p_stamp)
+            : content(p_content), stamp(p_stamp) {}
+
+        auto size() const -> size_type { return content.size(); }
+
+        auto read(size_type p_byte_offset, std::span<unit_type> p_buffer) const -> size_type
+        {
+            const auto byte_count = std::min<size_type>(p_buffer.size(), content.size() - p_byte_offset);
+            std::copy_n(content.begin() + p_byte_offset, byte_count, p_buffer.begin());
+            return byte_count;
+        }
+
+        auto get_stamp() const -> std::optional<stamp_t> { return stamp; }
+    };
+
+    template <typename T>
+    concept packing_content_c = std::is_convertible_v<T, content_type> || content_source_c<std::remove_cvref_t<T>>;
+
+    template <typename T>
+    concept packing_iterator_c = requires {
+        requires std::is_convertible_v<decltype(std::get<0>(std::declval<std::iter_value_t<T>>())), key_type>;
+        requires packing_content_c<decltype(std::get<1>(std::declval<std::iter_value_t<T>>()))>;
+    };
+
+#if LIBBAG_HAS_POSIX
+    /// Nanoseconds since the epoch of the last modification in a file status.
+    template <typename = void>
+    auto get_modification_time(const struct stat &p_status) -> int64_t
+    {
+#if defined(__APPLE__)
+        const auto &time = p_status.st_mtimespec;
+#else
+        const auto &time = p_status.st_mtim;
+#endif
+        return static_cast<int64_t>(time.tv_sec) * 1000000000 + static_cast<int64_t>(time.tv_nsec);
+    }
+
+    /// A content source reading a file with positional reads.
+    class file_source_t
+    {
+    private:
+        int descriptor = -1;
+        size_type byte_count = 0;
+        int64_t modification_time = 0;
+
+    public:
+        explicit file_source_t(const std::filesystem::path &p_path)
+            : descriptor(::open(p_path.c_str(), O_RDONLY | O_CLOEXEC))
+        {
+            if (descriptor < 0)
+                throw std::system_error(errno, std::generic_category(), "Fail to open the file '" + p_path.string() + "'");
+
+            struct stat status;
+            if (::fstat(descriptor, &status) != 0)
+            {
+                const int error = errno;
+                ::close(descriptor);
+                throw std::system_error(error, std::generic_category(), "Fail to stat the file '" + p_path.string() + "'");
+            }
+            byte_count = static_cast<size_type>(status.st_size);
+            modification_time = get_modification_time(status);
+        }
+
+        file_source_t(const file_source_t &) = delete;
+        auto operator=(const file_source_t &) -> file_source_t & = delete;
+
+        file_source_t(file_source_t &&p_other) noexcept
+            : descriptor(std::exchange(p_other.descriptor, -1)), byte_count(p_other.byte_count), modification_time(p_other.modification_time) {}
+
+        auto operator=(file_source_t &&p_other) noexcept -> file_source_t &
+        {
+            if (this != &p_other)
+            {
+                if (descriptor >= 0)
+                    ::close(descriptor);
+                descriptor = std::exchange(p_other.descriptor, -1);
+                byte_count = p_other.byte_count;
+                modification_time = p_other.modification_time;
+            }
+            return *this;
+        }
+
+        ~file_source_t()
+        {
+            if (descriptor >= 0)
+                ::close(descriptor);
+        }
+
+        auto size() const -> size_type { return byte_count; }
+
+        auto get_descriptor() const -> int { return descriptor; }
+
+        /// The size and modification time of the file when it was opened, without a content hash.
+        auto get_stamp() const -> std::optional<stamp_t> { return stamp_t{modification_time, content_hash_t{byte_count, 0, 0}}; }
+
+        auto read(size_type p_byte_offset, std::span<unit_type> p_buffer) const -> size_type
+        {
+            while (true)
+            {
+                const auto result = ::pread(descriptor, p_buffer.data(), p_buffer.size(), static_cast<off_t>(p_byte_offset));
+                if (result < 0 && errno == EINTR)
+                    continue;
+                if (result < 0)
+                    throw std::system_error(errno, std::generic_category(), "Fail to read the file");
+                return static_cast<size_type>(result);
+            }
+        }
+    };
+
+    /// Which system interface to open, read, write and close many files with.
+    enum class io_backend_t
+    {
+        /// Plain system calls, one file after another on each thread.
+        threads,
+        /// Batches of linked operations on an io_uring, with many files in flight for each system call.
+        uring,
+        /// io_uring where the kernel allows it, and plain system calls otherwise.
+        automatic
+    };
+
+#if LIBBAG_HAS_URING
+    /// A minimal io_uring, with a table of direct descriptors so the open, read or write, and close of a file
+    /// are linked in one submission and the descriptor never reaches the process.
+    /// Every submission completes once, so waiting for as many completions as were submitted drains it.
+    /// Opens into direct descriptors must not ask for O_CLOEXEC, which the kernel refuses for them.
+    class uring_t
+    {
+    private:
+        int descriptor = -1;
+        void *rings = MAP_FAILED;
+        size_type rings_byte_count = 0;
+        void *completion_rings = MAP_FAILED;
+        size_type completion_rings_byte_count = 0;
+        io_uring_sqe *entries = static_cast<io_uring_sqe *>(MAP_FAILED);
+        size_type entries_byte_count = 0;
+
+        uint32_t *submission_tail = nullptr;
+        uint32_t *submission_array = nullptr;
+        uint32_t submission_mask = 0;
+        uint32_t submission_count = 0;
+        uint32_t *completion_head = nullptr;
+        uint32_t *completion_tail = nullptr;
+        uint32_t completion_mask = 0;
+        io_uring_cqe *completions = nullptr;
+        uint32_t local_tail = 0;
+        uint32_t pending_count = 0;
+
+        static auto map(int p_descriptor, size_type p_byte_count, off_t p_offset) -> void *
+        {
+            void *mapping = ::mmap(nullptr, p_byte_count, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, p_descriptor, p_offset);
+            if (mapping == MAP_FAILED)
+                throw std::system_error(errno, std::generic_category(), "Fail to map the io_uring");
+            return mapping;
+        }
+
+        auto release() noexcept -> void
+        {
+            if (entries != MAP_FAILED)
+                ::munmap(entries, entries_byte_count);
+            if (completion_rings != MAP_FAILED && completion_rings != rings)
+                ::munmap(completion_rings, completion_rings_byte_count);
+            if (rings != MAP_FAILED)
+                ::munmap(rings, rings_byte_count);
+            if (descriptor >= 0)
+                ::close(descriptor);
+        }
+
+    public:
+        /// Set up a ring with room for this many submissions at once, and this many direct descriptors.
+        uring_t(uint32_t p_entry_count, uint32_t p_file_count)
+        {
+            io_uring_params parameters{};
+            descriptor = static_cast<int>(::syscall(__NR_io_uring_setup, p_entry_count, &parameters));
+            if (descriptor < 0)
+                throw std::system_error(errno, std::generic_category(), "Fail to set up an io_uring");
+
+            try
+            {
+                const auto &submission_offsets = parameters.sq_off;
+                const auto &completion_offsets = parameters.cq_off;
+                rings_byte_count = submission_offsets.array + parameters.sq_entries * sizeof(uint32_t);
+                completion_rings_byte_count = completion_offsets.cqes + parameters.cq_entries * sizeof(io_uring_cqe);
+                if ((parameters.features & IORING_FEAT_SINGLE_MMAP) != 0)
+                    rings_byte_count = completion_rings_byte_count = std::max(rings_byte_count, completion_rings_byte_count);
+
+                rings = map(descriptor, rings_byte_count, IORING_OFF_SQ_RING);
+                completion_rings = (parameters.features & IORING_FEAT_SINGLE_MMAP) != 0 ? rings : map(descriptor, completion_rings_byte_count, IORING_OFF_CQ_RING);
+                entries_byte_count = parameters.sq_entries * sizeof(io_uring_sqe);
+                entries = static_cast<io_uring_sqe *>(map(descriptor, entries_byte_count, IORING_OFF_SQES));
+
+                const auto submission_units = static_cast<unit_type *>(rings);
+                const auto completion_units = static_cast<unit_type *>(completion_rings);
+                submission_tail = reinterpret_cast<uint32_t *>(submission_units + submission_offsets.tail);
+                submission_array = reinterpret_cast<uint32_t *>(submission_units + submission_offsets.array);
+                submission_mask = *reinterpret_cast<uint32_t *>(submission_units + submission_offsets.ring_mask);
+                submission_count = parameters.sq_entries;
+                completion_head = reinterpret_cast<uint32_t *>(completion_units + completion_offsets.head);
+                completion_tail = reinterpret_cast<uint32_t *>(completion_units + completion_offsets.tail);
+                completion_mask = *reinterpret_cast<uint32_t *>(completion_units + completion_offsets.ring_mask);
+                completions = reinterpret_cast<io_uring_cqe *>(completion_units + completion_offsets.cqes);
+                local_tail = *submission_tail;
+
+                io_uring_rsrc_register files{};
+                files.nr = p_file_count;
+                files.flags = IORING_RSRC_REGISTER_SPARSE;
+                if (::syscall(__NR_io_uring_register, descriptor, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0)
+                    throw std::system_error(errno, std::generic_category(), "Fail to register the io_uring files");
+            }
+            catch (...)
+            {
+                release();
+                throw;
+            }
+        }
+
+        uring_t(const uring_t &) = delete;
+        auto operator=(const uring_t &) -> uring_t & = delete;
+
+        ~uring_t() { release(); }
+
+        /// Whether the kernel lets this process set up an io_uring, which seccomp filters and older kernels refuse.
+        static auto is_available() -> bool
+        {
+            static const bool is_available = []
+            {
+                try
+                {
+                    uring_t ring(1, 1);
+                    return true;
+                }
+                catch (const std::system_error &)
+                {
+                    return false;
+                }
+            }();
+            return is_available;
+        }
+
+        /// How many more submissions fit before the next `submit`.
+        auto get_free_count() const -> size_type { return submission_count - pending_count; }
+
+        auto push(const io_uring_sqe &p_entry) -> void
+        {
+            if (pending_count == submission_count)
+                throw std::logic_error("Full io_uring.");
+
+            const uint32_t index = local_tail & submission_mask;
+            entries[index] = p_entry;
+            submission_array[index] = index;
+            ++local_tail;
+            ++pending_count;
+        }
+
+        /// Submit the pushed operations and wait for all of them, calling the function with the user data and result of each.
+        /// The first exception from the function is rethrown once every operation is done, as they may still use its buffers until then.
+        template <typename F>
+        auto submit(F p_function) -> void
+        {
+            if (pending_count == 0)
+                return;
+
+            std::atomic_ref<uint32_t>(*submission_tail).store(local_tail, std::memory_order_release);
+            const uint32_t submitted_count = pending_count;
+            pending_count = 0;
+
+            std::exception_ptr error;
+            uint32_t completed_count = 0;
+            uint32_t entered_count = 0;
+            while (completed_count < submitted_count)
+            {
+                const auto result = ::syscall(__NR_io_uring_enter, descriptor, submitted_count - entered_count, submitted_count - completed_count, IORING_ENTER_GETEVENTS, nullptr, 0);
+                // The operations in flight may still use their buffers, so there is no safe way to give up on them.
+                if (result < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                    std::terminate();
+                if (result > 0)
+                    entered_count += static_cast<uint32_t>(result);
+
+                uint32_t head = *completion_head;
+                const uint32_t tail = std::atomic_ref<uint32_t>(*completion_tail).load(std::memory_order_acquire);
+                for (; head != tail; ++head, ++completed_count)
+                {
+                    const auto &completion = completions[head & completion_mask];
+                    try
+                    {
+                        p_function(completion.user_data, completion.res);
+                    }
+                    catch (...)
+                    {
+                        if (!error)
+                            error = std::current_exception();
+                    }
+                }
+                std::atomic_ref<uint32_t>(*completion_head).store(head, std::memory_order_release);
+            }
+
+            if (error)
+                std::rethrow_exception(error);
+        }
+    };
+#endif
+
+    /// A file read into memory, or only stat'd when it is larger than the byte limit.
+    struct read_file_t
+    {
+        /// The size and modification time of the file, without a content hash.
+        stamp_t stamp;
+        std::optional<unit_vector_type> content;
+    };
+
+    /// Read whole files into memory, except those larger than the byte limit, which are only stat'd.
+    /// With io_uring, the files of a batch are stat'd with one system call, then opened, read and closed with another.
+    template <typename = void>
+    auto read_files(std::span<const std::filesystem::path> p_paths, size_type p_byte_limit, io_backend_t p_backend = io_backend_t::threads) -> std::vector<read_file_t>
+    {
+        std::vector<read_file_t> files(p_paths.size());
+
+#if LIBBAG_HAS_URING
+        if (p_backend == io_backend_t::uring || (p_backend == io_backend_t::automatic && uring_t::is_available()))
+        {
+            constexpr uint32_t batch_file_count = 64;
+            std::vector<struct statx> statuses(batch_file_count);
+            uring_t ring(batch_file_count * 3, batch_file_count);
+            for (size_type batch_offset = 0; batch_offset < p_paths.size(); batch_offset += batch_file_count)
+            {
+                const size_type batch_count = std::min<size_type>(batch_file_count, p_paths.size() - batch_offset);
+                for (size_type index = 0; index < batch_count; ++index)
+                {
+                    io_uring_sqe entry{};
+                    entry.opcode = IORING_OP_STATX;
+                    entry.fd = AT_FDCWD;
+                    entry.addr = reinterpret_cast<uintptr_t>(p_paths[batch_offset + index].c_str());
+                    entry.len = STATX_SIZE | STATX_MTIME;
+                    entry.off = reinterpret_cast<uintptr_t>(&statuses[index]);
+                    entry.user_data = index;
+                    ring.push(entry);
+                }
+                ring.submit([&](uint64_t p_index, int p_result)
+                            {
+                    if (p_result < 0)
+                        throw std::system_error(-p_result, std::generic_category(), "Fail to stat the file '" + p_paths[batch_offset + p_index].string() + "'");
+
+                    const auto &status = statuses[p_index];
+                    auto &file = files[batch_offset + p_index];
+                    file.stamp.modification_time = static_cast<int64_t>(status.stx_mtime.tv_sec) * 1000000000 + static_cast<int64_t>(status.stx_mtime.tv_nsec);
+                    file.stamp.content_hash.byte_count = static_cast<size_type>(status.stx_size); });
+
+                // Open, read and close each file in a chain, the close going on even when the read falls short.
+                for (size_type index = 0; index < batch_count; ++index)
+                {
+                    auto &file = files[batch_offset + index];
+                    const size_type byte_count = file.stamp.content_hash.byte_count;
+                    if (byte_count > p_byte_limit || byte_count > std::numeric_limits<uint32_t>::max())
+                        continue;
+
+                    file.content.emplace(byte_count);
+                    if (byte_count == 0)
+                        continue;
+
+                    io_uring_sqe open_entry{};
+                    open_entry.opcode = IORING_OP_OPENAT;
+                    open_entry.flags = IOSQE_IO_LINK;
+                    open_entry.fd = AT_FDCWD;
+                    open_entry.addr = reinterpret_cast<uintptr_t>(p_paths[batch_offset + index].c_str());
+                    open_entry.open_flags = O_RDONLY;
+                    open_entry.file_index = static_cast<uint32_t>(index + 1);
+                    open_entry.user_data = index * 3;
+                    ring.push(open_entry);
+
+                    io_uring_sqe read_entry{};
+                    read_entry.opcode = IORING_OP_READ;
+                    read_entry.flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+                    read_entry.fd = static_cast<int>(index);
+                    read_entry.addr = reinterpret_cast<uintptr_t>(file.content->data());
+                    read_entry.len = static_cast<uint32_t>(byte_count);
+                    read_entry.user_data = index * 3 + 1;
+                    ring.push(read_entry);
+
+                    io_uring_sqe close_entry{};
+                    close_entry.opcode = IORING_OP_CLOSE;
+                    close_entry.file_index = static_cast<uint32_t>(index + 1);
+                    close_entry.user_data = index * 3 + 2;
+                    ring.push(close_entry);
+                }
+                ring.submit([&](uint64_t p_data, int p_result)
+                            {
+                    const auto &path = p_paths[batch_offset + p_data / 3];
+                    const auto &file = files[batch_offset + p_data / 3];
+                    switch (p_data % 3)
+                    {
+                    case 0:
+                        if (p_result < 0)
+                            throw std::system_error(-p_result, std::generic_category(), "Fail to open the file '" + path.string() + "'");
+                        break;
+                    case 1:
+                        if (p_result < 0 && p_result != -ECANCELED)
+                            throw std::system_error(-p_result, std::generic_category(), "Fail to read the file '" + path.string() + "'");
+                        if (p_result >= 0 && static_cast<size_type>(p_result) != file.content->size())
+                            throw std::runtime_error("Fail to read the content of the file '" + path.string() + "'.");
+                        break;
+                    } });
+            }
+            return files;
+        }
+#endif
+        if (p_backend == io_backend_t::uring)
+            throw std::runtime_error("Missing io_uring.");
+
+        for (size_type index = 0; index < p_paths.size(); ++index)
+        {
+            const file_source_t source(p_paths[index]);
+            auto &file = files[index];
+            file.stamp = *source.get_stamp();
+            if (source.size() > p_byte_limit)
+                continue;
+
+            file.content.emplace(source.size());
+            for (size_type byte_offset = 0; byte_offset < source.size();)
+            {
+                const size_type read_byte_count = source.read(byte_offset, std::span(*file.content).subspan(byte_offset));
+                if (read_byte_count == 0)
+                    throw std::runtime_error("Fail to read the content of the file '" + p_paths[index].string() + "'.");
+                byte_offset += read_byte_count;
+            }
+        }
+        return files;
+    }
+#endif
+
+    /// Hash a content source in bounded chunks.
+    template <content_source_c C>
+    auto hash_content_source(const C &p_content, unit_vector_type &p_buffer) -> content_hash_t
+    {
+        const size_type byte_count = p_content.size();
+        units_hasher_t low_hasher(byte_count);
+        units_hasher_t high_hasher(byte_count, content_hash_high_seed);
+
+        if (p_buffer.empty())
+            p_buffer.resize(1 << 20);
+
+        for (size_type byte_offset = 0; byte_offset < byte_count;)
+        {
+            const auto chunk = std::span<unit_type>(p_buffer.data(), std::min<size_type>(p_buffer.size(), byte_count - byte_offset));
+            const size_type read_byte_count = p_content.read(byte_offset, chunk);
+            if (read_byte_count == 0)
+                throw std::runtime_error("Content source is shorter than its size.");
+
+            low_hasher.update(unit_span_type(chunk.data(), read_byte_count));
+            high_hasher.update(unit_span_type(chunk.data(), read_byte_count));
+            byte_offset += read_byte_count;
+        }
+
+        return content_hash_t{byte_count, low_hasher.finish(), high_hasher.finish()};
+    }
+
+    /// CRC32C of a content source, read in bounded chunks.
+    template <content_source_c C>
+    auto checksum_content_source(const C &p_content, unit_vector_type &p_buffer) -> uint32_t
+    {
+        const size_type byte_count = p_content.size();
+        uint32_t checksum = 0;
+
+        if (p_buffer.empty())
+            p_buffer.resize(1 << 20);
+
+        for (size_type byte_offset = 0; byte_offset < byte_count;)
+        {
+            const auto chunk = std::span<unit_type>(p_buffer.data(), std::min<size_type>(p_buffer.size(), byte_count - byte_offset));
+            const size_type read_byte_count = p_content.read(byte_offset, chunk);
+            if (read_byte_count == 0)
+                throw std::runtime_error("Content source is shorter than its size.");
+
+            checksum = crc32c(unit_span_type(chunk.data(), read_byte_count), checksum);
+            byte_offset += read_byte_count;
+        }
+
+        return checksum;
+    }
+
+    /// Write a content, in bounded chunks when it comes from a content source.
+    /// Return the byte count of the content.
+    template <output_sink_c S, typename C>
+    auto write_content(S &p_sink, const C &p_content, unit_vector_type &p_buffer) -> size_type
+    {
+        if constexpr (std::is_convertible_v<const C &, content_type>)
+        {
+            const auto content = content_type(p_content);
+            p_sink.write(content);
+            return content.size();
+        }
+        else
+        {
+            const size_type byte_count = p_content.size();
+
+            if constexpr (descriptor_content_source_c<C> && transfer_output_sink_c<S>)
+            {
+                if (const int descriptor = p_content.get_descriptor(); descriptor >= 0)
+                {
+                    size_type descriptor_offset = 0;
+                    if constexpr (requires { p_content.get_descriptor_offset(); })
+                        descriptor_offset = p_content.get_descriptor_offset();
+
+                    p_sink.transfer(descriptor, descriptor_offset, byte_count);
+                    return byte_count;
+                }
+            }
+
+            if (p_buffer.empty())
+                p_buffer.resize(1 << 20);
+
+            for (size_type byte_offset = 0; byte_offset < byte_count;)
+            {
+                const auto chunk = std::span<unit_type>(p_buffer.data(), std::min<size_type>(p_buffer.size(), byte_count - byte_offset));
+                const size_type read_byte_count = p_content.read(byte_offset, chunk);
+                if (read_byte_count == 0)
+                    throw std::runtime_error("Content source is shorter than its size.");
+
+                p_sink.write(unit_span_type(chunk.data(), read_byte_count));
+                byte_offset += read_byte_count;
+            }
+
+            return byte_count;
+        }
+    }
+
+    /// Produce items on a pool of threads ahead of a single consumer, which takes them in order.
+    /// Threads stop claiming items while the produced but untaken items weigh more than the byte limit.
+    template <typename T>
+    class prefetcher_t
+    {
+    public:
+        using producer_type = std::function<T(size_type)>;
+        using weigher_type = std::function<size_type(const T &)>;
+
+    private:
+        struct slot_t
+        {
+            std::optional<T> value;
+            std::exception_ptr error;
+            size_type byte_count = 0;
+        };
+
+        size_type item_count;
+        producer_type producer;
+        weigher_type weigher;
+        size_type byte_limit;
+
+        std::mutex mutex;
+        std::condition_variable produced;
+        std::condition_variable consumed;
+        std::map<size_type, slot_t> ready;
+        size_type claimed_count = 0;
+        size_type taken_count = 0;
+        size_type in_flight_byte_count = 0;
+        bool is_stopping = false;
+
+        std::optional<T> current;
+        std::vector<std::thread> threads;
+
+        auto work() -> void
+        {
+            while (true)
+            {
+                std::unique_lock lock(mutex);
+                consumed.wait(lock, [this]
+                              { return is_stopping || claimed_count >= item_count || in_flight_byte_count < byte_limit || claimed_count == taken_count; });
+                if (is_stopping || claimed_count >= item_count)
+                    return;
+                const size_type ordinal = claimed_count++;
+                lock.unlock();
+
+                slot_t slot;
+                try
+                {
+                    slot.value.emplace(producer(ordinal));
+                    slot.byte_count = weigher(*slot.value);
+                }
+                catch (...)
+                {
+                    slot.value.reset();
+                    slot.error = std::current_exception();
+                }
+
+                lock.lock();
+                in_flight_byte_count += slot.byte_count;
+                ready.emplace(ordinal, std::move(slot));
+                produced.notify_all();
+            }
+        }
+
+        auto take() -> void
+        {
+            std::unique_lock lock(mutex);
+            produced.wait(lock, [this]
+                          { return ready.contains(taken_count); });
+
+            current.reset();
+            auto node = ready.extract(taken_count);
+            ++taken_count;
+            in_flight_byte_count -= node.mapped().byte_count;
+            consumed.notify_all();
+            lock.unlock();
+
+            if (node.mapped().error)
+                std::rethrow_exception(node.mapped().error);
+            current = std::move(node.mapped().value);
+        }
+
+    public:
+        class iterator
+        {
+        public:
+            using difference_type = std::ptrdiff_t;
+            using value_type = T;
+            using reference = const T &;
+            using iterator_category = std::input_iterator_tag;
+
+        private:
+            prefetcher_t *prefetcher = nullptr;
+            size_type ordinal = 0;
+
+        public:
+            iterator() = default;
+
+            iterator(prefetcher_t *p_prefetcher, size_type p_ordinal)
+                : prefetcher(p_prefetcher), ordinal(p_ordinal) {}
+
+            auto operator*() const -> reference { return prefetcher->get(ordinal); }
+
+            auto operator++() -> iterator &
+            {
+                ++ordinal;
+                return *this;
+            }
+
+            auto operator++(int) -> iterator
+            {
+                iterator temp = *this;
+                ++(*this);
+                return temp;
+            }
+
+            auto operator==(const iterator &p_other) const -> bool { return ordinal == p_other.ordinal; }
+        };
+
+        prefetcher_t(size_type p_item_count, producer_type p_producer, weigher_type p_weigher, size_type p_thread_count, size_type p_byte_limit)
+            : item_count(p_item_count), producer(std::move(p_producer)), weigher(std::move(p_weigher)), byte_limit(p_byte_limit)
+        {
+            for (size_type i = 0; i < std::max<size_type>(p_thread_count, 1); ++i)
+                threads.emplace_back([this]
+                                     { work(); });
+        }
+
+        prefetcher_t(const prefetcher_t &) = delete;
+        auto operator=(const prefetcher_t &) -> prefetcher_t & = delete;
+
+        ~prefetcher_t()
+        {
+            {
+                std::lock_guard lock(mutex);
+                is_stopping = true;
+            }
+            consumed.notify_all();
+            for (auto &thread : threads)
+                thread.join();
+        }
+
+        /// Get an item by ordinal. Ordinals must be visited in order, each item being valid until the next one is taken.
+        auto get(size_type p_ordinal) -> const T &
+        {
+            if (p_ordinal >= item_count)
+                throw std::out_of_range("Invalid prefetch ordinal.");
+            if (p_ordinal + 1 < taken_count || (p_ordinal + 1 == taken_count && !current.has_value()))
+                throw std::logic_error("Prefetched items must be taken in order.");
+
+            while (taken_count <= p_ordinal)
+                take();
+
+            return *current;
+        }
+
+        auto begin() -> iterator { return iterator(this, 0); }
+
+        auto end() -> iterator { return iterator(this, item_count); }
+    };
+
+    /// Call a function for each index on a pool of threads.
+    /// Each thread owns a contiguous range of indices and steals from the others' once it is done.
+    /// The first exception is rethrown after every thread stops.
+    template <typename F>
+    auto parallel_for_each_index(size_type p_index_count, size_type p_thread_count, F p_function) -> void
+    {
+        const size_type thread_count = std::clamp<size_type>(p_thread_count, 1, std::max<size_type>(p_index_count, 1));
+        if (thread_count == 1)
+        {
+            for (size_type index = 0; index < p_index_count; ++index)
+                p_function(index);
+            return;
+        }
+
+        struct range_t
+        {
+            std::atomic<size_type> next;
+            size_type end;
+        };
+        std::vector<range_t> ranges(thread_count);
+        for (size_type i = 0; i < thread_count; ++i)
+        {
+            ranges[i].next = p_index_count * i / thread_count;
+            ranges[i].end = p_index_count * (i + 1) / thread_count;
+        }
+
+        std::atomic<bool> is_failed = false;
+        std::exception_ptr error;
+        std::mutex error_mutex;
+
+        const auto work = [&](size_type p_thread_index)
+        {
+            for (size_type victim = 0; victim < thread_count && !is_failed; ++victim)
+            {
+                auto &range = ranges[(p_thread_index + victim) % thread_count];
+                for (size_type index = range.next++; index < range.end && !is_failed; index = range.next++)
+                {
+                    try
+                    {
+                        p_function(index);
+                    }
+                    catch (...)
+                    {
+                        std::lock_guard lock(error_mutex);
+                        if (!error)
+                            error = std::current_exception();
+                        is_failed = true;
+                    }
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_type i = 1; i < thread_count; ++i)
+            threads.emplace_back(work, i);
+        work(0);
+        for (auto &thread : threads)
+            thread.join();
+
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    /// A codec encodes a content by appending to a buffer, and decodes it into a span of the decoded size.
+    /// Decoding returns false on malformed input.
+    /// Identifiers below 256 are reserved for libbag.
+    template <typename T>
+    concept codec_c = requires(const T &p_codec, content_type p_input, unit_vector_type &p_output, std::span<unit_type> p_decoded) {
+        { T::identifier } -> std::convertible_to<size_type>;
+        p_codec.encode(p_input, p_output);
+        { p_codec.decode(p_input, p_decoded) } -> std::convertible_to<bool>;
+    };
+
+    constexpr const size_type stored_codec_identifier = 0;
+
+    /// A dependency-free LZ77 codec in the spirit of LZ4 block format.
+    ///
+    /// Sequence:
+    /// | token | literal count extension | literals | offset (2 bytes) | match count extension |
+    ///
+    /// The token holds the literal count in its high 4 bits and the match count minus 4 in its low 4 bits.
+    /// A 15 is extended by the following bytes, summed until one is not 255.
+    /// The last sequence only has literals.
+    class lz_codec_t
+    {
+    private:
+        static constexpr size_type minimum_match_byte_count = 4;
+        static constexpr size_type maximum_offset = 0xFFFF;
+        /// Below this, matches cannot save more than the sequences cost, so the input is written as literals.
+        static constexpr size_type minimum_encoded_byte_count = 32;
+        static constexpr size_type maximum_hash_bit_count = 14;
+
+        static auto load_32(const unit_type *p_units) -> uint32_t
+        {
+            uint32_t value;
+            std::memcpy(&value, p_units, sizeof(value));
+            return value;
+        }
+
+        static auto write_count(unit_vector_type &p_output, size_type p_count) -> void
+        {
+            for (; p_count >= 255; p_count -= 255)
+                p_output.push_back(static_cast<unit_type>(255));
+            p_output.push_back(static_cast<unit_type>(p_count));
+        }
+
+        static auto read_count(const unit_type *&p_input, const unit_type *p_input_end, size_type &p_count) -> bool
+        {
+            while (true)
+            {
+                if (p_input == p_input_end)
+                    return false;
+                const auto value = static_cast<unsigned char>(*p_input++);
+                p_count += value;
+                if (value != 255)
+                    return true;
+            }
+        }
+
+        static auto write_sequence(unit_vector_type &p_output, content_type p_literals, size_type p_offset, size_type p_match_byte_count) -> void
+        {
+            const size_type literal_count = p_literals.size();
+            const size_type match_count = p_match_byte_count == 0 ? 0 : p_match_byte_count - minimum_match_byte_count;
+            p_output.push_back(static_cast<unit_type>((std::min<size_type>(literal_count, 15) << 4) | std::min<size_type>(match_count, 15)));
+            if (literal_count >= 15)
+                write_count(p_output, literal_count - 15);
+            p_output.insert(p_output.end(), p_literals.begin(), p_literals.end());
+
+            if (p_match_byte_count == 0)
+                return;
+
+            p_output.push_back(static_cast<unit_type>(p_offset & 0xFF));
+            p_output.push_back(static_cast<unit_type>(p_offset >> 8));
+            if (match_count >= 15)
+                write_count(p_output, match_count - 15);
+        }
+
+    public:
+        static constexpr size_type identifier = 1;
+
+        auto encode(content_type p_input, unit_vector_type &p_output) const -> void
+        {
+            const auto input = p_input.data();
+            const size_type byte_count = p_input.size();
+
+            if (byte_count < minimum_encoded_byte_count || byte_count >= std::numeric_limits<uint32_t>::max())
+            {
+                write_sequence(p_output, p_input, 0, 0);
+                return;
+            }
+
+            // Positions are stored plus one, so zero marks an empty slot, in a table sized for the input.
+            const size_type hash_bit_count = std::min<size_type>(maximum_hash_bit_count, std::bit_width(byte_count));
+            std::array<uint32_t, size_type(1) << maximum_hash_bit_count> table;
+            std::fill_n(table.begin(), size_type(1) << hash_bit_count, 0);
+
+            size_type anchor = 0;
+            size_type position = 0;
+            while (position + minimum_match_byte_count <= byte_count)
+            {
+                const uint32_t sequence = load_32(input + position);
+                const size_type hash = static_cast<uint32_t>(sequence * 2654435761u) >> (32 - hash_bit_count);
+                const size_type stored_position = table[hash];
+                table[hash] = static_cast<uint32_t>(position + 1);
+
+                const size_type candidate = stored_position - 1;
+                if (stored_position == 0 || position - candidate > maximum_offset || load_32(input + candidate) != sequence)
+                {
+                    ++position;
+                    continue;
+                }
+
+                size_type match_byte_count = minimum_match_byte_count;
+                while (position + match_byte_count < byte_count && input[candidate + match_byte_count] == input[position + match_byte_count])
+                    ++match_byte_count;
+
+                write_sequence(p_output, p_input.subspan(anchor, position - anchor), position - candidate, match_byte_count);
+                position += match_byte_count;
+                anchor = position;
+            }
+
+            write_sequence(p_output, p_input.subspan(anchor), 0, 0);
+        }
+
+        auto decode(content_type p_input, std::span<unit_type> p_decoded) const -> bool
+        {
+            auto input = p_input.data();
+            const auto input_end = input + p_input.size();
+            size_type position = 0;
+
+            while (input != input_end)
+            {
+                const auto token = static_cast<unsigned char>(*input++);
+
+                size_type literal_count = token >> 4;
+                if (literal_count == 15 && !read_count(input, input_end, literal_count))
+                    return false;
+                if (literal_count > static_cast<size_type>(input_end - input) || literal_count > p_decoded.size() - position)
+                    return false;
+                std::copy_n(input, literal_count, p_decoded.data() + position);
+                input += literal_count;
+                position += literal_count;
+
+                if (input == input_end)
+                    break;
+
+                if (input_end - input < 2)
+                    return false;
+                const size_type offset = static_cast<unsigned char>(input[0]) | (static_cast<size_type>(static_cast<unsigned char>(input[1])) << 8);
+                input += 2;
+
+                size_type match_byte_count = token & 0x0F;
+                if (match_byte_count == 15 && !read_count(input, input_end, match_byte_count))
+                    return false;
+                match_byte_count += minimum_match_byte_count;
+
+                if (offset == 0 || offset > position || match_byte_count > p_decoded.size() - position)
+                    return false;
+                // Byte by byte as the match may overlap what it produces.
+                for (size_type i = 0; i < match_byte_count; ++i, ++position)
+                    p_decoded[position] = p_decoded[position - offset];
+            }
+
+            return position == p_decoded.size();
+        }
+    };
+    static_assert(codec_c<lz_codec_t>);
+
+    /// A type-erased codec.
+    class codec_t
+    {
+    private:
+        size_type identifier;
+        std::function<void(content_type, unit_vector_type &)> encoder;
+        std::function<bool(content_type, std::span<unit_type>)> decoder;
+
+    public:
+        template <codec_c C>
+        codec_t(C p_codec)
+            : identifier(C::identifier),
+              encoder([p_codec](content_type p_input, unit_vector_type &p_output)
+                      { p_codec.encode(p_input, p_output); }),
+              decoder([p_codec](content_type p_input, std::span<unit_type> p_decoded)
+                      { return p_codec.decode(p_input, p_decoded); }) {}
+
+        auto get_identifier() const -> size_type { return identifier; }
+
+        auto encode(content_type p_input, unit_vector_type &p_output) const -> void { encoder(p_input, p_output); }
+
+        auto decode(content_type p_input, std::span<unit_type> p_decoded) const -> bool { return decoder(p_input, p_decoded); }
+    };
+
+    template <typename = void>
+    auto builtin_codecs() -> std::vector<codec_t>
+    {
+        return {codec_t(lz_codec_t())};
+    }
+
+    /// Decode a content with the codec its encoding names.
+    template <typename = void>
+    auto decode_content(std::span<const codec_t> p_codecs, const encoding_t &p_encoding, content_type p_encoded, std::span<unit_type> p_decoded) -> void
+    {
+        const auto codec = std::find_if(p_codecs.begin(), p_codecs.end(), [&](const codec_t &p_codec)
+                                        { return p_codec.get_identifier() == p_encoding.codec; });
+        if (codec == p_codecs.end())
+            throw std::runtime_error("Unknown codec.");
+        if (p_decoded.size() != p_encoding.byte_count || !codec->decode(p_encoded, p_decoded))
+            throw std::runtime_error("Invalid encoded content.");
+    }
+
+    /// What an observer is told packing, unpacking or extracting is busy with.
+    /// A phase may begin and end many times, such as once per item.
+    enum class phase_t
+    {
+        /// Advancing the input iterators and reading contents into memory.
+        read_inputs,
+        encode_contents,
+        /// Writing keys and contents to the sink, with the contents streamed from their sources.
+        write_items,
+        build_pages,
+        write_pages,
+        list_attributes,
+        verify_pages,
+        unpack_items,
+        create_directories,
+        write_files
+    };
+
+    constexpr auto to_string(phase_t p_phase) -> std::string_view
+    {
+        switch (p_phase)
+        {
+        case phase_t::read_inputs:
+            return "read_inputs";
+        case phase_t::encode_contents:
+            return "encode_contents";
+        case phase_t::write_items:
+            return "write_items";
+        case phase_t::build_pages:
+            return "build_pages";
+        case phase_t::write_pages:
+            return "write_pages";
+        case phase_t::list_attributes:
+            return "list_attributes";
+        case phase_t::verify_pages:
+            return "verify_pages";
+        case phase_t::unpack_items:
+            return "unpack_items";
+        case phase_t::create_directories:
+            return "create_directories";
+        case phase_t::write_files:
+            return "write_files";
+        }
+        return "unknown";
+    }
+
+    /// An observer without any of `on_phase_begin(phase_t)`, `on_phase_end(phase_t)` and `on_entry(phase_t, key_type, size_type)`,
+    /// so observing with it compiles to nothing.
+    struct null_observer_t
+    {
+    };
+
+    template <typename O>
+    constexpr auto notify_phase_begin(O &p_observer, phase_t p_phase) -> void
+    {
+        if constexpr (requires { p_observer.on_phase_begin(p_phase); })
+            p_observer.on_phase_begin(p_phase);
+    }
+
+    template <typename O>
+    constexpr auto notify_phase_end(O &p_observer, phase_t p_phase) -> void
+    {
+        if constexpr (requires { p_observer.on_phase_end(p_phase); })
+            p_observer.on_phase_end(p_phase);
+    }
+
+    /// Tell an observer an item went through a phase, with the byte count of its content there.
+    template <typename O>
+    constexpr auto notify_entry(O &p_observer, phase_t p_phase, key_type p_key, size_type p_byte_count) -> void
+    {
+        if constexpr (requires { p_observer.on_entry(p_phase, p_key, p_byte_count); })
+            p_observer.on_entry(p_phase, p_key, p_byte_count);
+    }
+
+    /// A phase from its construction to its destruction.
+    template <typename O>
+    class observed_phase_t
+    {
+    private:
+        O &observer;
+        phase_t phase;
+
+    public:
+        constexpr observed_phase_t(O &p_observer, phase_t p_phase)
+            : observer(p_observer), phase(p_phase) { notify_phase_begin(observer, phase); }
+
+        observed_phase_t(const observed_phase_t &) = delete;
+        auto operator=(const observed_phase_t &) -> observed_phase_t & = delete;
+
+        constexpr ~observed_phase_t() { notify_phase_end(observer, phase); }
+    };
+
+    /// An observer timing the phases, and counting their items and bytes with a histogram of the item sizes.
+    /// Phases and items may be told from several threads at once. Each thread times its own phases, and the duration of
+    /// a phase adds up the time every thread spent in it, so it can exceed the wall clock time when threads overlap.
+    class stats_observer_t
+    {
+    public:
+        using clock_type = std::chrono::steady_clock;
+
+        struct phase_stats_t
+        {
+            clock_type::duration duration{};
+            size_type entry_count = 0;
+            size_type byte_count = 0;
+            /// Entries by the bit width of their byte count, so entry i has from 2^(i-1) up to 2^i bytes.
+            std::array<size_type, 65> histogram{};
+        };
+
+    private:
+        mutable std::mutex mutex;
+        std::map<phase_t, phase_stats_t> phases;
+        /// When each thread began each phase it is in.
+        std::map<std::pair<phase_t, std::thread::id>, clock_type::time_point> begin_times;
+
+    public:
+        auto on_phase_begin(phase_t p_phase) -> void
+        {
+            const auto now = clock_type::now();
+            std::scoped_lock lock(mutex);
+            begin_times[{p_phase, std::this_thread::get_id()}] = now;
+        }
+
+        auto on_phase_end(phase_t p_phase) -> void
+        {
+            const auto now = clock_type::now();
+            std::scoped_lock lock(mutex);
+            if (const auto it = begin_times.find({p_phase, std::this_thread::get_id()}); it != begin_times.end())
+            {
+                phases[p_phase].duration += now - it->second;
+                begin_times.erase(it);
+            }
+        }
+
+        auto on_entry(phase_t p_phase, key_type, size_type p_byte_count) -> void
+        {
+            std::scoped_lock lock(mutex);
+            auto &phase = phases[p_phase];
+            ++phase.entry_count;
+            phase.byte_count += p_byte_count;
+            ++phase.histogram[std::bit_width(p_byte_count)];
+        }
+
+        auto get_phases() const -> std::map<phase_t, phase_stats_t>
+        {
+            std::scoped_lock lock(mutex);
+            return phases;
+        }
+
+        auto write_text(std::ostream &p_output) const -> void
+        {
+            for (const auto &[phase, stats] : get_phases())
+            {
+                p_output << to_string(phase) << ": " << std::chrono::duration<double, std::milli>(stats.duration).count() << " ms";
+                if (stats.entry_count != 0)
+                    p_output << ", " << stats.entry_count << " entries, " << stats.byte_count << " bytes";
+                p_output << "\n";
+                for (size_type width = 0; width < stats.histogram.size(); ++width)
+                    if (stats.histogram[width] != 0)
+                        p_output << "  < " << (size_type(1) << std::min<size_type>(width, 63)) << " bytes: " << stats.histogram[width] << "\n";
+            }
+        }
+
+        auto write_json(std::ostream &p_output) const -> void
+        {
+            p_output << "{\"phases\": [";
+            bool is_first_phase = true;
+            for (const auto &[phase, stats] : get_phases())
+            {
+                p_output << (is_first_phase ? "" : ", ") << "{\"phase\": \"" << to_string(phase) << "\", \"seconds\": " << std::chrono::duration<double>(stats.duration).count()
+                         << ", \"entries\": " << stats.entry_count << ", \"bytes\": " << stats.byte_count << ", \"histogram\": [";
+                bool is_first_bucket = true;
+                for (size_type width = 0; width < stats.histogram.size(); ++width)
+                {
+                    if (stats.histogram[width] == 0)
+                        continue;
+                    p_output << (is_first_bucket ? "" : ", ") << "{\"bit_width\": " << width << ", \"entries\": " << stats.histogram[width] << "}";
+                    is_first_bucket = false;
+                }
+                p_output << "]}";
+                is_first_phase = false;
+            }
+            p_output << "]}\n";
+        }
+    };
+
+    using attribute_type = std::pair<key_type, slice_t>;
+
+    template <typename T>
+    concept attribute_container_c = requires {
+        std::declval<std::insert_iterator<T>>() = std::declval<attribute_type>();
+    };
+
+    /// Append an unsigned LEB128 integer.
+    template <typename = void>
+    auto write_varint(unit_vector_type &p_output, size_type p_value) -> void
+    {
+        for (; p_value >= 0x80; p_value >>= 7)
+            p_output.push_back(static_cast<unit_type>((p_value & 0x7F) | 0x80));
+        p_output.push_back(static_cast<unit_type>(p_value));
+    }
+
+    /// Read an unsigned LEB128 integer, returning false when it is cut or too long.
+    template <typename = void>
+    auto read_varint(const unit_type *&p_input, const unit_type *p_input_end, size_type &p_value) -> bool
+    {
+        p_value = 0;
+        for (size_type shift = 0; shift < sizeof(size_type) * 8; shift += 7)
+        {
+            if (p_input == p_input_end)
+                return false;
+            const auto unit = static_cast<unsigned char>(*p_input++);
+            p_value |= static_cast<size_type>(unit & 0x7F) << shift;
+            if ((unit & 0x80) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    /// Keys in the key page are front-coded in blocks of this many, each block starting with a whole key.
+    ///
+    /// Key page:
+    /// | size_type block count | size_type block byte offsets... | blocks... |
+    ///
+    /// Entry of a block:
+    /// | shared byte count | suffix byte count | suffix | ordinal |
+    ///
+    /// Counts and ordinals are LEB128 integers, and the entries are sorted by key.
+    constexpr const size_type key_restart_interval = 16;
+
+    template <typename = void>
+    auto build_lookup_page(std::span<const size_type> p_key_hashes) -> std::vector<lookup_slot_t>
+    {
+        if (p_key_hashes.size() >= std::numeric_limits<uint32_t>::max())
+            throw std::length_error("Too many items for a lookup page.");
+
+        // Keep the load factor at most a half so most probes end in the first cache line.
+        std::vector<lookup_slot_t> slots(std::bit_ceil(std::max<size_type>(p_key_hashes.size() * 2, 1)), lookup_slot_t(0, 0));
+        const size_type mask = slots.size() - 1;
+        for (size_type ordinal = 0; ordinal < p_key_hashes.size(); ++ordinal)
+        {
+            const size_type hash = p_key_hashes[ordinal];
+            size_type position = hash & mask;
+            while (slots[position].ordinal != 0)
+                position = (position + 1) & mask;
+            slots[position] = lookup_slot_t(static_cast<uint32_t>(hash >> 32), static_cast<uint32_t>(ordinal + 1));
+        }
+
+        return slots;
+    }
+
+    /// Build the key page, the keys sorted and front-coded in blocks that each start with a whole key.
+    template <typename = void>
+    auto build_key_page(std::span<const key_type> p_keys) -> unit_vector_type
+    {
+        std::vector<size_type> ordinals(p_keys.size());
+        std::iota(ordinals.begin(), ordinals.end(), size_type(0));
+        std::stable_sort(ordinals.begin(), ordinals.end(), [&](size_type p_left, size_type p_right)
+                         { return p_keys[p_left] < p_keys[p_right]; });
+
+        const size_type block_count = (p_keys.size() + key_restart_interval - 1) / key_restart_interval;
+        unit_vector_type page(sizeof(size_type) * (1 + block_count));
+        std::memcpy(page.data(), &block_count, sizeof(block_count));
+
+        key_type previous_key;
+        for (size_type position = 0; position < ordinals.size(); ++position)
+        {
+            const key_type key = p_keys[ordinals[position]];
+            if (position % key_restart_interval == 0)
+            {
+                const size_type block_byte_offset = page.size();
+                std::memcpy(page.data() + sizeof(size_type) * (1 + position / key_restart_interval), &block_byte_offset, sizeof(block_byte_offset));
+                previous_key = key_type();
+            }
+
+            const auto shared_byte_count = static_cast<size_type>(std::mismatch(key.begin(), key.end(), previous_key.begin(), previous_key.end()).first - key.begin());
+            write_varint(page, shared_byte_count);
+            write_varint(page, key.size() - shared_byte_count);
+            page.insert(page.end(), key.begin() + shared_byte_count, key.end());
+            write_varint(page, ordinals[position]);
+            previous_key = key;
+        }
+
+        return page;
+    }
+
+    struct layout_chain_t;
+
+    /// The parsed footer of a bag.
+    struct layout_t
+    {
+        const unit_type *origin;
+        const metadata_t *metadata;
+        extension_t extension;
+        slice_view_type indices;
+        /// Parallel to the indices, empty when the bag has no encoding page.
+        std::span<const encoding_t> encodings;
+        /// Parallel to the indices, empty when the bag has no content page.
+        slice_view_type content_slices;
+        /// Parallel to the indices, empty when the bag has no checksum page.
+        std::span<const checksum_t> checksums;
+        /// Parallel to the indices, empty when the bag has no stamp page.
+        std::span<const stamp_t> stamps;
+        /// The sorted and front-coded keys, empty when the bag has no key page.
+        unit_span_type key_page;
+        /// The open addressing hash table over the keys, empty when the bag has no lookup page.
+        std::span<const lookup_slot_t> lookup_slots;
+        /// The keys the generation removes from the ones before it, empty once they are merged.
+        unit_span_type tombstones;
+        /// The generations and the merged pages the spans above view, when the bag was appended to.
+        std::shared_ptr<const layout_chain_t> chain;
+    };
+
+    template <typename T>
+    auto get_page(const layout_t &p_layout, const slice_t &p_page) -> std::span<const T>
+    {
+        if (p_page.byte_offset > p_layout.metadata->true_byte_count || p_page.byte_count > p_layout.metadata->true_byte_count - p_page.byte_offset)
+            throw std::runtime_error("Invalid page.");
+        if (p_page.byte_count % sizeof(T) != 0)
+            throw std::runtime_error("Invalid page size.");
+
+        return std::span<const T>(reinterpret_cast<const T *>(p_layout.origin + p_page.byte_offset), p_page.byte_count / sizeof(T));
+    }
+
+    /// Parse the last footer of a bag, which is the whole of it unless it was appended to.
+    template <typename = void>
+    auto get_generation_layout(const bag_type &p_bag) -> layout_t
+    {
+        const auto bag_unit_pointer = static_cast<const unit_type *>(p_bag.data());
+        const auto bag_byte_count = p_bag.size_bytes();
+        const auto bag_end_unit_pointer = bag_unit_pointer + bag_byte_count;
+
+        if (bag_byte_count < sizeof(metadata_t))
+            throw std::runtime_error("Invalid bag size.");
+
+        // Get metadata_t.
+        const metadata_t *data = reinterpret_cast<const metadata_t *>(bag_end_unit_pointer - sizeof(metadata_t));
+        if (data->mark != identifier_mark && data->mark != extended_identifier_mark)
+            throw std::runtime_error("Invalid marking.");
+        if (data->true_byte_count > bag_byte_count || data->true_byte_count < sizeof(metadata_t))
+            throw std::runtime_error("Invalid true byte count.");
+
+        layout_t layout{bag_end_unit_pointer - data->true_byte_count, data, extension_t(), slice_view_type(), {}, slice_view_type(), {}, {}, {}, {}, {}, {}};
+
+        // Get extension_t.
+        if (data->mark == extended_identifier_mark)
+        {
+            const auto extension_end_unit_pointer = bag_end_unit_pointer - sizeof(metadata_t) - sizeof(size_type);
+            size_type extension_byte_count;
+            if (data->true_byte_count < sizeof(metadata_t) + sizeof(extension_byte_count))
+                throw std::runtime_error("Invalid extension.");
+            std::memcpy(&extension_byte_count, extension_end_unit_pointer, sizeof(extension_byte_count));
+            if (extension_byte_count > data->true_byte_count - sizeof(metadata_t) - sizeof(extension_byte_count))
+                throw std::runtime_error("Invalid extension size.");
+
+            layout.extension.version = 0;
+            std::memcpy(&layout.extension, extension_end_unit_pointer - extension_byte_count, std::min<size_type>(extension_byte_count, sizeof(extension_t)));
+            if ((layout.extension.flags & ~supported_flags) != 0)
+                throw std::runtime_error("Unsupported feature.");
+        }
+
+        // Get indices.
+        layout.indices = get_page<slice_t>(layout, data->index_page);
+
+        // Get the pages parallel to the indices.
+        if (layout.extension.encoding_page.byte_count != 0)
+        {
+            layout.encodings = get_page<encoding_t>(layout, layout.extension.encoding_page);
+            if (layout.encodings.size() != layout.indices.size())
+                throw std::runtime_error("Invalid encoding page.");
+        }
+        if (layout.extension.content_page.byte_count != 0)
+        {
+            layout.content_slices = get_page<slice_t>(layout, layout.extension.content_page);
+            if (layout.content_slices.size() != layout.indices.size())
+                throw std::runtime_error("Invalid content page.");
+        }
+        if ((layout.extension.flags & separated_flag) != 0 && layout.content_slices.size() != layout.indices.size())
+            throw std::runtime_error("Missing content page.");
+        if (layout.extension.checksum_page.byte_count != 0)
+        {
+            layout.checksums = get_page<checksum_t>(layout, layout.extension.checksum_page);
+            if (layout.checksums.size() != layout.indices.size())
+                throw std::runtime_error("Invalid checksum page.");
+        }
+        if (layout.extension.stamp_page.byte_count != 0)
+        {
+            layout.stamps = get_page<stamp_t>(layout, layout.extension.stamp_page);
+            if (layout.stamps.size() != layout.indices.size())
+                throw std::runtime_error("Invalid stamp page.");
+        }
+        if (layout.extension.key_page.byte_count != 0)
+            layout.key_page = get_page<unit_type>(layout, layout.extension.key_page);
+        if (layout.extension.lookup_page.byte_count != 0)
+        {
+            layout.lookup_slots = get_page<lookup_slot_t>(layout, layout.extension.lookup_page);
+            if (!std::has_single_bit(layout.lookup_slots.size()))
+                throw std::runtime_error("Invalid lookup page.");
+        }
+        if (layout.extension.tombstone_page.byte_count != 0)
+        {
+            layout.tombstones = get_page<unit_type>(layout, layout.extension.tombstone_page);
+            if (layout.tombstones.back() != null_unit)
+                throw std::runtime_error("Invalid tombstone page.");
+        }
+
+        return layout;
+    }
+
+    /// Get the layout of the generation a generation was appended to, when it was.
+    template <typename = void>
+    auto get_previous_generation(const layout_t &p_layout) -> std::optional<layout_t>
+    {
+        if ((p_layout.extension.flags & chained_flag) == 0)
+            return std::nullopt;
+
+        // The previous generation ends where the items of this one start, so walking the chain always ends.
+        const auto &footer = p_layout.extension.previous_footer;
+        const size_type byte_count = footer.byte_offset + footer.byte_count;
+        if (footer.byte_count < sizeof(metadata_t) || byte_count < footer.byte_offset || byte_count > p_layout.metadata->index_page.byte_offset)
+            throw std::runtime_error("Invalid previous footer.");
+
+        auto generation = get_generation_layout(bag_type(p_layout.origin, byte_count));
+        if (generation.origin != p_layout.origin)
+            throw std::runtime_error("Invalid previous footer.");
+        return generation;
+    }
+
+    /// Call a function with each key a generation removes from the ones before it.
+    template <typename F>
+    auto for_each_tombstone(const layout_t &p_layout, F p_function) -> void
+    {
+        for (auto it = p_layout.tombstones.begin(); it != p_layout.tombstones.end();)
+        {
+            const auto null_it = std::find(it, p_layout.tombstones.end(), null_unit);
+            p_function(key_type(it, null_it));
+            it = null_it + 1;
+        }
+    }
+
+    template <typename = void>
+    auto is_removed(const layout_t &p_layout, key_type p_key) -> bool
+    {
+        bool is_found = false;
+        for_each_tombstone(p_layout, [&](key_type p_removed_key)
+                           { is_found = is_found || p_removed_key == p_key; });
+        return is_found;
+    }
+
+    using unpack_result_type = std::pair<key_type, content_type>;
+
+    /// Get the key and content of an item, looking for the null byte only within the item.
+    template <typename = void>
+    auto get_item(const layout_t &p_layout, const slice_t &p_index) -> unpack_result_type
+    {
+        if (p_index.byte_offset >= p_layout.metadata->true_byte_count || p_index.byte_count >= p_layout.metadata->true_byte_count - p_index.byte_offset)
+            throw std::runtime_error("Invalid byte count.");
+
+        const auto item_unit_pointer = p_layout.origin + p_index.byte_offset;
+        const auto item_end_unit_pointer = item_unit_pointer + p_index.byte_count;
+        const auto null_unit_pointer = std::find(item_unit_pointer, item_end_unit_pointer, null_unit);
+        if (null_unit_pointer == item_end_unit_pointer)
+            throw std::runtime_error("Missing null byte.");
+
+        return unpack_result_type(
+            key_type(item_unit_pointer, null_unit_pointer),
+            content_type(null_unit_pointer + sizeof(null_unit), item_end_unit_pointer));
+    }
+
+    /// Get the key and stored content of an item by ordinal, following the content page when there is one.
+    template <typename = void>
+    auto get_item(const layout_t &p_layout, size_type p_ordinal) -> unpack_result_type
+    {
+        auto item = get_item(p_layout, p_layout.indices[p_ordinal]);
+        if (p_layout.content_slices.empty())
+            return item;
+
+        const auto &content_slice = p_layout.content_slices[p_ordinal];
+        if (content_slice.byte_offset > p_layout.metadata->true_byte_count || content_slice.byte_count > p_layout.metadata->true_byte_count - content_slice.byte_offset)
+            throw std::runtime_error("Invalid content slice.");
+
+        item.second = content_type(p_layout.origin + content_slice.byte_offset, content_slice.byte_count);
+        return item;
+    }
+
+    /// The generations of an appended bag, and the pages of their live items merged as if they were packed at once.
+    struct layout_chain_t
+    {
+        /// The newest first.
+        std::vector<layout_t> generations;
+        std::vector<slice_t> indices;
+        std::vector<encoding_t> encodings;
+        std::vector<slice_t> content_slices;
+        std::vector<checksum_t> checksums;
+        std::vector<stamp_t> stamps;
+        std::vector<lookup_slot_t> lookup_slots;
+        unit_vector_type key_page;
+    };
+
+    /// Parse the footer of a bag.
+    /// The generations of an appended bag are merged into one index of their live items, the oldest first, so
+    /// readers see it as if it was packed at once. An item is live unless a newer generation has an item of the
+    /// same key, or removes it. Merging costs as much as the items of every generation, which `compact` saves.
+    /// Checksums and stamps are only kept when every generation with items has them.
+    template <typename = void>
+    auto get_layout(const bag_type &p_bag) -> layout_t
+    {
+        auto layout = get_generation_layout(p_bag);
+        if ((layout.extension.flags & chained_flag) == 0)
+            return layout;
+
+        auto chain = std::make_shared<layout_chain_t>();
+        auto &generations = chain->generations;
+        for (std::optional<layout_t> generation = layout; generation; generation = get_previous_generation(*generation))
+            generations.push_back(*generation);
+
+        const auto has_every = [&](auto p_page)
+        {
+            return std::ranges::all_of(generations, [&](const layout_t &p_generation)
+                                       { return p_generation.indices.empty() || !(p_generation.*p_page).empty(); });
+        };
+        const auto has_any = [&](auto p_page)
+        {
+            return std::ranges::any_of(generations, [&](const layout_t &p_generation)
+                                       { return !(p_generation.*p_page).empty(); });
+        };
+        const bool is_encoded = has_any(&layout_t::encodings);
+        const bool is_separated = has_any(&layout_t::content_slices);
+        const bool is_checksummed = has_every(&layout_t::checksums);
+        const bool is_stamped = has_every(&layout_t::stamps);
+        const bool has_lookup = !layout.lookup_slots.empty();
+        const bool has_key_page = !layout.key_page.empty();
+
+        // List the live items of each generation, before its keys shadow the generations after it.
+        std::unordered_set<key_type> shadowed_keys;
+        std::vector<std::vector<size_type>> live_ordinals(generations.size());
+        std::vector<key_type> generation_keys;
+        for (size_type position = 0; position < generations.size(); ++position)
+        {
+            const auto &generation = generations[position];
+            generation_keys.clear();
+            for (size_type ordinal = 0; ordinal < generation.indices.size(); ++ordinal)
+            {
+                const auto key = get_item(generation, ordinal).first;
+                if (!shadowed_keys.contains(key))
+                    live_ordinals[position].push_back(ordinal);
+                generation_keys.push_back(key);
+            }
+            shadowed_keys.insert(generation_keys.begin(), generation_keys.end());
+            for_each_tombstone(generation, [&](key_type p_key)
+                               { shadowed_keys.insert(p_key); });
+        }
+
+        std::vector<size_type> key_hashes;
+        std::vector<key_type> keys;
+        for (size_type position = generations.size(); position-- > 0;)
+        {
+            const auto &generation = generations[position];
+            for (const size_type ordinal : live_ordinals[position])
+            {
+                const auto [key, content] = get_item(generation, ordinal);
+                if (is_separated)
+                {
+                    chain->indices.emplace_back(generation.indices[ordinal].byte_offset, key.size() + sizeof(null_unit));
+                    chain->content_slices.emplace_back(static_cast<size_type>(content.data() - layout.origin), content.size());
+                }
+                else
+                    chain->indices.push_back(generation.indices[ordinal]);
+
+                if (is_encoded)
+                    chain->encodings.push_back(generation.encodings.empty() ? encoding_t(stored_codec_identifier, content.size()) : generation.encodings[ordinal]);
+                if (is_checksummed)
+                    chain->checksums.push_back(generation.checksums[ordinal]);
+                if (is_stamped)
+                    chain->stamps.push_back(generation.stamps[ordinal]);
+                if (has_lookup)
+                    key_hashes.push_back(hash_units(key));
+                if (has_key_page)
+                    keys.push_back(key);
+            }
+        }
+        if (has_lookup)
+            chain->lookup_slots = build_lookup_page(key_hashes);
+        if (has_key_page)
+            chain->key_page = build_key_page(keys);
+
+        layout.indices = chain->indices;
+        layout.encodings = chain->encodings;
+        layout.content_slices = chain->content_slices;
+        layout.checksums = chain->checksums;
+        layout.stamps = chain->stamps;
+        layout.lookup_slots = chain->lookup_slots;
+        layout.key_page = chain->key_page;
+        layout.tombstones = unit_span_type();
+        if (is_encoded)
+            layout.extension.flags |= encoded_flag;
+        if (is_separated)
+            layout.extension.flags |= separated_flag;
+        layout.chain = std::move(chain);
+        return layout;
+    }
+
+    template <attribute_container_c C, typename O>
+    auto get_attributes(const bag_type &p_bag, std::insert_iterator<C> p_output, O &p_observer) -> const unit_type *
+    {
+        const observed_phase_t observed(p_observer, phase_t::list_attributes);
+        const auto layout = get_layout(p_bag);
+        const auto data = layout.metadata;
+        const auto origin = layout.origin;
+
+        // Get attributes.
+        for (const auto &index : layout.indices)
+        {
+            if ((index.byte_offset) >= data->true_byte_count)
+                throw std::runtime_error("Invalid byte offset.");
+            if ((index.byte_offset + index.byte_count) >= data->true_byte_count)
+                throw std::runtime_error("Invalid byte count.");
+
+            const auto key_unit_pointer = origin + index.byte_offset;
+            const auto key = key_type(key_unit_pointer);
+            notify_entry(p_observer, phase_t::list_attributes, key, index.byte_count);
+            p_output = attribute_type(key, index);
+        }
+
+        return origin;
+    }
+
+    template <attribute_container_c C>
+    auto get_attributes(const bag_type &p_bag, std::insert_iterator<C> p_output) -> const unit_type *
+    {
+        null_observer_t observer;
+        return get_attributes(p_bag, p_output, observer);
+    }
+
+    template <typename T>
+    concept unpack_result_container_c = requires {
+        std::declval<std::insert_iterator<T>>() = std::declval<unpack_result_type>();
+    };
+
+    template <typename F>
+    concept unpack_filter_predicate_c = std::predicate<F, attribute_type>;
+
+    /// Storage for decoded contents, and the codecs to decode them with.
+    /// Decoded contents are carved out of chunks that `clear` keeps for the next unpack,
+    /// so repeated unpacks of alike bags on one context stop allocating once the chunks fit.
+    class unpack_context_t
+    {
+    private:
+        struct chunk_t
+        {
+            unit_type *data;
+            size_type byte_count;
+        };
+
+        static constexpr size_type minimum_chunk_byte_count = 64 << 10;
+        static constexpr size_type chunk_alignment = alignof(std::max_align_t);
+
+        std::pmr::memory_resource *resource;
+        std::pmr::vector<chunk_t> chunks;
+        size_type chunk_index = 0;
+        size_type chunk_byte_offset = 0;
+
+        /// Get units that live until `clear`, aligned for any scalar type.
+        auto allocate(size_type p_byte_count) -> std::span<unit_type>
+        {
+            if (p_byte_count == 0)
+                return std::span<unit_type>();
+
+            for (; chunk_index < chunks.size(); ++chunk_index, chunk_byte_offset = 0)
+            {
+                const size_type byte_offset = (chunk_byte_offset + chunk_alignment - 1) & ~(chunk_alignment - 1);
+                if (byte_offset <= chunks[chunk_index].byte_count && p_byte_count <= chunks[chunk_index].byte_count - byte_offset)
+                {
+                    chunk_byte_offset = byte_offset + p_byte_count;
+                    return std::span<unit_type>(chunks[chunk_index].data + byte_offset, p_byte_count);
+                }
+            }
+
+            const size_type chunk_byte_count = std::max({p_byte_count, minimum_chunk_byte_count, chunks.empty() ? 0 : chunks.back().byte_count * 2});
+            chunks.push_back(chunk_t(static_cast<unit_type *>(resource->allocate(chunk_byte_count, chunk_alignment)), chunk_byte_count));
+            chunk_index = chunks.size() - 1;
+            chunk_byte_offset = p_byte_count;
+            return std::span<unit_type>(chunks.back().data, p_byte_count);
+        }
+
+    public:
+        std::vector<codec_t> codecs = builtin_codecs();
+        verify_mode_t verify_mode = verify_mode_t::on_access;
+
+        /// Take the chunks from a memory resource, such as a monotonic buffer on the stack.
+        explicit unpack_context_t(std::pmr::memory_resource *p_resource = std::pmr::get_default_resource())
+            : resource(p_resource), chunks(p_resource) {}
+
+        unpack_context_t(const unpack_context_t &) = delete;
+        auto operator=(const unpack_context_t &) -> unpack_context_t & = delete;
+
+        ~unpack_context_t() { release(); }
+
+        /// Decode a content into storage owned by the context, which lives until `clear`.
+        auto decode(const encoding_t &p_encoding, content_type p_encoded) -> content_type
+        {
+            const auto decoded = allocate(p_encoding.byte_count);
+            decode_content(codecs, p_encoding, p_encoded, decoded);
+            return content_type(decoded);
+        }
+
+        /// Reserve a chunk for decoded contents of this many bytes ahead of time.
+        auto reserve(size_type p_byte_count) -> void
+        {
+            size_type byte_count = 0;
+            for (const auto &chunk : chunks)
+                byte_count += chunk.byte_count;
+            if (byte_count >= p_byte_count)
+                return;
+
+            const size_type chunk_byte_count = std::max(p_byte_count - byte_count, minimum_chunk_byte_count);
+            chunks.push_back(chunk_t(static_cast<unit_type *>(resource->allocate(chunk_byte_count, chunk_alignment)), chunk_byte_count));
+        }
+
+        /// End the lifetime of the decoded contents, keeping their storage for reuse.
+        auto clear() -> void
+        {
+            chunk_index = 0;
+            chunk_byte_offset = 0;
+        }
+
+        /// End the lifetime of the decoded contents, and give their storage back to the memory resource.
+        auto release() -> void
+        {
+            for (const auto &chunk : chunks)
+                resource->deallocate(chunk.data, chunk.byte_count, chunk_alignment);
+            chunks.clear();
+            clear();
+        }
+    };
+
+    /// Get the decoded content of an item, decoding it in the context when it is encoded.
+    template <typename = void>
+    auto get_decoded_content(std::span<const encoding_t> p_encodings, size_type p_ordinal, content_type p_content, unpack_context_t *p_context) -> content_type
+    {
+        if (p_encodings.empty() || p_encodings[p_ordinal].codec == stored_codec_identifier)
+            return p_content;
+        if (p_context == nullptr)
+            throw std::logic_error("Encoded content needs an unpack context.");
+
+        return p_context->decode(p_encodings[p_ordinal], p_content);
+    }
+
+    /// View a content as an array of trivially copyable objects in place.
+    /// The content must be aligned for T, as contents of a bag packed with `content_alignment` are when its origin is.
+    template <typename T>
+        requires std::is_trivially_copyable_v<T>
+    auto as_array(content_type p_content) -> std::span<const T>
+    {
+        if (reinterpret_cast<std::uintptr_t>(p_content.data()) % alignof(T) != 0)
+            throw std::runtime_error("Misaligned content.");
+        if (p_content.size() % sizeof(T) != 0)
+            throw std::runtime_error("Invalid content size.");
+
+        return std::span<const T>(reinterpret_cast<const T *>(p_content.data()), p_content.size() / sizeof(T));
+    }
+
+    /// Get the stored content of an item, to pack it into another bag as it is.
+    /// The descriptor is of the file the whole bag is read from, when there is one.
+    template <typename = void>
+    auto get_stored_item_source(const bag_type &p_bag, const layout_t &p_layout, size_type p_ordinal, int p_descriptor = -1) -> stored_item_source_t
+    {
+        const auto content = get_item(p_layout, p_ordinal).second;
+        return stored_item_source_t(
+            content,
+            p_layout.encodings.empty() ? encoding_t(stored_codec_identifier, content.size()) : p_layout.encodings[p_ordinal],
+            p_layout.checksums.empty() ? std::nullopt : std::optional<uint32_t>(p_layout.checksums[p_ordinal].content),
+            p_layout.stamps.empty() ? std::nullopt : std::optional<stamp_t>(p_layout.stamps[p_ordinal]),
+            p_descriptor,
+            static_cast<size_type>(content.data() - static_cast<const unit_type *>(p_bag.data())));
+    }
+
+    /// Whether the stored key and content of an item match the checksum page, when there is one.
+    template <typename = void>
+    auto is_item_intact(const layout_t &p_layout, size_type p_ordinal, const unpack_result_type &p_item) -> bool
+    {
+        if (p_layout.checksums.empty())
+            return true;
+
+        const auto &[key, content] = p_item;
+        const auto &checksum = p_layout.checksums[p_ordinal];
+        return crc32c(unit_span_type(key.data(), key.size() + sizeof(null_unit))) == checksum.key && crc32c(content) == checksum.content;
+    }
+
+    template <typename = void>
+    auto verify_item(const layout_t &p_layout, size_type p_ordinal, const unpack_result_type &p_item) -> void
+    {
+        if (!is_item_intact(p_layout, p_ordinal, p_item))
+            throw std::runtime_error("Checksum mismatch for '" + unit_string_type(p_item.first) + "'.");
+    }
+
+    /// Check the index page and the pages after it against the page checksum, when there is a checksum page.
+    /// Each generation of an appended bag is checked against its own.
+    template <typename = void>
+    auto verify_pages(const layout_t &p_layout) -> void
+    {
+        if (p_layout.chain)
+        {
+            for (const auto &generation : p_layout.chain->generations)
+                verify_pages(generation);
+            return;
+        }
+        if (p_layout.checksums.empty())
+            return;
+
+        const auto &index_page = p_layout.metadata->index_page;
+        const auto &checksum_page = p_layout.extension.checksum_page;
+        if (checksum_page.byte_offset < index_page.byte_offset)
+            throw std::runtime_error("Invalid checksum page.");
+
+        const auto pages = get_page<unit_type>(p_layout, slice_t(index_page.byte_offset, checksum_page.byte_offset + checksum_page.byte_count - index_page.byte_offset));
+        if (crc32c(pages) != p_layout.extension.page_checksum)
+            throw std::runtime_error("Page checksum mismatch.");
+    }
+
+    /// Get the key and stored content of an item by ordinal, verifying them as the mode asks.
+    template <typename = void>
+    auto get_verified_item(const layout_t &p_layout, size_type p_ordinal, verify_mode_t p_mode) -> unpack_result_type
+    {
+        auto item = get_item(p_layout, p_ordinal);
+        if (p_mode != verify_mode_t::off)
+            verify_item(p_layout, p_ordinal, item);
+        return item;
+    }
+
+    /// Unpack the items passing the filter predicate.
+    /// Encoded contents are only decoded for those items, into the unpack context.
+    template <unpack_result_container_c C, unpack_filter_predicate_c F, typename O>
+    auto unpack(const bag_type &p_bag, F p_filter_predicate, std::insert_iterator<C> p_output, unpack_context_t *p_context, O &p_observer) -> void
+    {
+        const auto layout = get_layout(p_bag);
+        const auto verify_mode = p_context ? p_context->verify_mode : verify_mode_t::on_access;
+        if (verify_mode == verify_mode_t::all)
+        {
+            const observed_phase_t observed(p_observer, phase_t::verify_pages);
+            verify_pages(layout);
+            for (size_type ordinal = 0; ordinal < layout.indices.size(); ++ordinal)
+                verify_item(layout, ordinal, get_item(layout, ordinal));
+        }
+
+        // The attributes are listed in the same pass as the items are unpacked, so each key is only looked for once.
+        const observed_phase_t observed(p_observer, phase_t::unpack_items);
+        for (size_type ordinal = 0; ordinal < layout.indices.size(); ++ordinal)
+        {
+            const auto item = get_item(layout, ordinal);
+            const auto &[key, content] = item;
+            const auto &index = layout.indices[ordinal];
+            notify_entry(p_observer, phase_t::list_attributes, key, index.byte_count);
+            if (!p_filter_predicate(attribute_type(key, index)))
+                continue;
+
+            if (verify_mode == verify_mode_t::on_access)
+                verify_item(layout, ordinal, item);
+
+            const auto decoded_content = get_decoded_content(layout.encodings, ordinal, content, p_context);
+            notify_entry(p_observer, phase_t::unpack_items, key, decoded_content.size());
+            p_output = unpack_result_type(key, decoded_content);
+        }
+    }
+
+    template <unpack_result_container_c C, unpack_filter_predicate_c F>
+    auto unpack(const bag_type &p_bag, F p_filter_predicate, std::insert_iterator<C> p_output, unpack_context_t *p_context = nullptr) -> void
+    {
+        null_observer_t observer;
+        unpack(p_bag, p_filter_predicate, p_output, p_context, observer);
+    }
+
+    template <unpack_result_container_c C>
+    auto unpack_all(const bag_type &p_bag, std::insert_iterator<C> p_output, unpack_context_t *p_context = nullptr) -> void
+    {
+        unpack(p_bag, [](const attribute_type &)
+               { return true; }, p_output, p_context);
+    }
+
+    template <unpack_result_container_c C, typename O>
+    auto unpack_all(const bag_type &p_bag, std::insert_iterator<C> p_output, unpack_context_t *p_context, O &p_observer) -> void
+    {
+        unpack(p_bag, [](const attribute_type &)
+               { return true; }, p_output, p_context, p_observer);
+    }
+
+    template <typename A>
+    concept unpack_result_allocator_c = requires(A p_allocator) {
+        requires std::same_as<typename A::value_type, unpack_result_type>;
+        { p_allocator.allocate(size_type(1)) } -> std::same_as<unpack_result_type *>;
+    };
+
+    /// Unpack every item into a vector taking its storage from the allocator, reserved for the item count up front.
+    template <unpack_result_allocator_c A = std::allocator<unpack_result_type>>
+    auto unpack_all(const bag_type &p_bag, const A &p_allocator = A(), unpack_context_t *p_context = nullptr) -> std::vector<unpack_result_type, A>
+    {
+        std::vector<unpack_result_type, A> items(p_allocator);
+        items.reserve(get_layout(p_bag).indices.size());
+        unpack_all(p_bag, std::inserter(items, items.end()), p_context);
+        return items;
+    }
+
+    /// A lazy view of the items of a bag, each read from its index only when it is reached.
+    /// It allocates nothing, except to decode encoded contents into the unpack context.
+    class entry_view_t : public std::ranges::view_interface<entry_view_t>
+    {
+    private:
+        layout_t layout{};
+        unpack_context_t *context = nullptr;
+
+    public:
+        class iterator_t
+        {
+        private:
+            const entry_view_t *view = nullptr;
+            size_type ordinal = 0;
+
+        public:
+            using iterator_concept = std::random_access_iterator_tag;
+            using iterator_category = std::input_iterator_tag;
+            using value_type = unpack_result_type;
+            using difference_type = std::ptrdiff_t;
+
+            iterator_t() = default;
+
+            iterator_t(const entry_view_t *p_view, size_type p_ordinal)
+                : view(p_view), ordinal(p_ordinal) {}
+
+            auto operator*() const -> value_type { return view->get(ordinal); }
+
+            auto operator[](difference_type p_offset) const -> value_type { return *(*this + p_offset); }
+
+            auto operator++() -> iterator_t &
+            {
+                ++ordinal;
+                return *this;
+            }
+
+            auto operator++(int) -> iterator_t
+            {
+                iterator_t temp = *this;
+                ++ordinal;
+                return temp;
+            }
+
+            auto operator--() -> iterator_t &
+            {
+                --ordinal;
+                return *this;
+            }
+
+            auto operator--(int) -> iterator_t
+            {
+                iterator_t temp = *this;
+                --ordinal;
+                return temp;
+            }
+
+            auto operator+=(difference_type p_offset) -> iterator_t &
+            {
+                ordinal += p_offset;
+                return *this;
+            }
+
+            auto operator-=(difference_type p_offset) -> iterator_t &
+            {
+                ordinal -= p_offset;
+                return *this;
+            }
+
+            friend auto operator+(iterator_t p_it, difference_type p_offset) -> iterator_t { return p_it += p_offset; }
+
+            friend auto operator+(difference_type p_offset, iterator_t p_it) -> iterator_t { return p_it += p_offset; }
+
+            friend auto operator-(iterator_t p_it, difference_type p_offset) -> iterator_t { return p_it -= p_offset; }
+
+            friend auto operator-(const iterator_t &p_left, const iterator_t &p_right) -> difference_type
+            {
+                return static_cast<difference_type>(p_left.ordinal) - static_cast<difference_type>(p_right.ordinal);
+            }
+
+            auto operator==(const iterator_t &p_other) const -> bool { return ordinal == p_other.ordinal; }
+
+            auto operator<=>(const iterator_t &p_other) const -> std::strong_ordering { return ordinal <=> p_other.ordinal; }
+        };
+
+        entry_view_t() = default;
+
+        entry_view_t(const bag_type &p_bag, unpack_context_t *p_context)
+            : layout(get_layout(p_bag)), context(p_context) {}
+
+        auto begin() const -> iterator_t { return iterator_t(this, 0); }
+
+        auto end() const -> iterator_t { return iterator_t(this, layout.indices.size()); }
+
+        auto size() const -> size_type { return layout.indices.size(); }
+
+        /// Get an item by ordinal, verified as the context asks and decoded into it.
+        auto get(size_type p_ordinal) const -> unpack_result_type
+        {
+            const auto [key, content] = get_verified_item(layout, p_ordinal, context ? context->verify_mode : verify_mode_t::on_access);
+            return unpack_result_type(key, get_decoded_content(layout.encodings, p_ordinal, content, context));
+        }
+    };
+
+    /// View the items of a bag lazily, to compose with range adaptors.
+    template <typename = void>
+    auto entries(const bag_type &p_bag, unpack_context_t *p_context = nullptr) -> entry_view_t
+    {
+        return entry_view_t(p_bag, p_context);
+    }
+
+    /// Find the content of a key among the items of a layout.
+    /// It probes the lookup page when there is one, and scans the indices otherwise.
+    template <typename = void>
+    auto find(const layout_t &p_layout, key_type p_key, unpack_context_t *p_context = nullptr) -> std::optional<content_type>
+    {
+        const auto &layout = p_layout;
+        const auto verify_mode = p_context ? p_context->verify_mode : verify_mode_t::on_access;
+
+        if (layout.lookup_slots.empty())
+        {
+            for (size_type ordinal = 0; ordinal < layout.indices.size(); ++ordinal)
+            {
+                const auto item = get_item(layout, ordinal);
+                if (item.first != p_key)
+                    continue;
+
+                if (verify_mode != verify_mode_t::off)
+                    verify_item(layout, ordinal, item);
+                return get_decoded_content(layout.encodings, ordinal, item.second, p_context);
+            }
+            return std::nullopt;
+        }
+
+        const auto slots = layout.lookup_slots;
+        const size_type hash = hash_units(p_key);
+        const auto tag = static_cast<uint32_t>(hash >> 32);
+        const size_type mask = slots.size() - 1;
+        for (size_type position = hash & mask, probe_count = 0; probe_count < slots.size(); position = (position + 1) & mask, ++probe_count)
+        {
+            const auto &slot = slots[position];
+            if (slot.ordinal == 0)
+                break;
+            if (slot.tag != tag)
+                continue;
+            if (slot.ordinal > layout.indices.size())
+                throw std::runtime_error("Invalid lookup ordinal.");
+
+            const auto ordinal = static_cast<size_type>(slot.ordinal - 1);
+            const auto item = get_item(layout, ordinal);
+            if (item.first != p_key)
+                continue;
+
+            if (verify_mode != verify_mode_t::off)
+                verify_item(layout, ordinal, item);
+            return get_decoded_content(layout.encodings, ordinal, item.second, p_context);
+        }
+
+        return std::nullopt;
+    }
+
+    /// Find the content of a key.
+    /// The generations of an appended bag are looked through from the newest, without merging them.
+    template <typename = void>
+    auto find(const bag_type &p_bag, key_type p_key, unpack_context_t *p_context = nullptr) -> std::optional<content_type>
+    {
+        for (std::optional<layout_t> generation = get_generation_layout(p_bag); generation; generation = get_previous_generation(*generation))
+        {
+            if (const auto content = find(*generation, p_key, p_context))
+                return content;
+            if (is_removed(*generation, p_key))
+                return std::nullopt;
+        }
+
+        return std::nullopt;
+    }
+
+    /// Verify the pages and every item of a bag against its checksum page.
+    /// Return the keys of the items that do not match, or throw when the pages do not.
+    template <typename = void>
+    auto verify(const bag_type &p_bag) -> std::vector<key_type>
+    {
+        const auto layout = get_layout(p_bag);
+        if (layout.checksums.empty())
+            throw std::runtime_error("Missing checksum page.");
+        verify_pages(layout);
+
+        std::vector<key_type> corrupted_keys;
+        for (size_type ordinal = 0; ordinal < layout.indices.size(); ++ordinal)
+        {
+            const auto item = get_item(layout, ordinal);
+            if (!is_item_intact(layout, ordinal, item))
+                corrupted_keys.push_back(item.first);
+        }
+
+        return corrupted_keys;
+    }
+
+    /// A bag whose whole structure is checked once when it is opened, so its accessors need not check it again.
+    /// Opening checks the mark and sizes, that every page, item and content slice is within the bag, that every key ends
+    /// with a null byte within its item, that no item, content or page overlaps another, and that the lookup page is sound.
+    /// Contents shared by deduplicated items are the only slices that may be the same.
+    class validated_bag_t
+    {
+    private:
+        bag_type bag;
+        layout_t layout{};
+        /// The key and stored content of each item, parallel to the indices.
+        std::vector<unpack_result_type> items;
+        std::span<const lookup_slot_t> lookup_slots;
+        /// Whether each item has had its checksum verified, when it was not on opening, so it is verified at most once.
+        std::unique_ptr<std::atomic<bool>[]> verified_items;
+
+    public:
+        /// Also check the page checksum and the checksum of every item with `verify_mode_t::all`.
+        /// Otherwise, accessors verify the checksum of an item the first time it is accessed, unless their context turns verifying off.
+        explicit validated_bag_t(const bag_type &p_bag, verify_mode_t p_verify_mode = verify_mode_t::all)
+            : bag(p_bag), layout(libbag::get_layout(p_bag))
+        {
+            lookup_slots = layout.lookup_slots;
+            if (!lookup_slots.empty())
+            {
+                if (lookup_slots.size() < layout.indices.size())
+                    throw std::runtime_error("Invalid lookup page.");
+                for (const auto &slot : lookup_slots)
+                    if (slot.ordinal > layout.indices.size())
+                        throw std::runtime_error("Invalid lookup ordinal.");
+            }
+
+            items.reserve(layout.indices.size());
+            for (size_type ordinal = 0; ordinal < layout.indices.size(); ++ordinal)
+                items.push_back(libbag::get_item(layout, ordinal));
+
+            // Sort every region by where it starts, then check each one ends before the next starts.
+            std::vector<slice_t> content_slices(layout.content_slices.begin(), layout.content_slices.end());
+            const auto by_position = [](const slice_t &p_left, const slice_t &p_right)
+            {
+                return std::pair(p_left.byte_offset, p_left.byte_count) < std::pair(p_right.byte_offset, p_right.byte_count);
+            };
+            std::ranges::sort(content_slices, by_position);
+            content_slices.erase(std::unique(content_slices.begin(), content_slices.end(), [](const slice_t &p_left, const slice_t &p_right)
+                                             { return p_left.byte_offset == p_right.byte_offset && p_left.byte_count == p_right.byte_count; }),
+                                 content_slices.end());
+
+            std::vector<slice_t> regions(layout.indices.begin(), layout.indices.end());
+            regions.insert(regions.end(), content_slices.begin(), content_slices.end());
+
+            // The pages and footer of every generation, as an appended bag keeps those it replaced.
+            const auto generations = layout.chain ? std::span<const layout_t>(layout.chain->generations) : std::span<const layout_t>(&layout, 1);
+            for (const auto &generation : generations)
+            {
+                const auto data = generation.metadata;
+                const auto &extension = generation.extension;
+                for (const auto &page : {data->index_page, extension.lookup_page, extension.encoding_page, extension.content_page, extension.checksum_page, extension.stamp_page, extension.key_page, extension.tombstone_page})
+                    regions.push_back(page);
+
+                // The footer is the metadata, and the extension with its size when there is one.
+                size_type footer_byte_count = sizeof(metadata_t);
+                if (data->mark == extended_identifier_mark)
+                {
+                    size_type extension_byte_count;
+                    std::memcpy(&extension_byte_count, generation.origin + data->true_byte_count - sizeof(metadata_t) - sizeof(extension_byte_count), sizeof(extension_byte_count));
+                    footer_byte_count += sizeof(extension_byte_count) + extension_byte_count;
+                }
+                regions.emplace_back(data->true_byte_count - footer_byte_count, footer_byte_count);
+            }
+            std::erase_if(regions, [](const slice_t &p_region)
+                          { return p_region.byte_count == 0; });
+            std::ranges::sort(regions, by_position);
+            for (size_type position = 1; position < regions.size(); ++position)
+                if (regions[position - 1].byte_offset + regions[position - 1].byte_count > regions[position].byte_offset)
+                    throw std::runtime_error("Overlapping slices.");
+
+            if (p_verify_mode == verify_mode_t::all)
+            {
+                verify_pages(layout);
+                for (size_type ordinal = 0; ordinal < items.size(); ++ordinal)
+                    verify_item(layout, ordinal, items[ordinal]);
+            }
+            else if (!layout.checksums.empty())
+                verified_items = std::make_unique<std::atomic<bool>[]>(items.size());
+        }
+
+        auto get_bag() const -> const bag_type & { return bag; }
+
+        auto get_layout() const -> const layout_t & { return layout; }
+
+        auto size() const -> size_type { return items.size(); }
+
+        /// Get the key and stored content of an item by ordinal, without checking anything.
+        auto get_item(size_type p_ordinal) const -> const unpack_result_type & { return items[p_ordinal]; }
+
+        auto get_attribute(size_type p_ordinal) const -> attribute_type { return attribute_type(items[p_ordinal].first, layout.indices[p_ordinal]); }
+
+        /// Verify the checksum of an item unless the mode is off, or it was verified before. Threads may race to verify it twice, which is harmless.
+        auto verify_item_once(size_type p_ordinal, verify_mode_t p_mode) const -> void
+        {
+            if (p_mode == verify_mode_t::off || !verified_items || verified_items[p_ordinal].load(std::memory_order_acquire))
+                return;
+
+            verify_item(layout, p_ordinal, items[p_ordinal]);
+            verified_items[p_ordinal].store(true, std::memory_order_release);
+        }
+
+        /// Find the ordinal of a key, probing the lookup page when there is one and scanning the keys otherwise.
+        auto find_ordinal(key_type p_key) const -> std::optional<size_type>
+        {
+            if (lookup_slots.empty())
+            {
+                for (size_type ordinal = 0; ordinal < items.size(); ++ordinal)
+                    if (items[ordinal].first == p_key)
+                        return ordinal;
+                return std::nullopt;
+            }
+
+            const size_type hash = hash_units(p_key);
+            const auto tag = static_cast<uint32_t>(hash >> 32);
+            const size_type mask = lookup_slots.size() - 1;
+            for (size_type position = hash & mask, probe_count = 0; probe_count < lookup_slots.size(); position = (position + 1) & mask, ++probe_count)
+            {
+                const auto &slot = lookup_slots[position];
+                if (slot.ordinal == 0)
+                    break;
+                if (slot.tag == tag && items[slot.ordinal - 1].first == p_key)
+                    return static_cast<size_type>(slot.ordinal - 1);
+            }
+
+            return std::nullopt;
+        }
+
+        /// Find the content of a key, decoding it into the context when it is encoded.
+        auto find(key_type p_key, unpack_context_t *p_context = nullptr) const -> std::optional<content_type>
+        {
+            const auto ordinal = find_ordinal(p_key);
+            if (!ordinal)
+                return std::nullopt;
+
+            verify_item_once(*ordinal, p_context ? p_context->verify_mode : verify_mode_t::on_access);
+            return get_decoded_content(layout.encodings, *ordinal, items[*ordinal].second, p_context);
+        }
+    };
+
+    template <attribute_container_c C>
+    auto get_attributes(const validated_bag_t &p_bag, std::insert_iterator<C> p_output) -> const unit_type *
+    {
+        for (size_type ordinal = 0; ordinal < p_bag.size(); ++ordinal)
+            p_output = p_bag.get_attribute(ordinal);
+
+        return p_bag.get_layout().origin;
+    }
+
+    /// Unpack the items of a validated bag passing the filter predicate, in one pass without checking their structure again.
+    /// The checksum of each item is verified the first time it is accessed, unless the context turns verifying off.
+    template <unpack_result_container_c C, unpack_filter_predicate_c F, typename O>
+    auto unpack(const validated_bag_t &p_bag, F p_filter_predicate, std::insert_iterator<C> p_output, unpack_context_t *p_context, O &p_observer) -> void
+    {
+        const auto &encodings = p_bag.get_layout().encodings;
+        const auto verify_mode = p_context ? p_context->verify_mode : verify_mode_t::on_access;
+        const observed_phase_t observed(p_observer, phase_t::unpack_items);
+        for (size_type ordinal = 0; ordinal < p_bag.size(); ++ordinal)
+        {
+            if (!p_filter_predicate(p_bag.get_attribute(ordinal)))
+                continue;
+
+            p_bag.verify_item_once(ordinal, verify_mode);
+            const auto &[key, content] = p_bag.get_item(ordinal);
+            const auto decoded_content = get_decoded_content(encodings, ordinal, content, p_context);
+            notify_entry(p_observer, phase_t::unpack_items, key, decoded_content.size());
+            p_output = unpack_result_type(key, decoded_content);
+        }
+    }
+
+    template <unpack_result_container_c C, unpack_filter_predicate_c F>
+    auto unpack(const validated_bag_t &p_bag, F p_filter_predicate, std::insert_iterator<C> p_output, unpack_context_t *p_context = nullptr) -> void
+    {
+        null_observer_t observer;
+        unpack(p_bag, p_filter_predicate, p_output, p_context, observer);
+    }
+
+    template <unpack_result_container_c C>
+    auto unpack_all(const validated_bag_t &p_bag, std::insert_iterator<C> p_output, unpack_context_t *p_context = nullptr) -> void
+    {
+        unpack(p_bag, [](const attribute_type &)
+               { return true; }, p_output, p_context);
+    }
+
+    template <unpack_result_container_c C, typename O>
+    auto unpack_all(const validated_bag_t &p_bag, std::insert_iterator<C> p_output, unpack_context_t *p_context, O &p_observer) -> void
+    {
+        unpack(p_bag, [](const attribute_type &)
+               { return true; }, p_output, p_context, p_observer);
+    }
+
+    /// A chunk of the decoded content of an item read from a stream, with the key of the item.
+    struct stream_chunk_t
+    {
+        key_type key;
+        /// Of the whole decoded content.
+        size_type byte_count;
+        /// Where the chunk starts in the decoded content.
+        size_type byte_offset;
+        content_type content;
+
+        constexpr stream_chunk_t(key_type p_key, size_type p_byte_count, size_type p_byte_offset, content_type p_content)
+            : key(p_key), byte_count(p_byte_count), byte_offset(p_byte_offset), content(p_content) {}
+
+        auto is_last() const -> bool { return byte_offset + content.size() == byte_count; }
+    };
+
+    template <typename F>
+    concept stream_callback_c = std::invocable<F, const stream_chunk_t &>;
+
+    struct stream_options_t
+    {
+        /// Codecs to decode encoded contents with.
+        std::vector<codec_t> codecs = builtin_codecs();
+        /// Which checksums to verify, where verifying all is verifying every item as the pages come last.
+        verify_mode_t verify_mode = verify_mode_t::on_access;
+        /// The most bytes of a stored content read at once.
+        size_type chunk_byte_count = 1 << 20;
+        /// The longest key accepted, with its null byte, as headers are read before anything is checked.
+        size_type max_key_byte_count = 1 << 16;
+        /// The most bytes of an encoded content, and of it decoded, accepted, as both are held whole.
+        size_type max_buffered_byte_count = size_type(1) << 30;
+    };
+
+    /// Unpack a streamed bag in one pass from its start, such as from a pipe while it is downloaded.
+    /// The content of each item is given in chunks, at least one and in order, so stored contents are never held whole.
+    /// Encoded contents are held whole, and decoded whole before they are given, so they are limited by the options.
+    /// The stream is read up to the end of the items, and the pages after them are left unread.
+    /// A checksum mismatch of a stored content is thrown after its chunks are given.
+    /// Verifying all throws for an item without checksums, as for a bag without a checksum page.
+    template <stream_callback_c F>
+    auto stream_unpack(std::basic_istream<unit_type> &p_input, F p_callback, const stream_options_t &p_options = {}) -> void
+    {
+        const auto read_units = [&](std::span<unit_type> p_units)
+        {
+            p_input.read(p_units.data(), static_cast<std::streamsize>(p_units.size()));
+            if (static_cast<size_type>(p_input.gcount()) != p_units.size())
+                throw std::runtime_error("Truncated stream.");
+        };
+
+        size_type mark = 0;
+        read_units(std::span(reinterpret_cast<unit_type *>(&mark), sizeof(mark)));
+        if (mark != stream_identifier_mark)
+            throw std::runtime_error("Invalid marking.");
+
+        const size_type chunk_byte_count = std::max<size_type>(p_options.chunk_byte_count, 1);
+        unit_string_type key;
+        unit_vector_type buffer;
+        unit_vector_type decoded;
+        for (;;)
+        {
+            stream_header_t header;
+            read_units(std::span(reinterpret_cast<unit_type *>(&header), sizeof(header)));
+            if (header.key_byte_count == 0)
+                return;
+
+            if (header.key_byte_count > p_options.max_key_byte_count)
+                throw std::runtime_error("Key exceeds the limit.");
+            if (header.encoding.codec != stored_codec_identifier &&
+                (header.content_byte_count > p_options.max_buffered_byte_count || header.encoding.byte_count > p_options.max_buffered_byte_count))
+                throw std::runtime_error("Encoded content exceeds the limit.");
+
+            p_input.ignore(static_cast<std::streamsize>(header.padding_byte_count));
+            if (static_cast<size_type>(p_input.gcount()) != header.padding_byte_count)
+                throw std::runtime_error("Truncated stream.");
+
+            key.resize(header.key_byte_count);
+            read_units(key);
+            if (std::find(key.begin(), key.end(), null_unit) != key.end() - 1)
+                throw std::runtime_error("Missing null byte.");
+
+            const auto item_key = key_type(key.data(), key.size() - 1);
+            const bool is_verified = p_options.verify_mode != verify_mode_t::off && (header.flags & checksummed_stream_flag) != 0;
+            if (!is_verified && p_options.verify_mode == verify_mode_t::all)
+                throw std::runtime_error("Missing checksum page.");
+            const auto verify_checksum = [&](uint32_t p_checksum, uint32_t p_expected_checksum)
+            {
+                if (p_checksum != p_expected_checksum)
+                    throw std::runtime_error("Checksum mismatch for '" + unit_string_type(item_key) + "'.");
+            };
+            if (is_verified)
+                verify_checksum(crc32c(key), header.checksum.key);
+
+            if (header.encoding.codec == stored_codec_identifier)
+            {
+                if (header.encoding.byte_count != header.content_byte_count)
+                    throw std::runtime_error("Invalid stream header.");
+
+                buffer.resize(std::min(chunk_byte_count, std::max<size_type>(header.content_byte_count, buffer.size())));
+                uint32_t checksum = 0;
+                size_type byte_offset = 0;
+                do
+                {
+                    const auto chunk = std::span<unit_type>(buffer.data(), std::min<size_type>(buffer.size(), header.content_byte_count - byte_offset));
+                    read_units(chunk);
+                    if (is_verified)
+                        checksum = crc32c(chunk, checksum);
+                    p_callback(stream_chunk_t(item_key, header.content_byte_count, byte_offset, chunk));
+                    byte_offset += chunk.size();
+                } while (byte_offset < header.content_byte_count);
+
+                if (is_verified)
+                    verify_checksum(checksum, header.checksum.content);
+                continue;
+            }
+
+            buffer.resize(header.content_byte_count);
+            read_units(buffer);
+            if (is_verified)
+                verify_checksum(crc32c(buffer), header.checksum.content);
+
+            decoded.resize(header.encoding.byte_count);
+            decode_content(p_options.codecs, header.encoding, buffer, decoded);
+            size_type byte_offset = 0;
+            do
+            {
+                const auto chunk = content_type(decoded).subspan(byte_offset, std::min<size_type>(chunk_byte_count, decoded.size() - byte_offset));
+                p_callback(stream_chunk_t(item_key, decoded.size(), byte_offset, chunk));
+                byte_offset += chunk.size();
+            } while (byte_offset < decoded.size());
+
+            // Keep the buffers bounded by the chunk size between large encoded contents.
+            if (buffer.size() > chunk_byte_count)
+                unit_vector_type().swap(buffer);
+            if (decoded.size() > chunk_byte_count)
+                unit_vector_type().swap(decoded);
+        }
+    }
+
+    using listing_type = std::pair<unit_string_type, size_type>;
+
+    template <typename T>
+    concept listing_container_c = requires {
+        std::declval<std::insert_iterator<T>>() = std::declval<listing_type>();
+    };
+
+    /// List the keys starting with a prefix, such as a directory, in order and with their ordinals.
+    /// With a key page, only the blocks holding those keys are read, and no item is.
+    template <listing_container_c C>
+    auto list(const bag_type &p_bag, key_type p_prefix, std::insert_iterator<C> p_output) -> void
+    {
+        const auto layout = get_layout(p_bag);
+        if (layout.key_page.empty())
+        {
+            std::vector<listing_type> listings;
+            for (size_type ordinal = 0; ordinal < layout.indices.size(); ++ordinal)
+                if (const auto key = get_item(layout, layout.indices[ordinal]).first; key.starts_with(p_prefix))
+                    listings.emplace_back(key, ordinal);
+
+            std::stable_sort(listings.begin(), listings.end(), [](const listing_type &p_left, const listing_type &p_right)
+                             { return p_left.first < p_right.first; });
+            for (auto &listing : listings)
+                p_output = std::move(listing);
+            return;
+        }
+
+        const auto page = layout.key_page;
+        size_type block_count;
+        if (page.size() < sizeof(block_count))
+            throw std::runtime_error("Invalid key page.");
+        std::memcpy(&block_count, page.data(), sizeof(block_count));
+        if (block_count > page.size() / sizeof(size_type) - 1)
+            throw std::runtime_error("Invalid key page.");
+
+        const auto get_block = [&](size_type p_block) -> unit_span_type
+        {
+            size_type begin;
+            size_type end = page.size();
+            std::memcpy(&begin, page.data() + sizeof(size_type) * (1 + p_block), sizeof(begin));
+            if (p_block + 1 < block_count)
+                std::memcpy(&end, page.data() + sizeof(size_type) * (2 + p_block), sizeof(end));
+            if (begin < sizeof(size_type) * (1 + block_count) || begin > end || end > page.size())
+                throw std::runtime_error("Invalid key page.");
+            return page.subspan(begin, end - begin);
+        };
+
+        unit_string_type key;
+        size_type ordinal;
+        const auto read_entry = [&](const unit_type *&p_input, const unit_type *p_input_end)
+        {
+            size_type shared_byte_count;
+            size_type suffix_byte_count;
+            if (!read_varint(p_input, p_input_end, shared_byte_count) || !read_varint(p_input, p_input_end, suffix_byte_count) ||
+                shared_byte_count > key.size() || suffix_byte_count > static_cast<size_type>(p_input_end - p_input))
+                throw std::runtime_error("Invalid key page.");
+
+            key.resize(shared_byte_count);
+            key.append(p_input, suffix_byte_count);
+            p_input += suffix_byte_count;
+            if (!read_varint(p_input, p_input_end, ordinal) || ordinal >= layout.indices.size())
+                throw std::runtime_error("Invalid key page.");
+        };
+
+        // Find the first block starting at or after the prefix, as the keys may start in the block before it.
+        size_type low = 0;
+        for (size_type high = block_count; low < high;)
+        {
+            const size_type middle = low + (high - low) / 2;
+            const auto block = get_block(middle);
+            const unit_type *input = block.data();
+            key.clear();
+            read_entry(input, block.data() + block.size());
+            if (key_type(key) < p_prefix)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+
+        for (size_type block_index = low == 0 ? 0 : low - 1; block_index < block_count; ++block_index)
+        {
+            const auto block = get_block(block_index);
+            const unit_type *input = block.data();
+            key.clear();
+            while (input != block.data() + block.size())
+            {
+                read_entry(input, block.data() + block.size());
+                if (key.starts_with(p_prefix))
+                    p_output = listing_type(key, ordinal);
+                else if (key_type(key) > p_prefix)
+                    return;
+            }
+        }
+    }
+
+    struct pack_options_t
+    {
+        /// Write a lookup page for constant time `find`.
+        bool lookup_index = false;
+        /// Encode each content with this codec, unless it does not get smaller.
+        std::optional<codec_t> codec;
+        /// Contents from content sources larger than this are stored without encoding, so they are never held in memory.
+        size_type codec_byte_limit = 64 << 20;
+        /// Store identical contents once, shared by their items through the content page.
+        bool deduplicate = false;
+        /// Write a checksum page, with the CRC32C of each item and of the pages.
+        bool checksum = false;
+        /// Pad before each item so its content starts at a multiple of this many bytes from the origin.
+        /// It must be a power of two, and zero or one leaves contents unaligned.
+        size_type content_alignment = 0;
+        /// Write a stamp page, with the modification time and content hash each item was packed from.
+        bool stamp = false;
+        /// Write a key page, with the keys sorted and front-coded for `list`.
+        /// Keys stay before their contents too, so items are still read in place, at the cost of storing every key twice.
+        bool key_table = false;
+        /// The number of items to be packed when it is known ahead, to reserve the pages for.
+        /// It is taken from the iterators when they tell their distance in constant time.
+        size_type expected_item_count = 0;
+        /// Where the pages are built while packing, such as a monotonic buffer reused between packs.
+        std::pmr::memory_resource *memory_resource = std::pmr::get_default_resource();
+        /// Write a mark first and a header before each item, so the bag can be unpacked from a pipe by `stream_unpack`.
+        /// Contents cannot be shared, and nothing can be appended.
+        bool stream = false;
+        /// Mark the bag as the manifest of shards, as `pack_manifest` does.
+        bool manifest = false;
+    };
+
+    /// Pack items after the last generation of a base bag, or from scratch when there is none.
+    /// The sink continues from the end of the base bag, and only the items and the removed keys are written,
+    /// in a generation chained to the footer of the base bag.
+    /// The pages the base bag has for all its items are kept, even those the options do not ask for.
+    template <packing_iterator_c Iterator, output_sink_c S, typename O>
+    auto pack_onto(const layout_t *p_base, const std::set<key_type> &p_removed_keys, Iterator p_begin, Iterator p_end, S &p_sink, const pack_options_t &p_options, O &p_observer) -> void
+    {
+        // A content as it is stored, which later items may share.
+        struct stored_content_t
+        {
+            slice_t slice;
+            encoding_t encoding;
+            uint32_t checksum;
+        };
+
+        const auto resource = p_options.memory_resource;
+        std::pmr::vector<slice_t> indices(resource);
+        std::pmr::vector<size_type> key_hashes(resource);
+        std::pmr::vector<encoding_t> encodings(resource);
+        std::pmr::vector<slice_t> content_slices(resource);
+        std::pmr::vector<checksum_t> checksums(resource);
+        std::pmr::vector<stamp_t> stamps(resource);
+        std::pmr::vector<unit_string_type> keys(resource);
+        std::pmr::unordered_map<content_hash_t, stored_content_t, content_hash_hasher_t> stored_contents(resource);
+        unit_vector_type buffer;
+        unit_vector_type encoded;
+        unit_vector_type source_content;
+        size_type current_byte_offset = p_base ? p_base->metadata->true_byte_count : 0;
+
+        // A page of a generation without items is empty, but is still there when it starts after the first byte.
+        const auto has_base_page = [&](slice_t extension_t::*p_page)
+        { return p_base && ((p_base->extension.*p_page).byte_offset != 0 || (p_base->extension.*p_page).byte_count != 0); };
+        const bool has_lookup = p_options.lookup_index || has_base_page(&extension_t::lookup_page);
+        const bool is_separated = p_options.deduplicate;
+        const bool is_checksummed = p_options.checksum || has_base_page(&extension_t::checksum_page);
+        const bool is_stamped = p_options.stamp || has_base_page(&extension_t::stamp_page);
+        const bool has_key_page = p_options.key_table || has_base_page(&extension_t::key_page);
+        const bool is_streamed = p_options.stream;
+        const bool is_manifest = p_options.manifest || (p_base && (p_base->extension.flags & manifest_flag) != 0);
+        if (is_streamed && p_options.deduplicate)
+            throw std::runtime_error("Streamed bags cannot share contents.");
+        if (p_base && (is_streamed || (p_base->extension.flags & streamed_flag) != 0))
+            throw std::runtime_error("Streamed bags cannot be appended to.");
+
+        const bool is_aligned = p_options.content_alignment > 1;
+        if (is_aligned && !std::has_single_bit(p_options.content_alignment))
+            throw std::runtime_error("Invalid content alignment.");
+        const unit_vector_type padding(is_aligned ? p_options.content_alignment - 1 : 0, null_unit);
+
+        // Reserve the pages for every item up front, so they are not copied as they grow.
+        size_type expected_item_count = p_options.expected_item_count;
+        if constexpr (std::sized_sentinel_for<Iterator, Iterator>)
+            expected_item_count = std::max(expected_item_count, static_cast<size_type>(std::ranges::distance(p_begin, p_end)));
+        indices.reserve(expected_item_count);
+        encodings.reserve(expected_item_count);
+        if (is_separated)
+            content_slices.reserve(expected_item_count);
+        if (is_checksummed)
+            checksums.reserve(expected_item_count);
+        if (is_stamped)
+            stamps.reserve(expected_item_count);
+        if (has_lookup)
+            key_hashes.reserve(expected_item_count);
+        if (has_key_page)
+            keys.reserve(expected_item_count);
+
+        if (is_streamed)
+        {
+            p_sink.write(as_units(stream_identifier_mark));
+            current_byte_offset += sizeof(stream_identifier_mark);
+        }
+
+
+        // Encode a content in memory, unless it does not get smaller.
+        // Return the units to store and their encoding.
+        const auto encode_memory_content = [&](content_type p_content) -> std::pair<content_type, encoding_t>
+        {
+            if (p_options.codec)
+            {
+                const observed_phase_t observed(p_observer, phase_t::encode_contents);
+                encoded.clear();
+                p_options.codec->encode(p_content, encoded);
+                if (encoded.size() < p_content.size())
+                    return {content_type(encoded), encoding_t(p_options.codec->get_identifier(), p_content.size())};
+            }
+
+            return {p_content, encoding_t(stored_codec_identifier, p_content.size())};
+        };
+
+        // Reading the inputs spans advancing the iterators, so it is ended and begun again around the rest of each item.
+        notify_phase_begin(p_observer, phase_t::read_inputs);
+        for (auto it = p_begin; it != p_end; ++it)
+        {
+            const auto &[raw_key, raw_content] = *it;
+            const auto key = key_type(raw_key);
+            const size_type key_byte_count = (key.size()) * sizeof(typename decltype(key)::value_type) + sizeof(null_unit);
+            const auto key_units = unit_span_type(key.data(), key.size());
+            const auto null_units = unit_span_type(&null_unit, sizeof(null_unit));
+
+            // A content already stored in a bag is written as it is.
+            std::optional<encoding_t> stored_encoding;
+            if constexpr (stored_content_source_c<std::remove_cvref_t<decltype(raw_content)>>)
+                stored_encoding = raw_content.get_stored_encoding();
+
+            // Get the content in memory when there is one, reading small enough sources to encode them.
+            std::optional<content_type> memory_content;
+            if constexpr (std::is_convertible_v<decltype(raw_content), content_type>)
+                memory_content = content_type(raw_content);
+            else if (!stored_encoding && p_options.codec && raw_content.size() <= p_options.codec_byte_limit)
+            {
+                source_content.resize(raw_content.size());
+                for (size_type byte_offset = 0; byte_offset < source_content.size();)
+                {
+                    const size_type read_byte_count = raw_content.read(byte_offset, std::span(source_content).subspan(byte_offset));
+                    if (read_byte_count == 0)
+                        throw std::runtime_error("Content source is shorter than its size.");
+                    byte_offset += read_byte_count;
+                }
+                memory_content = content_type(source_content);
+            }
+
+            std::optional<content_hash_t> content_hash;
+            if (p_options.deduplicate && !stored_encoding)
+            {
+                if (memory_content)
+                    content_hash = hash_content(*memory_content);
+                else if constexpr (!std::is_convertible_v<decltype(raw_content), content_type>)
+                {
+                    if constexpr (hashed_content_source_c<std::remove_cvref_t<decltype(raw_content)>>)
+                        content_hash = raw_content.get_content_hash();
+                    if (!content_hash)
+                        content_hash = hash_content_source(raw_content, buffer);
+                }
+            }
+
+            const auto shared_content = content_hash ? stored_contents.find(*content_hash) : stored_contents.end();
+            const size_type header_byte_count = is_streamed ? sizeof(stream_header_t) : 0;
+            size_type padding_byte_count = 0;
+            if (is_aligned && shared_content == stored_contents.end())
+                padding_byte_count = (p_options.content_alignment - (current_byte_offset + header_byte_count + key_byte_count) % p_options.content_alignment) % p_options.content_alignment;
+            current_byte_offset += header_byte_count + padding_byte_count;
+
+            // Write the header of a streamed item, the padding and the key, then the units of the content when they are in memory.
+            const auto write_item = [&](size_type p_content_byte_count, encoding_t p_encoding, uint32_t p_checksum, unit_span_type p_units)
+            {
+                stream_header_t header;
+                if (is_streamed)
+                {
+                    header.padding_byte_count = padding_byte_count;
+                    header.key_byte_count = key_byte_count;
+                    header.content_byte_count = p_content_byte_count;
+                    header.encoding = p_encoding;
+                    if (is_checksummed)
+                    {
+                        header.checksum = checksum_t(crc32c(null_units, crc32c(key_units)), p_checksum);
+                        header.flags |= checksummed_stream_flag;
+                    }
+                }
+                write_parts(p_sink, {is_streamed ? as_units(header) : unit_span_type(), unit_span_type(padding.data(), padding_byte_count), key_units, null_units, p_units});
+            };
+
+            stored_content_t stored_content{slice_t(current_byte_offset + key_byte_count, 0), encoding_t(stored_codec_identifier, 0), 0};
+            if (shared_content != stored_contents.end())
+            {
+                // Only the key is written, the content is shared with an earlier item.
+                stored_content = shared_content->second;
+                notify_phase_end(p_observer, phase_t::read_inputs);
+                const observed_phase_t observed(p_observer, phase_t::write_items);
+                write_parts(p_sink, {key_units, null_units});
+            }
+            else if (memory_content)
+            {
+                notify_phase_end(p_observer, phase_t::read_inputs);
+                const auto [units, encoding] = encode_memory_content(*memory_content);
+                stored_content.slice.byte_count = units.size();
+                stored_content.encoding = encoding;
+                if (is_checksummed)
+                    stored_content.checksum = crc32c(units);
+                const observed_phase_t observed(p_observer, phase_t::write_items);
+                write_item(units.size(), encoding, stored_content.checksum, units);
+            }
+            else if constexpr (!std::is_convertible_v<decltype(raw_content), content_type>)
+            {
+                std::optional<uint32_t> stored_checksum;
+                if constexpr (stored_content_source_c<std::remove_cvref_t<decltype(raw_content)>>)
+                    stored_checksum = raw_content.get_stored_checksum();
+                if (is_checksummed)
+                    stored_content.checksum = stored_checksum ? *stored_checksum : checksum_content_source(raw_content, buffer);
+                stored_content.encoding = stored_encoding.value_or(encoding_t(stored_codec_identifier, raw_content.size()));
+                notify_phase_end(p_observer, phase_t::read_inputs);
+                const observed_phase_t observed(p_observer, phase_t::write_items);
+                write_item(raw_content.size(), stored_content.encoding, stored_content.checksum, unit_span_type());
+                stored_content.slice.byte_count = write_content(p_sink, raw_content, buffer);
+            }
+            notify_entry(p_observer, phase_t::write_items, key, stored_content.slice.byte_count);
+            notify_phase_begin(p_observer, phase_t::read_inputs);
+
+            const bool is_shared = shared_content != stored_contents.end();
+            if (is_separated)
+            {
+                indices.emplace_back(current_byte_offset, key_byte_count);
+                content_slices.push_back(stored_content.slice);
+                if (content_hash && !is_shared)
+                    stored_contents.emplace(*content_hash, stored_content);
+            }
+            else
+                indices.emplace_back(current_byte_offset, key_byte_count + stored_content.slice.byte_count);
+            current_byte_offset += key_byte_count + (is_shared ? 0 : stored_content.slice.byte_count);
+
+            encodings.push_back(stored_content.encoding);
+            if (is_checksummed)
+                checksums.emplace_back(crc32c(null_units, crc32c(key_units)), stored_content.checksum);
+            if (is_stamped)
+            {
+                stamp_t stamp;
+                if constexpr (stamped_content_source_c<std::remove_cvref_t<decltype(raw_content)>>)
+                    stamp = raw_content.get_stamp().value_or(stamp_t());
+
+                // Hash the decoded content, unless it is already known or only the stored content is at hand.
+                if (!stamp.has_content_hash())
+                {
+                    if (content_hash)
+                        stamp.content_hash = *content_hash;
+                    else if (memory_content)
+                        stamp.content_hash = hash_content(*memory_content);
+                    else if constexpr (!std::is_convertible_v<decltype(raw_content), content_type>)
+                    {
+                        if (!stored_encoding || stored_encoding->codec == stored_codec_identifier)
+                            stamp.content_hash = hash_content_source(raw_content, buffer);
+                    }
+                }
+                stamps.push_back(stamp);
+            }
+            if (has_lookup)
+                key_hashes.push_back(hash_units(key));
+            if (has_key_page)
+                keys.emplace_back(key);
+        }
+        notify_phase_end(p_observer, phase_t::read_inputs);
+
+        // End the streamed items with an empty header, before the pages.
+        notify_phase_begin(p_observer, phase_t::write_pages);
+        if (is_streamed)
+        {
+            const stream_header_t end_header;
+            p_sink.write(as_units(end_header));
+            current_byte_offset += sizeof(end_header);
+        }
+
+        const auto index_units = as_units(slice_view_type(indices));
+        p_sink.write(index_units);
+        notify_phase_end(p_observer, phase_t::write_pages);
+
+        const size_type indices_byte_count = indices.size() * sizeof(typename decltype(indices)::value_type);
+        const auto index_page = slice_t(current_byte_offset, indices_byte_count);
+        current_byte_offset += indices_byte_count;
+
+        const bool is_encoded = p_options.codec || std::ranges::any_of(encodings, [](const encoding_t &p_encoding)
+                                                                                                                   { return p_encoding.codec != stored_codec_identifier; });
+        const bool is_extended = has_lookup || is_encoded || is_separated || is_checksummed || is_stamped || has_key_page || is_aligned || is_streamed || is_manifest || p_base;
+        if (!is_extended)
+        {
+            const observed_phase_t observed(p_observer, phase_t::write_pages);
+            const metadata_t data = metadata_t(identifier_mark, current_byte_offset + sizeof(metadata_t), index_page);
+            p_sink.write(as_units(data));
+        }
+        else
+        {
+            notify_phase_begin(p_observer, phase_t::build_pages);
+            extension_t extension;
+            if (p_base)
+            {
+                // The alignment only holds when the base bag has it too.
+                const bool is_base_empty = p_base->indices.empty() && (p_base->extension.flags & chained_flag) == 0;
+                const size_type base_alignment = is_base_empty ? p_options.content_alignment : p_base->extension.content_alignment;
+                if (is_aligned && base_alignment > 1)
+                    extension.content_alignment = std::min(base_alignment, p_options.content_alignment);
+
+                const auto &base_index_page = p_base->metadata->index_page;
+                extension.previous_footer = slice_t(base_index_page.byte_offset, p_base->metadata->true_byte_count - base_index_page.byte_offset);
+                extension.flags |= chained_flag;
+            }
+            else if (is_aligned)
+                extension.content_alignment = p_options.content_alignment;
+
+            std::pmr::vector<unit_span_type> parts(resource);
+            const auto add_page = [&](slice_t &p_page, unit_span_type p_units)
+            {
+                p_page = slice_t(current_byte_offset, p_units.size());
+                current_byte_offset += p_units.size();
+                parts.push_back(p_units);
+            };
+
+            std::vector<lookup_slot_t> lookup_slots;
+            if (has_lookup)
+            {
+                lookup_slots = build_lookup_page(key_hashes);
+                add_page(extension.lookup_page, as_units(std::span<const lookup_slot_t>(lookup_slots)));
+            }
+
+            if (is_encoded)
+            {
+                add_page(extension.encoding_page, as_units(std::span<const encoding_t>(encodings)));
+                extension.flags |= encoded_flag;
+            }
+
+            if (is_separated)
+            {
+                add_page(extension.content_page, as_units(slice_view_type(content_slices)));
+                extension.flags |= separated_flag;
+            }
+
+            if (is_stamped)
+                add_page(extension.stamp_page, as_units(std::span<const stamp_t>(stamps)));
+
+            if (is_streamed)
+                extension.flags |= streamed_flag;
+            if (is_manifest)
+                extension.flags |= manifest_flag;
+
+            unit_vector_type key_page;
+            if (has_key_page)
+            {
+                key_page = build_key_page(std::vector<key_type>(keys.begin(), keys.end()));
+                add_page(extension.key_page, unit_span_type(key_page));
+            }
+
+            unit_vector_type tombstone_page;
+            if (p_base && !p_removed_keys.empty())
+            {
+                for (const auto &key : p_removed_keys)
+                {
+                    tombstone_page.insert(tombstone_page.end(), key.begin(), key.end());
+                    tombstone_page.push_back(null_unit);
+                }
+                add_page(extension.tombstone_page, unit_span_type(tombstone_page));
+            }
+
+            if (is_checksummed)
+            {
+                add_page(extension.checksum_page, as_units(std::span<const checksum_t>(checksums)));
+
+                uint32_t page_checksum = crc32c(index_units);
+                for (const auto &part : parts)
+                    page_checksum = crc32c(part, page_checksum);
+                extension.page_checksum = page_checksum;
+            }
+
+            const size_type extension_byte_count = sizeof(extension_t);
+            current_byte_offset += sizeof(extension_t) + sizeof(extension_byte_count);
+
+            const metadata_t data = metadata_t(extended_identifier_mark, current_byte_offset + sizeof(metadata_t), index_page);
+            parts.insert(parts.end(), {as_units(extension), as_units(extension_byte_count), as_units(data)});
+            notify_phase_end(p_observer, phase_t::build_pages);
+
+            const observed_phase_t observed(p_observer, phase_t::write_pages);
+            write_parts(p_sink, parts);
+        }
+
+        const observed_phase_t observed(p_observer, phase_t::write_pages);
+        if constexpr (requires { p_sink.flush(); })
+            p_sink.flush();
+    }
+
+    template <packing_iterator_c Iterator, output_sink_c S>
+    auto pack_onto(const layout_t *p_base, const std::set<key_type> &p_removed_keys, Iterator p_begin, Iterator p_end, S &p_sink, const pack_options_t &p_options) -> void
+    {
+        null_observer_t observer;
+        pack_onto(p_base, p_removed_keys, p_begin, p_end, p_sink, p_options, observer);
+    }
+
+    template <packing_iterator_c Iterator, output_sink_c S>
+    auto pack(Iterator p_begin, Iterator p_end, S &p_sink, const pack_options_t &p_options = {}) -> void
+    {
+        pack_onto(nullptr, {}, p_begin, p_end, p_sink, p_options);
+    }
+
+    /// Pack items, telling the observer about each phase and item.
+    template <packing_iterator_c Iterator, output_sink_c S, typename O>
+    auto pack(Iterator p_begin, Iterator p_end, S &p_sink, const pack_options_t &p_options, O &p_observer) -> void
+    {
+        pack_onto(nullptr, {}, p_begin, p_end, p_sink, p_options, p_observer);
+    }
+
+    template <packing_iterator_c Iterator>
+    auto pack(Iterator p_begin, Iterator p_end, std::basic_ostream<unit_type> &p_output, const pack_options_t &p_options = {}) -> void
+    {
+        ostream_sink_t sink(p_output);
+        pack(p_begin, p_end, sink, p_options);
+    }
+
+    template <typename T>
+    concept packing_container_c = requires {
+        requires packing_iterator_c<decltype(std::declval<T>().begin())>;
+        requires packing_iterator_c<decltype(std::declval<T>().end())>;
+    };
+
+    auto pack(const packing_container_c auto &p_container, std::basic_ostream<unit_type> &p_output, const pack_options_t &p_options = {}) -> void
+    {
+        pack(p_container.begin(), p_container.end(), p_output, p_options);
+    }
+
+    template <output_sink_c S>
+    auto pack(const packing_container_c auto &p_container, S &p_sink, const pack_options_t &p_options = {}) -> void
+    {
+        pack(p_container.begin(), p_container.end(), p_sink, p_options);
+    }
+
+    /// Append items to a bag, with the sink writing right after its last byte.
+    /// Only the new contents and a footer over them and the removed keys are written, so appending costs as much as
+    /// the change, whatever the size of the bag. The footer chains to the one before it, and readers merge the generations.
+    /// The bytes of removed and replaced items stay until `compact`.
+    template <packing_iterator_c Iterator, output_sink_c S>
+    auto append(const bag_type &p_bag, Iterator p_begin, Iterator p_end, S &p_sink, const pack_options_t &p_options = {}, const std::set<key_type> &p_removed_keys = {}) -> void
+    {
+        const auto layout = get_generation_layout(p_bag);
+        pack_onto(&layout, p_removed_keys, p_begin, p_end, p_sink, p_options);
+    }
+
+    template <packing_iterator_c Iterator, output_sink_c S, typename O>
+    auto append(const bag_type &p_bag, Iterator p_begin, Iterator p_end, S &p_sink, const pack_options_t &p_options, const std::set<key_type> &p_removed_keys, O &p_observer) -> void
+    {
+        const auto layout = get_generation_layout(p_bag);
+        pack_onto(&layout, p_removed_keys, p_begin, p_end, p_sink, p_options, p_observer);
+    }
+
+    template <output_sink_c S>
+    auto append(const bag_type &p_bag, const packing_container_c auto &p_container, S &p_sink, const pack_options_t &p_options = {}, const std::set<key_type> &p_removed_keys = {}) -> void
+    {
+        append(p_bag, p_container.begin(), p_container.end(), p_sink, p_options, p_removed_keys);
+    }
+
+    /// Pack the live items of a bag into a new one, merging the generations of an appended bag into one
+    /// and leaving out the bytes of the removed and replaced items.
+    /// Each content is decoded with the codecs, then packed with the pages the bag has, and those the options add.
+    template <output_sink_c S>
+    auto compact(const bag_type &p_bag, S &p_sink, const pack_options_t &p_options = {}, const std::vector<codec_t> &p_codecs = builtin_codecs()) -> void
+    {
+        const auto layout = get_layout(p_bag);
+        pack_options_t options = p_options;
+        options.lookup_index = options.lookup_index || !layout.lookup_slots.empty();
+        options.deduplicate = options.deduplicate || (layout.extension.flags & separated_flag) != 0;
+        options.checksum = options.checksum || !layout.checksums.empty();
+        options.content_alignment = std::max(options.content_alignment, layout.extension.content_alignment);
+        options.stamp = options.stamp || !layout.stamps.empty();
+        options.key_table = options.key_table || !layout.key_page.empty();
+        options.manifest = options.manifest || (layout.extension.flags & manifest_flag) != 0;
+
+        unit_vector_type decoded;
+        const auto get_decoded_item = [&](size_type p_ordinal)
+        {
+            auto [key, content] = get_item(layout, p_ordinal);
+            if (!layout.encodings.empty() && layout.encodings[p_ordinal].codec != stored_codec_identifier)
+            {
+                decoded.resize(layout.encodings[p_ordinal].byte_count);
+                decode_content(p_codecs, layout.encodings[p_ordinal], content, decoded);
+                content = content_type(decoded);
+            }
+            return unpack_result_type(key, content);
+        };
+
+        const auto ordinals = std::views::iota(size_type(0), layout.indices.size());
+        if (layout.stamps.empty())
+        {
+            const auto items = ordinals | std::views::transform(get_decoded_item);
+            pack(items.begin(), items.end(), p_sink, options);
+            return;
+        }
+
+        // Keep the stamps, as the contents no longer tell when their files were modified.
+        const auto items = ordinals | std::views::transform([&](size_type p_ordinal)
+                                                            {
+                                                                const auto [key, content] = get_decoded_item(p_ordinal);
+                                                                return std::pair<key_type, stamped_content_source_t>(key, stamped_content_source_t(content, layout.stamps[p_ordinal])); });
+        pack(items.begin(), items.end(), p_sink, options);
+    }
+
+    template <typename = void>
+    auto is_manifest(const bag_type &p_bag) -> bool
+    {
+        return (get_layout(p_bag).extension.flags & manifest_flag) != 0;
+    }
+
+    /// Pack the manifest of shards, each a bag of its own, mapping the key of every item to its shard_location_t.
+    /// The manifest always has a lookup page, as it is there to find items.
+    template <output_sink_c S>
+    auto pack_manifest(std::span<const bag_type> p_shards, S &p_sink, const pack_options_t &p_options = {}) -> void
+    {
+        std::vector<shard_location_t> locations;
+        std::vector<key_type> keys;
+        for (size_type shard = 0; shard < p_shards.size(); ++shard)
+        {
+            const auto layout = get_layout(p_shards[shard]);
+            for (size_type ordinal = 0; ordinal < layout.indices.size(); ++ordinal)
+            {
+                keys.push_back(get_item(layout, ordinal).first);
+                locations.emplace_back(shard, ordinal, layout.indices[ordinal]);
+            }
+        }
+
+        std::vector<unpack_result_type> items;
+        items.reserve(keys.size());
+        for (size_type position = 0; position < keys.size(); ++position)
+            items.emplace_back(keys[position], as_units(locations[position]));
+
+        pack_options_t options = p_options;
+        options.lookup_index = true;
+        options.manifest = true;
+        pack(items.begin(), items.end(), p_sink, options);
+    }
+
+    /// Get the shard_location_t of an item in a manifest.
+    template <typename = void>
+    auto get_shard_location(content_type p_content) -> shard_location_t
+    {
+        if (p_content.size() != sizeof(shard_location_t))
+            throw std::runtime_error("Invalid shard location.");
+
+        shard_location_t location(0, 0, slice_t(0, 0));
+        std::memcpy(&location, p_content.data(), sizeof(location));
+        return location;
+    }
+
+    /// The slot of a key in a perfect hash table, from the hash of the key and the seed of its bucket.
+    constexpr auto get_perfect_hash_slot(size_type p_hash, size_type p_seed, size_type p_slot_count) -> size_type
+    {
+        size_type value = p_hash ^ (p_seed * 0x9E3779B97F4A7C15);
+        value ^= value >> 33;
+        value *= 0xFF51AFD7ED558CCD;
+        value ^= value >> 33;
+        return value % p_slot_count;
+    }
+
+    /// A minimal perfect hash over keys of distinct hashes, by hash and displace.
+    /// A key goes in the bucket of its hash, and the seed of the bucket places it in its own slot.
+    struct perfect_hash_t
+    {
+        std::vector<size_type> seeds;
+        /// The ordinal of the key in each slot.
+        std::vector<size_type> ordinals;
+    };
+
+    template <typename = void>
+    auto build_perfect_hash(std::span<const key_type> p_keys) -> perfect_hash_t
+    {
+        const size_type slot_count = p_keys.size();
+        const size_type bucket_count = std::max<size_type>(slot_count / 2, 1);
+
+        std::vector<size_type> hashes(p_keys.size());
+        std::vector<std::vector<size_type>> buckets(bucket_count);
+        for (size_type ordinal = 0; ordinal < p_keys.size(); ++ordinal)
+        {
+            hashes[ordinal] = hash_units(unit_span_type(p_keys[ordinal].data(), p_keys[ordinal].size()));
+            buckets[hashes[ordinal] % bucket_count].push_back(ordinal);
+        }
+
+        // Keys of the same hash are never told apart by any seed, so fail before searching for one.
+        std::vector<size_type> sorted_hashes = hashes;
+        std::sort(sorted_hashes.begin(), sorted_hashes.end());
+        if (std::adjacent_find(sorted_hashes.begin(), sorted_hashes.end()) != sorted_hashes.end())
+            throw std::runtime_error("Colliding key hashes.");
+
+        // Place the largest buckets first, while most slots are free.
+        std::vector<size_type> bucket_order(bucket_count);
+        std::iota(bucket_order.begin(), bucket_order.end(), size_type(0));
+        std::stable_sort(bucket_order.begin(), bucket_order.end(), [&](size_type p_left, size_type p_right)
+                         { return buckets[p_left].size() > buckets[p_right].size(); });
+
+        perfect_hash_t hash{std::vector<size_type>(bucket_count, 0), std::vector<size_type>(slot_count, 0)};
+        std::vector<bool> is_taken(slot_count, false);
+        std::vector<size_type> slots;
+        for (const size_type bucket : bucket_order)
+        {
+            if (buckets[bucket].empty())
+                break;
+
+            for (size_type seed = 0;; ++seed)
+            {
+                if (seed == std::numeric_limits<uint32_t>::max())
+                    throw std::runtime_error("Fail to build a perfect hash.");
+
+                slots.clear();
+                for (const size_type ordinal : buckets[bucket])
+                {
+                    const size_type slot = get_perfect_hash_slot(hashes[ordinal], seed, slot_count);
+                    if (is_taken[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end())
+                        break;
+                    slots.push_back(slot);
+                }
+                if (slots.size() != buckets[bucket].size())
+                    continue;
+
+                for (size_type position = 0; position < slots.size(); ++position)
+                {
+                    is_taken[slots[position]] = true;
+                    hash.ordinals[slots[position]] = buckets[bucket][position];
+                }
+                hash.seeds[bucket] = seed;
+                break;
+            }
+        }
+
+        return hash;
+    }
+
+    /// An item of an embedded bag, in the slot of its key.
+    struct embedded_entry_t
+    {
+        slice_t key;
+        slice_t content;
+
+        constexpr embedded_entry_t(slice_t p_key, slice_t p_content)
+            : key(p_key), content(p_content) {}
+    };
+
+    /// A bag compiled into a binary, with a perfect hash table over its keys, as written by `write_embedded_header`.
+    /// Finding a key hashes it once and compares it once, and can be done in constant expressions.
+    class embedded_bag_t
+    {
+    private:
+        bag_type units;
+        std::span<const size_type> seeds;
+        std::span<const embedded_entry_t> entries;
+
+    public:
+        constexpr embedded_bag_t(bag_type p_bag, std::span<const size_type> p_seeds, std::span<const embedded_entry_t> p_entries)
+            : units(p_bag), seeds(p_seeds), entries(p_entries) {}
+
+        /// The whole bag, to read it like any other at run time.
+        constexpr auto get_bag() const -> bag_type { return units; }
+
+        constexpr auto size() const -> size_type { return entries.size(); }
+
+        constexpr auto find(key_type p_key) const -> std::optional<content_type>
+        {
+            if (entries.empty() || seeds.empty())
+                return std::nullopt;
+
+            const size_type hash = hash_units(unit_span_type(p_key.data(), p_key.size()));
+            const auto &entry = entries[get_perfect_hash_slot(hash, seeds[hash % seeds.size()], entries.size())];
+            if (key_type(units.data() + entry.key.byte_offset, entry.key.byte_count) != p_key)
+                return std::nullopt;
+
+            return units.subspan(entry.content.byte_offset, entry.content.byte_count);
+        }
+    };
+
+    /// Write a C++ header embedding a bag, with a perfect hash table over its keys for `embedded_bag_t`.
+    /// The bag, its seeds and its entries are named after the namespace they are in.
+    /// When a key repeats, the first item wins. Encoded contents cannot be embedded, as they could not be found at compile time.
+    template <typename = void>
+    auto write_embedded_header(const bag_type &p_bag, std::string_view p_namespace, std::basic_ostream<unit_type> &p_output) -> void
+    {
+        const auto layout = get_layout(p_bag);
+        if (std::ranges::any_of(layout.encodings, [](const encoding_t &p_encoding)
+                                { return p_encoding.codec != stored_codec_identifier; }))
+            throw std::runtime_error("Cannot embed encoded contents.");
+
+        std::vector<key_type> keys;
+        std::vector<content_type> contents;
+        std::set<key_type> seen_keys;
+        for (size_type ordinal = 0; ordinal < layout.indices.size(); ++ordinal)
+        {
+            const auto [key, content] = get_item(layout, ordinal);
+            if (!seen_keys.insert(key).second)
+                continue;
+            keys.push_back(key);
+            contents.push_back(content);
+        }
+        const auto hash = build_perfect_hash(keys);
+
+        unit_string_type guard;
+        for (const auto unit : p_namespace)
+            guard.push_back(static_cast<unit_type>(std::toupper(static_cast<unsigned char>(unit))));
+        guard += "_EMBEDDED_HPP";
+
+        const auto get_byte_offset = [&](const unit_type *p_unit_pointer)
+        { return static_cast<size_type>(p_unit_pointer - p_bag.data()); };
+        const size_type alignment = std::max<size_type>(layout.extension.content_alignment, 16);
+
+        p_output << "// Generated by bag --emit-cpp.\n"
+                 << "#ifndef " << guard << "\n"
+                 << "#define " << guard << "\n\n"
+                 << "#include <array>\n"
+                 << "#include <libbag.hpp>\n\n"
+                 << "namespace " << p_namespace << "\n{\n"
+                 << "    alignas(" << alignment << ") inline constexpr libbag::unit_type bag_units[] =";
+
+        constexpr const char *hex_digits = "0123456789abcdef";
+        constexpr size_type line_byte_count = 32;
+        for (size_type byte_offset = 0; byte_offset < p_bag.size(); byte_offset += line_byte_count)
+        {
+            p_output << "\n        \"";
+            for (const auto unit : p_bag.subspan(byte_offset, std::min(line_byte_count, p_bag.size() - byte_offset)))
+            {
+                const auto byte = static_cast<unsigned char>(unit);
+                p_output << "\\x" << hex_digits[byte >> 4] << hex_digits[byte & 0xF];
+            }
+            p_output << '"';
+        }
+        p_output << ";\n\n";
+
+        p_output << "    inline constexpr std::array<libbag::size_type, " << hash.seeds.size() << "> bag_seeds{{";
+        for (size_type bucket = 0; bucket < hash.seeds.size(); ++bucket)
+            p_output << (bucket % 16 == 0 ? "\n        " : " ") << hash.seeds[bucket] << ",";
+        p_output << "\n    }};\n\n";
+
+        p_output << "    inline constexpr std::array<libbag::embedded_entry_t, " << hash.ordinals.size() << "> bag_entries{{";
+        for (const size_type ordinal : hash.ordinals)
+            p_output << "\n        libbag::embedded_entry_t(libbag::slice_t(" << get_byte_offset(keys[ordinal].data()) << ", " << keys[ordinal].size()
+                     << "), libbag::slice_t(" << get_byte_offset(contents[ordinal].data()) << ", " << contents[ordinal].size() << ")),";
+        p_output << "\n    }};\n\n";
+
+        p_output << "    inline constexpr libbag::embedded_bag_t bag(libbag::bag_type(bag_units, sizeof(bag_units) - 1), bag_seeds, bag_entries);\n"
+                 << "} // namespace " << p_namespace << "\n\n"
+                 << "#endif // " << guard << "\n";
+    }
+
+#if LIBBAG_HAS_POSIX
+    enum class access_advice_t
+    {
+        normal,
+        sequential,
+        random,
+        will_need
+    };
+
+    /// A read-only memory-mapped bag.
+    /// Pages are only loaded when touched, so opening a bag costs the metadata_t and indices.
+    class mapped_bag_t
+    {
+    private:
+        const unit_type *unit_pointer = nullptr;
+        size_type byte_count = 0;
+
+        static auto to_advice(access_advice_t p_advice) -> int
+        {
+            switch (p_advice)
+            {
+            case access_advice_t::sequential:
+                return MADV_SEQUENTIAL;
+            case access_advice_t::random:
+                return MADV_RANDOM;
+            case access_advice_t::will_need:
+                return MADV_WILLNEED;
+            default:
+                return MADV_NORMAL;
+            }
+        }
+
+        auto release() noexcept -> void
+        {
+            if (unit_pointer != nullptr)
+                ::munmap(const_cast<unit_type *>(unit_pointer), byte_count);
+            unit_pointer = nullptr;
+            byte_count = 0;
+        }
+
+    public:
+        mapped_bag_t() = default;
+
+        explicit mapped_bag_t(const std::filesystem::path &p_path, access_advice_t p_advice = access_advice_t::normal)
+        {
+            const int descriptor = ::open(p_path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (descriptor < 0)
+                throw std::system_error(errno, std::generic_category(), "Fail to open the bag '" + p_path.string() + "'");
+
+            struct stat status;
+            if (::fstat(descriptor, &status) != 0)
+            {
+                const int error = errno;
+                ::close(descriptor);
+                throw std::system_error(error, std::generic_category(), "Fail to stat the bag '" + p_path.string() + "'");
+            }
+
+            byte_count = static_cast<size_type>(status.st_size);
+            if (byte_count != 0)
+            {
+                void *mapping = ::mmap(nullptr, byte_count, PROT_READ, MAP_SHARED, descriptor, 0);
+                if (mapping == MAP_FAILED)
+                {
+                    const int error = errno;
+                    ::close(descriptor);
+                    byte_count = 0;
+                    throw std::system_error(error, std::generic_category(), "Fail to map the bag '" + p_path.string() + "'");
+                }
+                unit_pointer = static_cast<const unit_type *>(mapping);
+            }
+            ::close(descriptor);
+
+            advise(p_advice);
+        }
+
+        mapped_bag_t(const mapped_bag_t &) = delete;
+        auto operator=(const mapped_bag_t &) -> mapped_bag_t & = delete;
+
+        mapped_bag_t(mapped_bag_t &&p_other) noexcept
+            : unit_pointer(std::exchange(p_other.unit_pointer, nullptr)), byte_count(std::exchange(p_other.byte_count, 0)) {}
+
+        auto operator=(mapped_bag_t &&p_other) noexcept -> mapped_bag_t &
+        {
+            if (this != &p_other)
+            {
+                release();
+                unit_pointer = std::exchange(p_other.unit_pointer, nullptr);
+                byte_count = std::exchange(p_other.byte_count, 0);
+            }
+            return *this;
+        }
+
+        ~mapped_bag_t() { release(); }
+
+        auto bag() const -> bag_type { return bag_type(unit_pointer, byte_count); }
+
+        operator bag_type() const { return bag(); }
+
+        auto size_bytes() const -> size_type { return byte_count; }
+
+        /// Hint the kernel about the access pattern of the whole mapping.
+        auto advise(access_advice_t p_advice) const -> void
+        {
+            if (unit_pointer != nullptr)
+                ::madvise(const_cast<unit_type *>(unit_pointer), byte_count, to_advice(p_advice));
+        }
+
+        /// Hint the kernel about the access pattern of a region, relative to the start of the mapping.
+        auto advise(access_advice_t p_advice, const slice_t &p_region) const -> void
+        {
+            if (unit_pointer == nullptr || p_region.byte_offset >= byte_count)
+                return;
+
+            const auto page_byte_count = static_cast<size_type>(::sysconf(_SC_PAGESIZE));
+            const auto begin = p_region.byte_offset - p_region.byte_offset % page_byte_count;
+            const auto end = std::min(p_region.byte_offset + p_region.byte_count, byte_count);
+            ::madvise(const_cast<unit_type *>(unit_pointer) + begin, end - begin, to_advice(p_advice));
+        }
+    };
+
+    struct extract_options_t
+    {
+        /// Number of threads writing files.
+        size_type thread_count = 1;
+        /// Reserve the size of each file before writing it.
+        bool preallocate = false;
+        /// Codecs to decode encoded contents with.
+        std::vector<codec_t> codecs = builtin_codecs();
+        /// Which checksums to verify before writing files.
+        verify_mode_t verify_mode = verify_mode_t::on_access;
+        /// How to open, write and close the files.
+        io_backend_t io_backend = io_backend_t::threads;
+    };
+
+    /// Get the path to write an item to under a destination directory, refusing keys that would escape it.
+    template <typename = void>
+    auto get_output_path(const std::filesystem::path &p_destination, key_type p_key) -> std::filesystem::path
+    {
+        std::filesystem::path key_path(p_key);
+        key_path.make_preferred();
+        if (key_path.empty() || key_path.has_root_path() || std::find(key_path.begin(), key_path.end(), std::filesystem::path("..")) != key_path.end())
+            throw std::runtime_error("Unsafe key '" + unit_string_type(p_key) + "'.");
+
+        return p_destination / key_path;
+    }
+
+    /// Write every item of a bag as a file under a destination directory.
+    /// Each directory is created once, then files are written on a pool of threads, in batches on an io_uring when the options ask for it.
+    /// When a key repeats, the first item wins.
+    /// Files are told to the observer from the threads writing them.
+    template <typename O>
+    auto extract(const bag_type &p_bag, const std::filesystem::path &p_destination, const extract_options_t &p_options, O &p_observer) -> void
+    {
+        const auto layout = get_layout(p_bag);
+        const auto &encodings = layout.encodings;
+        if ((layout.extension.flags & manifest_flag) != 0)
+            throw std::runtime_error("Cannot extract a manifest, extract its shards instead.");
+        if (p_options.verify_mode == verify_mode_t::all)
+        {
+            const observed_phase_t observed(p_observer, phase_t::verify_pages);
+            verify_pages(layout);
+        }
+
+        notify_phase_begin(p_observer, phase_t::list_attributes);
+        std::vector<unpack_result_type> items;
+        std::vector<size_type> ordinals;
+        std::set<key_type> keys;
+        for (size_type ordinal = 0; ordinal < layout.indices.size(); ++ordinal)
+        {
+            const auto item = get_item(layout, ordinal);
+            if (!keys.insert(item.first).second)
+                continue;
+
+            items.push_back(item);
+            ordinals.push_back(ordinal);
+        }
+
+        std::vector<std::filesystem::path> output_paths;
+        std::set<std::filesystem::path> output_directory_paths;
+        output_paths.reserve(items.size());
+        for (const auto &[key, content] : items)
+        {
+            output_paths.push_back(get_output_path(p_destination, key));
+            output_directory_paths.insert(output_paths.back().parent_path());
+        }
+        notify_phase_end(p_observer, phase_t::list_attributes);
+
+        {
+            const observed_phase_t observed(p_observer, phase_t::create_directories);
+            for (const auto &output_directory_path : output_directory_paths)
+                std::filesystem::create_directories(output_directory_path);
+        }
+
+        const observed_phase_t observed(p_observer, phase_t::write_files);
+
+        // Verify an item, and decode it into the buffer when it is encoded.
+        const auto get_content = [&](size_type p_index, unit_vector_type &p_decoded) -> content_type
+        {
+            if (p_options.verify_mode != verify_mode_t::off)
+                verify_item(layout, ordinals[p_index], items[p_index]);
+
+            const auto content = items[p_index].second;
+            if (encodings.empty() || encodings[ordinals[p_index]].codec == stored_codec_identifier)
+                return content;
+
+            p_decoded.resize(encodings[ordinals[p_index]].byte_count);
+            decode_content(p_options.codecs, encodings[ordinals[p_index]], content, p_decoded);
+            return content_type(p_decoded);
+        };
+
+        const auto write_file = [&](size_type p_index, content_type p_content)
+        {
+            file_sink_t file(output_paths[p_index]);
+
+            if (p_options.preallocate && !p_content.empty())
+            {
+#if defined(__linux__)
+                ::fallocate(file.get_descriptor(), 0, 0, static_cast<off_t>(p_content.size()));
+#else
+                ::posix_fallocate(file.get_descriptor(), 0, static_cast<off_t>(p_content.size()));
+#endif
+            }
+
+            file.write(p_content);
+        };
+
+#if LIBBAG_HAS_URING
+        // Each thread writes its batches of files on its own ring, each batch with one system call.
+        if (p_options.io_backend == io_backend_t::uring || (p_options.io_backend == io_backend_t::automatic && uring_t::is_available()))
+        {
+            constexpr size_type batch_file_count = 64;
+            const size_type batch_count = (items.size() + batch_file_count - 1) / batch_file_count;
+            const size_type thread_count = std::clamp<size_type>(p_options.thread_count, 1, std::max<size_type>(batch_count, 1));
+            parallel_for_each_index(thread_count, thread_count, [&](size_type p_thread)
+                                    {
+                std::vector<unit_vector_type> decoded(batch_file_count);
+                std::vector<content_type> contents(batch_file_count);
+                std::vector<bool> is_rewritten(batch_file_count);
+                uring_t ring(batch_file_count * 4, batch_file_count);
+                for (size_type batch = p_thread; batch < batch_count; batch += thread_count)
+                {
+                    const size_type batch_offset = batch * batch_file_count;
+                    const size_type count = std::min(batch_file_count, items.size() - batch_offset);
+                    for (size_type index = 0; index < count; ++index)
+                    {
+                        contents[index] = get_content(batch_offset + index, decoded[index]);
+                        is_rewritten[index] = contents[index].size() > std::numeric_limits<int32_t>::max();
+                        if (is_rewritten[index])
+                            continue;
+
+                        // Open, preallocate, write and close the file in a chain, the close going on even when the write falls short.
+                        io_uring_sqe open_entry{};
+                        open_entry.opcode = IORING_OP_OPENAT;
+                        open_entry.flags = IOSQE_IO_LINK;
+                        open_entry.fd = AT_FDCWD;
+                        open_entry.addr = reinterpret_cast<uintptr_t>(output_paths[batch_offset + index].c_str());
+                        open_entry.len = 0644;
+                        open_entry.open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+                        open_entry.file_index = static_cast<uint32_t>(index + 1);
+                        open_entry.user_data = index * 4;
+                        ring.push(open_entry);
+
+                        if (!contents[index].empty())
+                        {
+                            if (p_options.preallocate)
+                            {
+                                io_uring_sqe allocate_entry{};
+                                allocate_entry.opcode = IORING_OP_FALLOCATE;
+                                allocate_entry.flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+                                allocate_entry.fd = static_cast<int>(index);
+                                allocate_entry.addr = contents[index].size();
+                                allocate_entry.user_data = index * 4 + 1;
+                                ring.push(allocate_entry);
+                            }
+
+                            io_uring_sqe write_entry{};
+                            write_entry.opcode = IORING_OP_WRITE;
+                            write_entry.flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+                            write_entry.fd = static_cast<int>(index);
+                            write_entry.addr = reinterpret_cast<uintptr_t>(contents[index].data());
+                            write_entry.len = static_cast<uint32_t>(contents[index].size());
+                            write_entry.user_data = index * 4 + 2;
+                            ring.push(write_entry);
+                        }
+
+                        io_uring_sqe close_entry{};
+                        close_entry.opcode = IORING_OP_CLOSE;
+                        close_entry.file_index = static_cast<uint32_t>(index + 1);
+                        close_entry.user_data = index * 4 + 3;
+                        ring.push(close_entry);
+                    }
+
+                    ring.submit([&](uint64_t p_data, int p_result)
+                                {
+                        const size_type index = p_data / 4;
+                        const auto &path = output_paths[batch_offset + index];
+                        switch (p_data % 4)
+                        {
+                        case 0:
+                            if (p_result < 0)
+                                throw std::system_error(-p_result, std::generic_category(), "Fail to open the file '" + path.string() + "'");
+                            break;
+                        case 2:
+                            if (p_result < 0 && p_result != -ECANCELED)
+                                throw std::system_error(-p_result, std::generic_category(), "Fail to write the file '" + path.string() + "'");
+                            // Write a short file again with plain system calls.
+                            if (p_result >= 0 && static_cast<size_type>(p_result) != contents[index].size())
+                                is_rewritten[index] = true;
+                            break;
+                        } });
+
+                    for (size_type index = 0; index < count; ++index)
+                    {
+                        if (is_rewritten[index])
+                            write_file(batch_offset + index, contents[index]);
+                        notify_entry(p_observer, phase_t::write_files, items[batch_offset + index].first, contents[index].size());
+                    }
+                } });
+            return;
+        }
+#endif
+        if (p_options.io_backend == io_backend_t::uring)
+            throw std::runtime_error("Missing io_uring.");
+
+        parallel_for_each_index(items.size(), p_options.thread_count, [&](size_type p_index)
+                                {
+            unit_vector_type decoded;
+            const auto content = get_content(p_index, decoded);
+            write_file(p_index, content);
+            notify_entry(p_observer, phase_t::write_files, items[p_index].first, content.size()); });
+    }
+
+    template <typename = void>
+    auto extract(const bag_type &p_bag, const std::filesystem::path &p_destination, const extract_options_t &p_options = {}) -> void
+    {
+        null_observer_t observer;
+        extract(p_bag, p_destination, p_options, observer);
+    }
+
+    /// Write every item of a streamed bag as a file under a destination directory, in one pass as it is read.
+    /// Files are written in order on the calling thread, and when a key repeats, the first item wins.
+    template <typename O>
+    auto extract_stream(std::basic_istream<unit_type> &p_input, const std::filesystem::path &p_destination, const extract_options_t &p_options, O &p_observer) -> void
+    {
+        const observed_phase_t observed(p_observer, phase_t::write_files);
+        std::set<unit_string_type, std::less<>> keys;
+        std::filesystem::path output_directory_path;
+        std::optional<file_sink_t> file;
+        bool is_skipped = false;
+        stream_unpack(p_input, [&](const stream_chunk_t &p_chunk)
+                      {
+            if (p_chunk.byte_offset == 0)
+            {
+                is_skipped = !keys.emplace(p_chunk.key).second;
+                if (is_skipped)
+                    return;
+
+                const auto output_path = get_output_path(p_destination, p_chunk.key);
+                if (output_path.parent_path() != output_directory_path)
+                {
+                    output_directory_path = output_path.parent_path();
+                    std::filesystem::create_directories(output_directory_path);
+                }
+
+                file.emplace(output_path);
+                if (p_options.preallocate && p_chunk.byte_count != 0)
+                {
+#if defined(__linux__)
+                    ::fallocate(file->get_descriptor(), 0, 0, static_cast<off_t>(p_chunk.byte_count));
+#else
+                    ::posix_fallocate(file->get_descriptor(), 0, static_cast<off_t>(p_chunk.byte_count));
+#endif
+                }
+            }
+            if (is_skipped)
+                return;
+
+            file->write(p_chunk.content);
+            if (p_chunk.is_last())
+            {
+                file.reset();
+                notify_entry(p_observer, phase_t::write_files, p_chunk.key, p_chunk.byte_count);
+            } }, stream_options_t{.codecs = p_options.codecs, .verify_mode = p_options.verify_mode});
+    }
+
+    template <typename = void>
+    auto extract_stream(std::basic_istream<unit_type> &p_input, const std::filesystem::path &p_destination, const extract_options_t &p_options = {}) -> void
+    {
+        null_observer_t observer;
+        extract_stream(p_input, p_destination, p_options, observer);
+    }
+
+    /// Get the path of a shard, next to its manifest.
+    template <typename = void>
+    auto get_shard_path(const std::filesystem::path &p_manifest_path, size_type p_shard) -> std::filesystem::path
+    {
+        return std::filesystem::path(p_manifest_path.string() + "." + std::to_string(p_shard));
     }
 
+    /// A bag split into shards, read through its manifest.
+    /// Shards are mapped when first needed, so a reader only touches the shards holding the items it finds.
+    /// It can be shared between threads.
+    class multi_bag_t
+    {
+    private:
+        struct shard_t
+        {
+            std::once_flag once;
+            mapped_bag_t bag;
+            layout_t layout;
+        };
+
+        std::filesystem::path manifest_path;
+        mapped_bag_t manifest;
+        access_advice_t advice;
+        std::vector<std::unique_ptr<shard_t>> shards;
+
+        auto open_shard(size_type p_shard) const -> const shard_t &
+        {
+            if (p_shard >= shards.size())
+                throw std::runtime_error("Invalid shard.");
+
+            shard_t &shard = *shards[p_shard];
+            std::call_once(shard.once, [&]
+                           {
+                shard.bag = mapped_bag_t(get_shard_path(manifest_path, p_shard), advice);
+                shard.layout = get_layout(shard.bag); });
+            return shard;
+        }
+
+    public:
+        explicit multi_bag_t(const std::filesystem::path &p_manifest_path, access_advice_t p_advice = access_advice_t::random)
+            : manifest_path(p_manifest_path), manifest(p_manifest_path, access_advice_t::random), advice(p_advice)
+        {
+            if (!is_manifest(manifest))
+                throw std::runtime_error("Not a manifest.");
+
+            size_type shard_count = 0;
+            for (const auto &[key, content] : entries(manifest))
+                shard_count = std::max(shard_count, get_shard_location(content).shard + 1);
+            for (size_type shard = 0; shard < shard_count; ++shard)
+                shards.push_back(std::make_unique<shard_t>());
+        }
+
+        auto get_manifest() const -> bag_type { return manifest; }
+
+        auto get_shard_count() const -> size_type { return shards.size(); }
+
+        /// Get a shard, mapping it when it is not yet.
+        auto get_shard(size_type p_shard) const -> bag_type { return open_shard(p_shard).bag; }
+
+        /// Find which shard holds an item without touching any shard.
+        auto locate(key_type p_key) const -> std::optional<shard_location_t>
+        {
+            const auto content = libbag::find(manifest.bag(), p_key);
+            if (!content)
+                return std::nullopt;
+            return get_shard_location(*content);
+        }
+
+        /// Find the content of a key in the shard holding it.
+        auto find(key_type p_key, unpack_context_t *p_context = nullptr) const -> std::optional<content_type>
+        {
+            const auto location = locate(p_key);
+            if (!location)
+                return std::nullopt;
+
+            const auto &layout = open_shard(location->shard).layout;
+            const auto ordinal = location->ordinal;
+            if (ordinal >= layout.indices.size() || layout.indices[ordinal].byte_offset != location->index.byte_offset || layout.indices[ordinal].byte_count != location->index.byte_count)
+                throw std::runtime_error("Stale shard.");
+
+            const auto [key, content] = get_verified_item(layout, ordinal, p_context ? p_context->verify_mode : verify_mode_t::on_access);
+            if (key != p_key)
+                throw std::runtime_error("Stale shard.");
+            return get_decoded_content(layout.encodings, ordinal, content, p_context);
+        }
+    };
+
+    /// A bag opened through a `bag_cache_t`, mapped and validated once for every reader of it.
+    class cached_bag_t
+    {
+    private:
+        std::filesystem::path path;
+        mapped_bag_t mapped;
+        validated_bag_t validated;
+        mutable std::atomic<size_type> last_use_tick = 0;
+
+        friend class bag_cache_t;
+
+    public:
+        cached_bag_t(const std::filesystem::path &p_path, access_advice_t p_advice, verify_mode_t p_verify_mode)
+            : path(p_path), mapped(p_path, p_advice), validated(mapped.bag(), p_verify_mode) {}
+
+        auto get_path() const -> const std::filesystem::path & { return path; }
+
+        auto bag() const -> bag_type { return mapped.bag(); }
+
+        auto get_validated() const -> const validated_bag_t & { return validated; }
+
+        /// The bytes the cache charges for the bag, which are its mapping and its parsed items.
+        auto get_byte_count() const -> size_type { return mapped.size_bytes() + validated.size() * sizeof(unpack_result_type); }
+
+        auto find(key_type p_key, unpack_context_t *p_context = nullptr) const -> std::optional<content_type> { return validated.find(p_key, p_context); }
+    };
+
+    /// A shared reference to a cached bag, which stays mapped as long as any reference to it does.
+    using bag_handle_type = std::shared_ptr<const cached_bag_t>;
+
+    /// Bags mapped and validated once, then shared between threads until they are evicted.
+    /// Bags already open are found without any lock or shared write: each thread keeps its own snapshot of the cache,
+    /// and only checks an atomic generation to know it is current, taking the lock once to renew it after the cache changed.
+    /// A bag being opened is opened by one thread, while others opening it wait for that thread rather than opening it again.
+    /// Each open copies the snapshot and scans it for the bags to evict, both linear in the number of bags, so the cache suits
+    /// many lookups of a few thousand bags rather than many opens.
+    /// The least recently used bags are evicted when the bags exceed the byte budget, though each stays mapped until its last handle
+    /// is dropped, and until every thread that looked a bag up through the cache renews its snapshot by looking up another.
+    /// Recency is only kept between opens, as evicting happens no more often, so bags used since the same open are evicted in any order.
+    /// A bag changed on disk is only seen again after it is erased from the cache.
+    class bag_cache_t
+    {
+    private:
+        using index_type = std::unordered_map<std::filesystem::path::string_type, std::shared_ptr<const cached_bag_t>>;
+
+        /// The snapshot a thread last took of a cache, which it uses as long as the cache is of the same generation.
+        struct thread_snapshot_t
+        {
+            /// Expires with the cache, for the snapshots of caches gone to be dropped.
+            std::weak_ptr<const bool> owner;
+            size_type generation = 0;
+            std::shared_ptr<const index_type> index;
+        };
+
+        size_type identifier;
+        std::shared_ptr<const bool> owner = std::make_shared<const bool>(true);
+        size_type byte_budget;
+        access_advice_t advice;
+        verify_mode_t verify_mode;
+        /// Replaced whole under the lock, then the generation is advanced for the threads to renew their snapshots.
+        std::shared_ptr<const index_type> index;
+        std::atomic<size_type> generation = 0;
+        /// Counts the opens, only advanced under the lock, so a lookup reads it without writing to a shared cache line.
+        std::atomic<size_type> tick = 0;
+        /// Held to change the snapshot, so opens and evictions do not lose each other's changes.
+        mutable std::mutex mutex;
+        size_type byte_count = 0;
+        /// The bags being opened, each by one thread, for other threads opening them to wait for.
+        std::unordered_map<std::filesystem::path::string_type, std::shared_future<bag_handle_type>> pending;
+
+        static auto get_next_identifier() -> size_type
+        {
+            static std::atomic<size_type> next_identifier = 0;
+            return next_identifier.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        /// The snapshots of the calling thread, by the identifier of their cache.
+        static auto get_thread_snapshots() -> std::unordered_map<size_type, thread_snapshot_t> &
+        {
+            thread_local std::unordered_map<size_type, thread_snapshot_t> snapshots;
+            return snapshots;
+        }
+
+        static auto get_name(const std::filesystem::path &p_path) -> std::filesystem::path::string_type { return p_path.lexically_normal().native(); }
+
+        /// Find a bag in a snapshot by its path as given, which is already its name when the path is normal, then by its name.
+        static auto find_in(const index_type &p_index, const std::filesystem::path &p_path) -> index_type::const_iterator
+        {
+            if (const auto it = p_index.find(p_path.native()); it != p_index.end())
+                return it;
+            return p_index.find(get_name(p_path));
+        }
+
+        /// Get the snapshot of the calling thread, renewing it under the lock when the cache changed since it was taken.
+        auto get_snapshot() const -> const index_type &
+        {
+            auto &snapshots = get_thread_snapshots();
+            auto it = snapshots.find(identifier);
+            if (it == snapshots.end())
+            {
+                std::erase_if(snapshots, [](const auto &p_entry)
+                              { return p_entry.second.owner.expired(); });
+                it = snapshots.emplace(identifier, thread_snapshot_t()).first;
+            }
+
+            auto &snapshot = it->second;
+            if (!snapshot.index || snapshot.generation != generation.load(std::memory_order_acquire))
+            {
+                std::scoped_lock lock(mutex);
+                snapshot = thread_snapshot_t(owner, generation.load(std::memory_order_relaxed), index);
+            }
+            return *snapshot.index;
+        }
+
+        /// Replace the snapshot, while the lock is held.
+        auto publish(std::shared_ptr<const index_type> p_index) -> void
+        {
+            index = std::move(p_index);
+            generation.fetch_add(1, std::memory_order_release);
+        }
+
+        /// Mark a bag as used since the last open, writing only when it was not already.
+        auto touch(const cached_bag_t &p_bag) const -> void
+        {
+            const auto current_tick = tick.load(std::memory_order_relaxed);
+            if (p_bag.last_use_tick.load(std::memory_order_relaxed) != current_tick)
+                p_bag.last_use_tick.store(current_tick, std::memory_order_relaxed);
+        }
+
+    public:
+        /// Keep the mapped and parsed bytes of the bags under the budget, with the access advice and verify mode to open bags with.
+        explicit bag_cache_t(size_type p_byte_budget, access_advice_t p_advice = access_advice_t::random, verify_mode_t p_verify_mode = verify_mode_t::all)
+            : identifier(get_next_identifier()), byte_budget(p_byte_budget), advice(p_advice), verify_mode(p_verify_mode), index(std::make_shared<const index_type>()) {}
+
+        bag_cache_t(const bag_cache_t &) = delete;
+        auto operator=(const bag_cache_t &) -> bag_cache_t & = delete;
+
+        /// Other threads drop their snapshots of the cache when they next take one of another cache, or when they exit.
+        ~bag_cache_t() { get_thread_snapshots().erase(identifier); }
+
+        /// Get the bag at a path, mapping and validating it when it is not in the cache.
+        /// Finding an open bag allocates nothing when the path is normal, as from `std::filesystem::path::lexically_normal`.
+        auto open(const std::filesystem::path &p_path) -> bag_handle_type
+        {
+            {
+                const auto &snapshot = get_snapshot();
+                if (const auto it = find_in(snapshot, p_path); it != snapshot.end())
+                {
+                    touch(*it->second);
+                    return it->second;
+                }
+            }
+
+            const auto name = get_name(p_path);
+            std::promise<bag_handle_type> promise;
+            {
+                std::unique_lock lock(mutex);
+                if (const auto it = index->find(name); it != index->end())
+                {
+                    touch(*it->second);
+                    return it->second;
+                }
+
+                if (const auto it = pending.find(name); it != pending.end())
+                {
+                    const auto opening = it->second;
+                    lock.unlock();
+                    return opening.get();
+                }
+                pending.emplace(name, promise.get_future().share());
+            }
+
+            // Open the bag without the lock, so other opens are not held up by it.
+            std::shared_ptr<const cached_bag_t> opened;
+            try
+            {
+                opened = std::make_shared<const cached_bag_t>(p_path, advice, verify_mode);
+            }
+            catch (...)
+            {
+                promise.set_exception(std::current_exception());
+                std::scoped_lock lock(mutex);
+                pending.erase(name);
+                throw;
+            }
+
+            {
+                std::scoped_lock lock(mutex);
+                touch(*opened);
+                tick.store(tick.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+                auto next = std::make_shared<index_type>(*index);
+                next->emplace(name, opened);
+                byte_count += opened->get_byte_count();
+
+                // Evict the least recently used bags, but never the one just opened.
+                while (byte_count > byte_budget && next->size() > 1)
+                {
+                    auto evicted = next->end();
+                    for (auto it = next->begin(); it != next->end(); ++it)
+                        if (it->second != opened && (evicted == next->end() || it->second->last_use_tick.load(std::memory_order_relaxed) < evicted->second->last_use_tick.load(std::memory_order_relaxed)))
+                            evicted = it;
+                    byte_count -= evicted->second->get_byte_count();
+                    next->erase(evicted);
+                }
+
+                publish(std::move(next));
+                pending.erase(name);
+            }
+            promise.set_value(opened);
+            return opened;
+        }
+
+        /// Drop the bag at a path from the cache, so it is opened again next time.
+        auto erase(const std::filesystem::path &p_path) -> bool
+        {
+            const auto name = get_name(p_path);
+            std::scoped_lock lock(mutex);
+            const auto it = index->find(name);
+            if (it == index->end())
+                return false;
+
+            auto next = std::make_shared<index_type>(*index);
+            byte_count -= it->second->get_byte_count();
+            next->erase(name);
+            publish(std::move(next));
+            return true;
+        }
+
+        auto clear() -> void
+        {
+            std::scoped_lock lock(mutex);
+            publish(std::make_shared<const index_type>());
+            byte_count = 0;
+        }
+
+        /// Whether the bag at a path is in the cache, without opening it or counting as a use.
+        auto contains(const std::filesystem::path &p_path) const -> bool
+        {
+            const auto &snapshot = get_snapshot();
+            return find_in(snapshot, p_path) != snapshot.end();
+        }
+
+        auto size() const -> size_type { return get_snapshot().size(); }
+
+        auto get_byte_count() const -> size_type
+        {
+            std::scoped_lock lock(mutex);
+            return byte_count;
+        }
+    };
+#endif
+
 } // namespace libbag
 
 #endif // LIBBAG_HPP
\ No newline at end of file
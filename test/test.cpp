@@ -3,6 +3,11 @@
 #include <map>
 #include <sstream>
 #include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <random>
+#include <cstdlib>
+#include <new>
 
 using collection_type = std::map<libbag::unit_string_type, libbag::unit_string_type>;
 using unpack_result_container_type = std::map<libbag::key_type, libbag::content_type>;
@@ -44,4 +49,1374 @@ TEST_CASE("Pack and unpack", "[libbag]")
     std::cout << "Output: " << output << std::endl;
 
     REQUIRE(input == output);
-}
\ No newline at end of file
+}
+
+TEST_CASE("Unpack a mapped bag", "[libbag]")
+{
+    collection_type input{
+        {"directory/file_1", "abc."},
+        {"directory/file_2", ""},
+        {"file_3", "ghi"}};
+
+    const auto path = std::filesystem::temp_directory_path() / "libbag_mapped_test.bag";
+    {
+        std::basic_ofstream<libbag::unit_type> stream(path, std::ios::binary);
+        libbag::pack(input, stream);
+    }
+
+    {
+        const libbag::mapped_bag_t bag(path, libbag::access_advice_t::random);
+        REQUIRE(bag.size_bytes() == std::filesystem::file_size(path));
+
+        unpack_result_container_type unpacked;
+        libbag::unpack_all(bag, std::inserter(unpacked, unpacked.end()));
+
+        collection_type output;
+        for (const auto &[key, content] : unpacked)
+            output.emplace(key, libbag::unit_string_type(content.begin(), content.end()));
+        REQUIRE(input == output);
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Find a key", "[libbag]")
+{
+    collection_type input;
+    for (int i = 0; i < 100; ++i)
+        input.emplace("key_" + std::to_string(i), "value_" + std::to_string(i));
+
+    for (const bool lookup_index : {false, true})
+    {
+        libbag::unit_stringstream_type stream;
+        libbag::pack(input, stream, {.lookup_index = lookup_index});
+        const libbag::unit_string_type packed = stream.str();
+        const auto bag = libbag::bag_type(packed.data(), packed.size());
+
+        for (const auto &[key, value] : input)
+        {
+            const auto content = libbag::find(bag, key);
+            REQUIRE(content.has_value());
+            REQUIRE(libbag::unit_string_type(content->begin(), content->end()) == value);
+        }
+        REQUIRE_FALSE(libbag::find(bag, "key_100").has_value());
+        REQUIRE_FALSE(libbag::find(bag, "").has_value());
+
+        unpack_result_container_type unpacked;
+        libbag::unpack_all(bag, std::inserter(unpacked, unpacked.end()));
+        REQUIRE(unpacked.size() == input.size());
+    }
+}
+
+TEST_CASE("Pack into sinks", "[libbag]")
+{
+    collection_type input{
+        {"file_1", libbag::unit_string_type(5000, 'a')},
+        {"file_2", "def."},
+        {"file_3", ""}};
+
+    libbag::unit_stringstream_type stream;
+    libbag::pack(input, stream, {.lookup_index = true});
+    const libbag::unit_string_type expected = stream.str();
+
+    libbag::unit_vector_type buffer(expected.size());
+    libbag::buffer_sink_t buffer_sink(buffer);
+    libbag::pack(input, buffer_sink, {.lookup_index = true});
+    REQUIRE(libbag::unit_string_type(buffer_sink.written().begin(), buffer_sink.written().end()) == expected);
+
+    libbag::unit_vector_type small_buffer(expected.size() - 1);
+    libbag::buffer_sink_t small_buffer_sink(small_buffer);
+    REQUIRE_THROWS_AS(libbag::pack(input, small_buffer_sink, {.lookup_index = true}), std::length_error);
+
+    const auto path = std::filesystem::temp_directory_path() / "libbag_sink_test.bag";
+    {
+        libbag::file_sink_t file_sink(path);
+        libbag::buffered_sink_t sink(file_sink, 64);
+        libbag::pack(input, sink, {.lookup_index = true});
+    }
+    std::basic_ifstream<libbag::unit_type> file(path, std::ios::binary);
+    REQUIRE(libbag::unit_string_type(std::istreambuf_iterator<libbag::unit_type>(file), {}) == expected);
+    std::filesystem::remove(path);
+}
+
+class string_source_t
+{
+private:
+    libbag::unit_string_type content;
+
+public:
+    explicit string_source_t(libbag::unit_string_type p_content)
+        : content(std::move(p_content)) {}
+
+    auto size() const -> libbag::size_type { return content.size(); }
+
+    auto read(libbag::size_type p_byte_offset, std::span<libbag::unit_type> p_buffer) const -> libbag::size_type
+    {
+        // Return short reads on purpose.
+        const auto byte_count = std::min<libbag::size_type>({p_buffer.size(), content.size() - p_byte_offset, 7});
+        std::copy_n(content.begin() + p_byte_offset, byte_count, p_buffer.begin());
+        return byte_count;
+    }
+};
+static_assert(libbag::content_source_c<string_source_t>);
+
+TEST_CASE("Pack from content sources", "[libbag]")
+{
+    collection_type input{
+        {"file_1", libbag::unit_string_type(3000000, 'a')},
+        {"file_2", "def."},
+        {"file_3", ""}};
+
+    libbag::unit_stringstream_type expected_stream;
+    libbag::pack(input, expected_stream);
+    const libbag::unit_string_type expected = expected_stream.str();
+
+    std::vector<std::pair<libbag::unit_string_type, string_source_t>> sources;
+    for (const auto &[key, value] : input)
+        sources.emplace_back(key, string_source_t(value));
+    static_assert(libbag::packing_container_c<decltype(sources)>);
+
+    libbag::unit_stringstream_type stream;
+    libbag::pack(sources, stream);
+    REQUIRE(stream.str() == expected);
+
+    const auto directory = std::filesystem::temp_directory_path() / "libbag_source_test";
+    std::filesystem::create_directories(directory);
+    std::vector<std::pair<libbag::unit_string_type, libbag::file_source_t>> files;
+    for (const auto &[key, value] : input)
+    {
+        std::basic_ofstream<libbag::unit_type>(directory / key, std::ios::binary) << value;
+        files.emplace_back(key, libbag::file_source_t(directory / key));
+    }
+
+    const auto path = directory / "bag";
+    {
+        libbag::file_sink_t file_sink(path);
+        libbag::buffered_sink_t sink(file_sink);
+        libbag::pack(files, sink);
+    }
+    std::basic_ifstream<libbag::unit_type> file(path, std::ios::binary);
+    REQUIRE(libbag::unit_string_type(std::istreambuf_iterator<libbag::unit_type>(file), {}) == expected);
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Prefetch items in order", "[libbag]")
+{
+    using item_type = std::pair<libbag::unit_string_type, libbag::unit_string_type>;
+    constexpr libbag::size_type item_count = 200;
+
+    collection_type input;
+    for (libbag::size_type i = 0; i < item_count; ++i)
+        input.emplace("key_" + std::to_string(1000 + i), libbag::unit_string_type(i * 10, 'x'));
+    const std::vector<item_type> items(input.begin(), input.end());
+
+    libbag::unit_stringstream_type expected_stream;
+    libbag::pack(input, expected_stream);
+
+    libbag::prefetcher_t<item_type> prefetcher(
+        items.size(),
+        [&](libbag::size_type p_ordinal)
+        { return items[p_ordinal]; },
+        [](const item_type &p_item)
+        { return p_item.second.size(); },
+        4,
+        512);
+    static_assert(libbag::packing_iterator_c<decltype(prefetcher.begin())>);
+
+    libbag::unit_stringstream_type stream;
+    libbag::pack(prefetcher.begin(), prefetcher.end(), stream);
+    REQUIRE(stream.str() == expected_stream.str());
+
+    libbag::prefetcher_t<item_type> failing_prefetcher(
+        items.size(),
+        [&](libbag::size_type p_ordinal)
+        {
+            if (p_ordinal == 3)
+                throw std::runtime_error("Fail to produce.");
+            return items[p_ordinal];
+        },
+        [](const item_type &p_item)
+        { return p_item.second.size(); },
+        4,
+        512);
+    libbag::unit_stringstream_type failing_stream;
+    REQUIRE_THROWS_AS(libbag::pack(failing_prefetcher.begin(), failing_prefetcher.end(), failing_stream), std::runtime_error);
+}
+
+TEST_CASE("Extract a bag", "[libbag]")
+{
+    collection_type input;
+    for (int i = 0; i < 50; ++i)
+        input.emplace("directory_" + std::to_string(i % 7) + "/nested/file_" + std::to_string(i), libbag::unit_string_type(i * 100, 'a' + i % 26));
+    input.emplace("top", "");
+
+    libbag::unit_stringstream_type stream;
+    libbag::pack(input, stream);
+    const libbag::unit_string_type packed = stream.str();
+
+    const auto destination = std::filesystem::temp_directory_path() / "libbag_extract_test";
+    std::filesystem::remove_all(destination);
+    libbag::extract(libbag::bag_type(packed.data(), packed.size()), destination, {.thread_count = 4, .preallocate = true});
+
+    for (const auto &[key, value] : input)
+    {
+        std::basic_ifstream<libbag::unit_type> file(destination / key, std::ios::binary);
+        REQUIRE(file.is_open());
+        REQUIRE(libbag::unit_string_type(std::istreambuf_iterator<libbag::unit_type>(file), {}) == value);
+    }
+    std::filesystem::remove_all(destination);
+
+    libbag::unit_stringstream_type unsafe_stream;
+    libbag::pack(collection_type{{"../escape", "x"}}, unsafe_stream);
+    const libbag::unit_string_type unsafe_packed = unsafe_stream.str();
+    REQUIRE_THROWS_AS(libbag::extract(libbag::bag_type(unsafe_packed.data(), unsafe_packed.size()), destination), std::runtime_error);
+    REQUIRE_FALSE(std::filesystem::exists(destination.parent_path() / "escape"));
+}
+
+class counting_codec_t
+{
+public:
+    static constexpr libbag::size_type identifier = 256;
+    static inline libbag::size_type decode_count = 0;
+
+    auto encode(libbag::content_type p_input, libbag::unit_vector_type &p_output) const -> void
+    {
+        // Run-length encode, so repetitive content gets smaller.
+        for (libbag::size_type i = 0; i < p_input.size();)
+        {
+            libbag::size_type count = 1;
+            while (i + count < p_input.size() && count < 255 && p_input[i + count] == p_input[i])
+                ++count;
+            p_output.push_back(static_cast<libbag::unit_type>(count));
+            p_output.push_back(p_input[i]);
+            i += count;
+        }
+    }
+
+    auto decode(libbag::content_type p_input, std::span<libbag::unit_type> p_decoded) const -> bool
+    {
+        ++decode_count;
+        libbag::size_type position = 0;
+        for (libbag::size_type i = 0; i + 1 < p_input.size(); i += 2)
+        {
+            const auto count = static_cast<unsigned char>(p_input[i]);
+            if (count > p_decoded.size() - position)
+                return false;
+            std::fill_n(p_decoded.begin() + position, count, p_input[i + 1]);
+            position += count;
+        }
+        return position == p_decoded.size();
+    }
+};
+static_assert(libbag::codec_c<counting_codec_t>);
+
+TEST_CASE("Encode contents with codecs", "[libbag]")
+{
+    libbag::unit_string_type text;
+    for (int i = 0; i < 2000; ++i)
+        text += "line " + std::to_string(i % 37) + " of some rather repetitive text.\n";
+    std::mt19937_64 generator(42);
+    libbag::unit_string_type noise;
+    for (int i = 0; i < 4096; ++i)
+        noise.push_back(static_cast<libbag::unit_type>(generator()));
+
+    collection_type input{
+        {"text", text},
+        {"noise", noise},
+        {"short", "abc"},
+        {"empty", ""},
+        {"runs", libbag::unit_string_type(100000, 'z')}};
+
+    libbag::unit_stringstream_type plain_stream;
+    libbag::pack(input, plain_stream);
+    const libbag::unit_string_type plain = plain_stream.str();
+
+    libbag::unit_stringstream_type stream;
+    libbag::pack(input, stream, {.lookup_index = true, .codec = libbag::lz_codec_t()});
+    const libbag::unit_string_type packed = stream.str();
+    const auto bag = libbag::bag_type(packed.data(), packed.size());
+    REQUIRE(packed.size() * 4 < plain.size());
+
+    const auto layout = libbag::get_layout(bag);
+    REQUIRE((layout.extension.flags & libbag::encoded_flag) != 0);
+    std::map<libbag::key_type, libbag::size_type> codecs;
+    for (libbag::size_type ordinal = 0; ordinal < layout.indices.size(); ++ordinal)
+        codecs.emplace(libbag::get_item(layout, ordinal).first, layout.encodings[ordinal].codec);
+    REQUIRE(codecs.at("text") == libbag::lz_codec_t::identifier);
+    REQUIRE(codecs.at("noise") == libbag::stored_codec_identifier);
+    REQUIRE(codecs.at("short") == libbag::stored_codec_identifier);
+
+    unpack_result_container_type unpacked;
+    REQUIRE_THROWS_AS(libbag::unpack_all(bag, std::inserter(unpacked, unpacked.end())), std::logic_error);
+
+    libbag::unpack_context_t context;
+    unpacked.clear();
+    libbag::unpack_all(bag, std::inserter(unpacked, unpacked.end()), &context);
+    collection_type output;
+    for (const auto &[key, content] : unpacked)
+        output.emplace(key, libbag::unit_string_type(content.begin(), content.end()));
+    REQUIRE(input == output);
+
+    const auto content = libbag::find(bag, "text", &context);
+    REQUIRE(content.has_value());
+    REQUIRE(libbag::unit_string_type(content->begin(), content->end()) == text);
+
+    // Contents of every size round trip, whichever table size the encoder picks for them.
+    const libbag::lz_codec_t codec;
+    for (libbag::size_type byte_count : {0, 1, 31, 32, 33, 100, 255, 256, 1000, 20000})
+    {
+        const auto original = text.substr(0, byte_count);
+        libbag::unit_vector_type encoded;
+        codec.encode(libbag::content_type(original), encoded);
+        libbag::unit_vector_type decoded(original.size());
+        REQUIRE(codec.decode(libbag::content_type(encoded), decoded));
+        REQUIRE(libbag::unit_string_type(decoded.begin(), decoded.end()) == original);
+    }
+
+    libbag::unit_stringstream_type custom_stream;
+    libbag::pack(input, custom_stream, {.codec = counting_codec_t()});
+    const libbag::unit_string_type custom_packed = custom_stream.str();
+
+    libbag::unpack_context_t custom_context;
+    custom_context.codecs.push_back(counting_codec_t());
+    unpacked.clear();
+    counting_codec_t::decode_count = 0;
+    libbag::unpack(libbag::bag_type(custom_packed.data(), custom_packed.size()), [](const libbag::attribute_type &p_attribute)
+                   { return p_attribute.first == "runs"; }, std::inserter(unpacked, unpacked.end()), &custom_context);
+    REQUIRE(counting_codec_t::decode_count == 1);
+    REQUIRE(libbag::unit_string_type(unpacked.at("runs").begin(), unpacked.at("runs").end()) == input.at("runs"));
+}
+
+TEST_CASE("Deduplicate contents", "[libbag]")
+{
+    const libbag::unit_string_type shared(10000, 's');
+    collection_type input{
+        {"en/readme", shared},
+        {"fr/readme", shared},
+        {"de/readme", shared},
+        {"unique", "only once"},
+        {"empty_1", ""},
+        {"empty_2", ""}};
+
+    libbag::unit_stringstream_type plain_stream;
+    libbag::pack(input, plain_stream);
+
+    for (const bool is_encoded : {false, true})
+    {
+        libbag::pack_options_t options{.lookup_index = true, .deduplicate = true};
+        if (is_encoded)
+            options.codec = libbag::lz_codec_t();
+
+        libbag::unit_stringstream_type stream;
+        libbag::pack(input, stream, options);
+        const libbag::unit_string_type packed = stream.str();
+        const auto bag = libbag::bag_type(packed.data(), packed.size());
+        REQUIRE(packed.size() + 2 * shared.size() <= plain_stream.str().size() + 1000);
+
+        const auto layout = libbag::get_layout(bag);
+        REQUIRE((layout.extension.flags & libbag::separated_flag) != 0);
+
+        libbag::unpack_context_t context;
+        unpack_result_container_type unpacked;
+        libbag::unpack_all(bag, std::inserter(unpacked, unpacked.end()), &context);
+        collection_type output;
+        for (const auto &[key, content] : unpacked)
+            output.emplace(key, libbag::unit_string_type(content.begin(), content.end()));
+        REQUIRE(input == output);
+
+        if (!is_encoded)
+            REQUIRE(libbag::find(bag, "en/readme")->data() == libbag::find(bag, "de/readme")->data());
+    }
+
+    std::vector<std::pair<libbag::unit_string_type, string_source_t>> sources;
+    for (const auto &[key, value] : input)
+        sources.emplace_back(key, string_source_t(value));
+    libbag::unit_stringstream_type source_stream;
+    libbag::pack(sources, source_stream, {.deduplicate = true});
+    libbag::unit_stringstream_type stream;
+    libbag::pack(input, stream, {.deduplicate = true});
+    REQUIRE(source_stream.str() == stream.str());
+}
+
+TEST_CASE("Verify checksums", "[libbag]")
+{
+    const libbag::unit_string_type check = "123456789";
+    REQUIRE(libbag::crc32c(libbag::unit_span_type(check)) == 0xE3069283);
+    REQUIRE(libbag::crc32c(libbag::unit_span_type(check).subspan(4), libbag::crc32c(libbag::unit_span_type(check).first(4))) == 0xE3069283);
+
+    libbag::unit_string_type noise(100003, '\0');
+    std::mt19937_64 generator(42);
+    for (auto &unit : noise)
+        unit = static_cast<libbag::unit_type>(generator());
+    REQUIRE(libbag::crc32c(libbag::unit_span_type(noise)) == ~libbag::crc32c_portable(~uint32_t(0), noise.data(), noise.size()));
+
+    collection_type input{
+        {"first", "the first content"},
+        {"second", noise},
+        {"third", "the third content"},
+        {"copy", "the first content"}};
+
+    for (const bool is_deduplicated : {false, true})
+    {
+        libbag::unit_stringstream_type stream;
+        libbag::pack(input, stream, {.lookup_index = true, .codec = libbag::lz_codec_t(), .deduplicate = is_deduplicated, .checksum = true});
+        libbag::unit_string_type packed = stream.str();
+        const auto bag = libbag::bag_type(packed.data(), packed.size());
+        REQUIRE(libbag::verify(bag).empty());
+
+        libbag::unpack_context_t context;
+        context.verify_mode = libbag::verify_mode_t::all;
+        unpack_result_container_type unpacked;
+        libbag::unpack_all(bag, std::inserter(unpacked, unpacked.end()), &context);
+        REQUIRE(unpacked.size() == input.size());
+
+        // Corrupt the content of one item.
+        const auto position = packed.find("the third content");
+        REQUIRE(position != libbag::unit_string_type::npos);
+        packed[position] ^= 1;
+
+        REQUIRE(libbag::verify(bag) == std::vector<libbag::key_type>{"third"});
+        REQUIRE(libbag::find(bag, "first", &context).has_value());
+        REQUIRE_THROWS_AS(libbag::find(bag, "third", &context), std::runtime_error);
+
+        context.verify_mode = libbag::verify_mode_t::off;
+        REQUIRE(libbag::find(bag, "third", &context).has_value());
+
+        context.verify_mode = libbag::verify_mode_t::on_access;
+        unpacked.clear();
+        libbag::unpack(bag, [](const libbag::attribute_type &p_attribute)
+                       { return p_attribute.first != "third"; }, std::inserter(unpacked, unpacked.end()), &context);
+        REQUIRE(unpacked.size() == input.size() - 1);
+
+        // Corrupt the indices.
+        packed[position] ^= 1;
+        const auto layout = libbag::get_layout(bag);
+        packed[layout.metadata->index_page.byte_offset + sizeof(libbag::size_type)] ^= 1;
+        REQUIRE_THROWS_AS(libbag::verify(bag), std::runtime_error);
+        packed[layout.metadata->index_page.byte_offset + sizeof(libbag::size_type)] ^= 1;
+        REQUIRE(libbag::verify(bag).empty());
+    }
+}
+
+TEST_CASE("Align contents", "[libbag]")
+{
+    std::vector<float> weights(1000);
+    for (std::size_t i = 0; i < weights.size(); ++i)
+        weights[i] = static_cast<float>(i) * 0.5f;
+    const auto weight_units = reinterpret_cast<const libbag::unit_type *>(weights.data());
+
+    collection_type input{
+        {"model/weights", libbag::unit_string_type(weight_units, weight_units + weights.size() * sizeof(float))},
+        {"model/name", "tiny"},
+        {"odd_key", "x"},
+        {"empty", ""}};
+
+    const auto path = std::filesystem::temp_directory_path() / "libbag_aligned_test.bag";
+    {
+        std::basic_ofstream<libbag::unit_type> stream(path, std::ios::binary);
+        libbag::pack(input, stream, {.content_alignment = 64});
+    }
+
+    {
+        const libbag::mapped_bag_t bag(path, libbag::access_advice_t::random);
+        const auto layout = libbag::get_layout(bag);
+        REQUIRE(layout.extension.content_alignment == 64);
+
+        for (libbag::size_type ordinal = 0; ordinal < layout.indices.size(); ++ordinal)
+            REQUIRE((libbag::get_item(layout, ordinal).second.data() - layout.origin) % 64 == 0);
+
+        const auto mapped_weights = libbag::as_array<float>(*libbag::find(bag, "model/weights"));
+        REQUIRE(std::ranges::equal(mapped_weights, weights));
+        REQUIRE_THROWS_AS(libbag::as_array<float>(*libbag::find(bag, "odd_key")), std::runtime_error);
+
+        unpack_result_container_type unpacked;
+        libbag::unpack_all(bag, std::inserter(unpacked, unpacked.end()));
+        collection_type output;
+        for (const auto &[key, content] : unpacked)
+            output.emplace(key, libbag::unit_string_type(content.begin(), content.end()));
+        REQUIRE(input == output);
+    }
+
+    std::filesystem::remove(path);
+
+    libbag::unit_stringstream_type stream;
+    REQUIRE_THROWS_AS(libbag::pack(input, stream, {.content_alignment = 48}), std::runtime_error);
+}
+
+TEST_CASE("Append to a bag", "[libbag]")
+{
+    const collection_type input{
+        {"kept", "kept content"},
+        {"replaced", "old content"},
+        {"removed", "removed content"}};
+    const collection_type appended_input{
+        {"replaced", "new content"},
+        {"added", libbag::unit_string_type(5000, 'a')}};
+    const collection_type expected{
+        {"kept", "kept content"},
+        {"replaced", "new content"},
+        {"added", libbag::unit_string_type(5000, 'a')}};
+
+    const auto unpack_to_collection = [](libbag::bag_type p_bag)
+    {
+        libbag::unpack_context_t context;
+        context.verify_mode = libbag::verify_mode_t::all;
+        unpack_result_container_type unpacked;
+        libbag::unpack_all(p_bag, std::inserter(unpacked, unpacked.end()), &context);
+        collection_type output;
+        for (const auto &[key, content] : unpacked)
+            output.emplace(key, libbag::unit_string_type(content.begin(), content.end()));
+        return output;
+    };
+
+    for (const bool is_extended : {false, true})
+    {
+        libbag::unit_stringstream_type stream;
+        libbag::pack(input, stream, is_extended ? libbag::pack_options_t{.lookup_index = true, .deduplicate = true, .checksum = true} : libbag::pack_options_t{});
+        const libbag::unit_string_type base = stream.str();
+
+        libbag::ostream_sink_t sink(stream);
+        libbag::append(libbag::bag_type(base.data(), base.size()), appended_input, sink, {.codec = libbag::lz_codec_t()}, {"removed"});
+        const libbag::unit_string_type packed = stream.str();
+        REQUIRE(packed.starts_with(base));
+        REQUIRE(packed.size() < base.size() + 1000);
+
+        const auto bag = libbag::bag_type(packed.data(), packed.size());
+        REQUIRE(unpack_to_collection(bag) == expected);
+
+        const auto layout = libbag::get_layout(bag);
+        REQUIRE(layout.extension.previous_footer.byte_offset + layout.extension.previous_footer.byte_count == base.size());
+        REQUIRE(layout.checksums.empty() != is_extended);
+        REQUIRE(libbag::find(bag, "removed") == std::nullopt);
+
+        libbag::unpack_context_t context;
+        const auto added = *libbag::find(bag, "added", &context);
+        REQUIRE(libbag::unit_string_type(added.begin(), added.end()) == expected.at("added"));
+
+        libbag::unit_stringstream_type compacted_stream;
+        libbag::ostream_sink_t compacted_sink(compacted_stream);
+        libbag::compact(bag, compacted_sink, {.codec = libbag::lz_codec_t()});
+        const libbag::unit_string_type compacted = compacted_stream.str();
+        REQUIRE(compacted.size() < packed.size());
+        REQUIRE(unpack_to_collection(libbag::bag_type(compacted.data(), compacted.size())) == expected);
+
+        const auto compacted_layout = libbag::get_layout(libbag::bag_type(compacted.data(), compacted.size()));
+        REQUIRE(compacted_layout.checksums.empty() != is_extended);
+        REQUIRE((compacted_layout.extension.lookup_page.byte_count != 0) == (layout.extension.lookup_page.byte_count != 0));
+        REQUIRE((compacted_layout.extension.flags & libbag::separated_flag) == (layout.extension.flags & libbag::separated_flag));
+        REQUIRE((compacted_layout.extension.flags & libbag::chained_flag) == 0);
+    }
+
+    // Generations chain, each shadowing the keys it packs or removes from the ones before it.
+    {
+        libbag::unit_stringstream_type stream;
+        libbag::pack(input, stream, {.lookup_index = true, .checksum = true, .key_table = true});
+        libbag::ostream_sink_t sink(stream);
+        libbag::unit_string_type packed = stream.str();
+        libbag::append(libbag::bag_type(packed.data(), packed.size()), appended_input, sink, {}, {"removed"});
+        packed = stream.str();
+        libbag::append(libbag::bag_type(packed.data(), packed.size()), collection_type{{"removed", "back again"}}, sink, {}, {"kept"});
+        packed = stream.str();
+
+        collection_type chained_expected = expected;
+        chained_expected.erase("kept");
+        chained_expected.emplace("removed", "back again");
+        const auto bag = libbag::bag_type(packed.data(), packed.size());
+        REQUIRE(unpack_to_collection(bag) == chained_expected);
+        REQUIRE(libbag::verify(bag).empty());
+        REQUIRE(libbag::find(bag, "kept") == std::nullopt);
+        for (const auto &[key, content] : chained_expected)
+        {
+            const auto found = libbag::find(bag, key);
+            REQUIRE(libbag::unit_string_type(found->begin(), found->end()) == content);
+        }
+
+        const libbag::validated_bag_t validated(bag);
+        REQUIRE(validated.size() == chained_expected.size());
+        REQUIRE(validated.find("kept") == std::nullopt);
+        std::vector<libbag::listing_type> listings;
+        libbag::list(bag, "re", std::inserter(listings, listings.end()));
+        REQUIRE(listings.size() == 2);
+
+        const auto layout = libbag::get_layout(bag);
+        REQUIRE(layout.chain->generations.size() == 3);
+        REQUIRE(!layout.checksums.empty());
+    }
+
+    // Appending writes the new items and a footer over them, whatever the size of the bag.
+    const auto get_appended_byte_count = [](int p_base_item_count, const collection_type &p_appended_input)
+    {
+        collection_type base_input;
+        for (int i = 0; i < p_base_item_count; ++i)
+            base_input.emplace("base/" + std::to_string(i), libbag::unit_string_type(100, 'b'));
+        libbag::unit_stringstream_type stream;
+        libbag::pack(base_input, stream, {.lookup_index = true, .checksum = true});
+        const libbag::unit_string_type base = stream.str();
+        libbag::ostream_sink_t sink(stream);
+        libbag::append(libbag::bag_type(base.data(), base.size()), p_appended_input, sink, {}, {"base/0"});
+        return stream.str().size() - base.size();
+    };
+    REQUIRE(get_appended_byte_count(10, appended_input) == get_appended_byte_count(10000, appended_input));
+    collection_type more_appended_input = appended_input;
+    more_appended_input.emplace("more", libbag::unit_string_type(100, 'm'));
+    REQUIRE(get_appended_byte_count(10, more_appended_input) > get_appended_byte_count(10, appended_input));
+}
+
+TEST_CASE("Rebuild from a base bag", "[libbag]")
+{
+    const collection_type input{
+        {"unchanged", libbag::unit_string_type(20000, 'u')},
+        {"changed", "old content"}};
+
+    const auto base_path = std::filesystem::temp_directory_path() / "libbag_base_test.bag";
+    const auto rebuilt_path = std::filesystem::temp_directory_path() / "libbag_rebuilt_test.bag";
+    {
+        libbag::file_sink_t file(base_path);
+        libbag::pack(input, file, {.codec = libbag::lz_codec_t(), .checksum = true, .stamp = true});
+    }
+
+    {
+        const libbag::mapped_bag_t base(base_path, libbag::access_advice_t::random);
+        const libbag::file_source_t base_file(base_path);
+        const auto base_layout = libbag::get_layout(base);
+        REQUIRE(base_layout.stamps.size() == 2);
+        for (libbag::size_type ordinal = 0; ordinal < 2; ++ordinal)
+        {
+            const auto [key, content] = libbag::get_item(base_layout, ordinal);
+            REQUIRE(base_layout.stamps[ordinal].content_hash == libbag::hash_content(input.at(libbag::unit_string_type(key))));
+        }
+
+        const libbag::size_type unchanged_ordinal = libbag::get_item(base_layout, 0).first == "unchanged" ? 0 : 1;
+        const libbag::unit_string_type changed_content = "new content";
+        std::vector<std::pair<libbag::unit_string_type, libbag::stored_item_source_t>> items;
+        items.emplace_back("changed", libbag::stored_item_source_t(libbag::content_type(changed_content), libbag::encoding_t(libbag::stored_codec_identifier, changed_content.size()), std::nullopt, std::nullopt));
+        items.emplace_back("unchanged", libbag::get_stored_item_source(base, base_layout, unchanged_ordinal, base_file.get_descriptor()));
+
+        {
+            libbag::file_sink_t file(rebuilt_path);
+            libbag::pack(items, file, {.codec = libbag::lz_codec_t(), .checksum = true, .stamp = true});
+        }
+
+        const libbag::mapped_bag_t rebuilt(rebuilt_path, libbag::access_advice_t::random);
+        REQUIRE(libbag::verify(rebuilt).empty());
+
+        // The stored content is copied as it is, without encoding it again.
+        const auto rebuilt_layout = libbag::get_layout(rebuilt);
+        const auto base_stored = libbag::get_item(base_layout, unchanged_ordinal).second;
+        REQUIRE(base_stored.size() < 1000);
+        REQUIRE(std::ranges::equal(libbag::get_item(rebuilt_layout, 1).second, base_stored));
+        REQUIRE(rebuilt_layout.encodings[1].codec == base_layout.encodings[unchanged_ordinal].codec);
+
+        libbag::unpack_context_t context;
+        const auto unchanged = *libbag::find(rebuilt, "unchanged", &context);
+        REQUIRE(libbag::unit_string_type(unchanged.begin(), unchanged.end()) == input.at("unchanged"));
+        const auto changed = *libbag::find(rebuilt, "changed", &context);
+        REQUIRE(libbag::unit_string_type(changed.begin(), changed.end()) == "new content");
+        REQUIRE(rebuilt_layout.stamps[1].content_hash == libbag::hash_content(input.at("unchanged")));
+
+        // Compacting keeps the stamps of the base, along with its checksums.
+        libbag::unit_stringstream_type compacted_stream;
+        libbag::ostream_sink_t compacted_sink(compacted_stream);
+        libbag::compact(base, compacted_sink);
+        const libbag::unit_string_type compacted = compacted_stream.str();
+        const auto compacted_layout = libbag::get_layout(libbag::bag_type(compacted.data(), compacted.size()));
+        REQUIRE(!compacted_layout.checksums.empty());
+        REQUIRE(std::ranges::equal(std::as_bytes(compacted_layout.stamps), std::as_bytes(base_layout.stamps)));
+    }
+
+    std::filesystem::remove(base_path);
+    std::filesystem::remove(rebuilt_path);
+}
+
+TEST_CASE("List keys by prefix", "[libbag]")
+{
+    collection_type input;
+    for (int i = 0; i < 100; ++i)
+        input.emplace("assets/textures/characters/hero_" + std::to_string(i) + ".ktx", std::to_string(i));
+    for (int i = 0; i < 50; ++i)
+        input.emplace("assets/meshes/" + std::to_string(i) + ".mesh", std::to_string(i));
+    input.emplace("assets/textures", "not a directory");
+    input.emplace("readme", "");
+
+    const auto list_keys = [](libbag::bag_type p_bag, libbag::key_type p_prefix)
+    {
+        std::vector<libbag::listing_type> listings;
+        libbag::list(p_bag, p_prefix, std::inserter(listings, listings.end()));
+        std::vector<libbag::unit_string_type> keys;
+        for (const auto &[key, ordinal] : listings)
+        {
+            REQUIRE(libbag::get_item(libbag::get_layout(p_bag), ordinal).first == key);
+            keys.push_back(key);
+        }
+        return keys;
+    };
+
+    libbag::unit_stringstream_type plain_stream;
+    libbag::pack(input, plain_stream);
+    const libbag::unit_string_type plain = plain_stream.str();
+
+    libbag::unit_stringstream_type stream;
+    libbag::pack(input, stream, {.key_table = true});
+    const libbag::unit_string_type packed = stream.str();
+    const auto bag = libbag::bag_type(packed.data(), packed.size());
+    REQUIRE(!libbag::get_layout(bag).key_page.empty());
+    REQUIRE(libbag::get_layout(bag).key_page.size() < 3000);
+
+    for (const libbag::key_type prefix : {"assets/textures/", "assets/textures", "assets/meshes/1", "assets/", "", "readme", "zzz", "a"})
+    {
+        std::vector<libbag::unit_string_type> expected;
+        for (const auto &[key, content] : input)
+            if (key.starts_with(prefix))
+                expected.push_back(key);
+
+        REQUIRE(list_keys(bag, prefix) == expected);
+        REQUIRE(list_keys(libbag::bag_type(plain.data(), plain.size()), prefix) == expected);
+    }
+}
+
+namespace
+{
+    thread_local bool is_counting_allocations = false;
+    thread_local std::size_t allocation_count = 0;
+}
+
+[[gnu::noinline]] auto operator new(std::size_t p_byte_count) -> void *
+{
+    if (is_counting_allocations)
+        ++allocation_count;
+    if (void *pointer = std::malloc(p_byte_count == 0 ? 1 : p_byte_count))
+        return pointer;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] auto operator delete(void *p_pointer) noexcept -> void { std::free(p_pointer); }
+
+[[gnu::noinline]] auto operator delete(void *p_pointer, std::size_t) noexcept -> void { std::free(p_pointer); }
+
+TEST_CASE("View entries lazily", "[libbag]")
+{
+    collection_type input;
+    for (int i = 0; i < 100; ++i)
+        input.emplace("entry_" + std::to_string(i), libbag::unit_string_type(static_cast<std::size_t>(i), 'e'));
+
+    libbag::unit_stringstream_type stream;
+    libbag::pack(input, stream, {.checksum = true});
+    const libbag::unit_string_type packed = stream.str();
+    const auto bag = libbag::bag_type(packed.data(), packed.size());
+
+    const auto view = libbag::entries(bag);
+    static_assert(std::ranges::random_access_range<decltype(view)>);
+    static_assert(std::ranges::view<libbag::entry_view_t>);
+    REQUIRE(view.size() == input.size());
+
+    collection_type output;
+    for (const auto &[key, content] : view)
+        output.emplace(key, libbag::unit_string_type(content.begin(), content.end()));
+    REQUIRE(output == input);
+
+    // A filtered scan allocates nothing.
+    std::size_t total_byte_count = 0;
+    std::size_t taken_count = 0;
+    allocation_count = 0;
+    is_counting_allocations = true;
+    for (const auto &[key, content] : libbag::entries(bag) | std::views::filter([](const libbag::unpack_result_type &p_entry)
+                                                                                 { return p_entry.second.size() % 2 == 0; }) |
+                                          std::views::take(10))
+    {
+        total_byte_count += content.size();
+        ++taken_count;
+    }
+    is_counting_allocations = false;
+    REQUIRE(allocation_count == 0);
+    REQUIRE(taken_count == 10);
+
+    std::size_t expected_byte_count = 0;
+    for (const auto &[key, content] : input | std::views::filter([](const auto &p_entry)
+                                                                 { return p_entry.second.size() % 2 == 0; }) |
+                                          std::views::take(10))
+        expected_byte_count += content.size();
+    REQUIRE(total_byte_count == expected_byte_count);
+}
+
+TEST_CASE("Reuse memory between packs and unpacks", "[libbag]")
+{
+    collection_type input;
+    for (int i = 0; i < 50; ++i)
+        input.emplace("item_" + std::to_string(i), libbag::unit_string_type(static_cast<std::size_t>(i) * 100, static_cast<char>('a' + i % 26)));
+
+    // Pack with the pages built in a buffer, reserved for the known item count.
+    std::array<std::byte, 1 << 16> pack_buffer;
+    std::pmr::monotonic_buffer_resource pack_resource(pack_buffer.data(), pack_buffer.size(), std::pmr::null_memory_resource());
+    libbag::unit_stringstream_type stream;
+    libbag::pack(input, stream, {.codec = libbag::lz_codec_t(), .checksum = true, .key_table = true, .expected_item_count = input.size(), .memory_resource = &pack_resource});
+    const libbag::unit_string_type packed = stream.str();
+    const auto bag = libbag::bag_type(packed.data(), packed.size());
+
+    // The first unpack sizes the context, and later ones allocate nothing in it.
+    std::pmr::vector<libbag::unpack_result_type> unpacked;
+    libbag::unpack_context_t context;
+    libbag::unpack_all(bag, std::inserter(unpacked, unpacked.end()), &context);
+    REQUIRE(unpacked.size() == input.size());
+
+    for (int round = 0; round < 3; ++round)
+    {
+        context.clear();
+        unpacked.clear();
+        allocation_count = 0;
+        is_counting_allocations = true;
+        libbag::unpack_all(bag, std::inserter(unpacked, unpacked.end()), &context);
+        is_counting_allocations = false;
+        REQUIRE(allocation_count == 0);
+    }
+
+    collection_type output;
+    for (const auto &[key, content] : unpacked)
+        output.emplace(key, libbag::unit_string_type(content.begin(), content.end()));
+    REQUIRE(output == input);
+
+    // Unpack into a vector on a memory resource.
+    std::pmr::unsynchronized_pool_resource pool;
+    libbag::unpack_context_t pooled_context(&pool);
+    const auto items = libbag::unpack_all(bag, std::pmr::polymorphic_allocator<libbag::unpack_result_type>(&pool), &pooled_context);
+    REQUIRE(items.size() == input.size());
+    REQUIRE(items.get_allocator().resource() == &pool);
+    for (const auto &[key, content] : items)
+        REQUIRE(libbag::unit_string_type(content.begin(), content.end()) == input.at(libbag::unit_string_type(key)));
+}
+
+TEST_CASE("Unpack a streamed bag in one pass", "[libbag]")
+{
+    collection_type input{
+        {"empty", ""},
+        {"small", "abc"},
+        {"runs", libbag::unit_string_type(5000, 'r')},
+        {"noise", "q8Zk1Lp0xW3vB7nM2cT6yH4jD9fG5sR"},
+    };
+
+    libbag::unit_stringstream_type stream;
+    libbag::pack(input, stream, {.codec = libbag::lz_codec_t(), .checksum = true, .content_alignment = 8, .stream = true});
+    const libbag::unit_string_type packed = stream.str();
+
+    // It is still read at random.
+    const auto bag = libbag::bag_type(packed.data(), packed.size());
+    unpack_result_container_type unpacked;
+    libbag::unpack_context_t context;
+    libbag::unpack_all(bag, std::inserter(unpacked, unpacked.end()), &context);
+    collection_type output;
+    for (const auto &[key, content] : unpacked)
+        output.emplace(key, libbag::unit_string_type(content.begin(), content.end()));
+    REQUIRE(output == input);
+    REQUIRE(libbag::verify(bag).empty());
+
+    // It is read in one pass, in chunks.
+    const auto stream_unpack_all = [](const libbag::unit_string_type &p_packed)
+    {
+        libbag::unit_stringstream_type input_stream(p_packed);
+        collection_type streamed;
+        libbag::size_type chunk_count = 0;
+        libbag::stream_unpack(input_stream, [&](const libbag::stream_chunk_t &p_chunk)
+                              {
+            auto &content = streamed[libbag::unit_string_type(p_chunk.key)];
+            REQUIRE(content.size() == p_chunk.byte_offset);
+            content.append(p_chunk.content.begin(), p_chunk.content.end());
+            REQUIRE(p_chunk.is_last() == (content.size() == p_chunk.byte_count));
+            ++chunk_count; }, {.chunk_byte_count = 1024});
+        return std::pair(streamed, chunk_count);
+    };
+    const auto [streamed, chunk_count] = stream_unpack_all(packed);
+    REQUIRE(streamed == input);
+    REQUIRE(chunk_count == 1 + 1 + 5 + 1);
+
+    // A corrupted content is caught.
+    libbag::unit_string_type corrupted = packed;
+    corrupted[corrupted.find("q8Zk1")] ^= 1;
+    REQUIRE_THROWS_AS(stream_unpack_all(corrupted), std::runtime_error);
+
+    // A truncated stream is caught.
+    REQUIRE_THROWS_AS(stream_unpack_all(packed.substr(0, packed.size() / 2)), std::runtime_error);
+
+    // Headers beyond the limits are refused before anything is allocated for them.
+    const auto stream_unpack_limited = [&](const libbag::stream_options_t &p_options)
+    {
+        libbag::unit_stringstream_type input_stream(packed);
+        libbag::stream_unpack(input_stream, [](const libbag::stream_chunk_t &) {}, p_options);
+    };
+    REQUIRE_NOTHROW(stream_unpack_limited({.max_key_byte_count = 6, .max_buffered_byte_count = 5000}));
+    REQUIRE_THROWS_AS(stream_unpack_limited({.max_key_byte_count = 5}), std::runtime_error);
+    REQUIRE_THROWS_AS(stream_unpack_limited({.max_buffered_byte_count = 4999}), std::runtime_error);
+
+    // Only bags packed as streamed are read as streams.
+    libbag::unit_stringstream_type plain_stream;
+    libbag::pack(input, plain_stream);
+    REQUIRE_THROWS_AS(stream_unpack_all(plain_stream.str()), std::runtime_error);
+
+    // Verifying all needs the checksums.
+    libbag::unit_stringstream_type unchecksummed_stream;
+    libbag::pack(input, unchecksummed_stream, {.stream = true});
+    libbag::unit_stringstream_type unchecksummed_input(unchecksummed_stream.str());
+    REQUIRE_NOTHROW(libbag::stream_unpack(unchecksummed_input, [](const libbag::stream_chunk_t &) {}));
+    unchecksummed_input = libbag::unit_stringstream_type(unchecksummed_stream.str());
+    REQUIRE_THROWS_AS(libbag::stream_unpack(unchecksummed_input, [](const libbag::stream_chunk_t &) {}, {.verify_mode = libbag::verify_mode_t::all}), std::runtime_error);
+
+    libbag::unit_stringstream_type shared_stream;
+    REQUIRE_THROWS_AS(libbag::pack(input, shared_stream, {.deduplicate = true, .stream = true}), std::runtime_error);
+}
+
+TEST_CASE("Read a bag split into shards", "[libbag]")
+{
+    const auto directory_path = std::filesystem::temp_directory_path() / "libbag_test_shards";
+    std::filesystem::remove_all(directory_path);
+    std::filesystem::create_directories(directory_path);
+    const auto manifest_path = directory_path / "sharded.bag";
+
+    const std::vector<collection_type> shard_inputs{
+        {{"a/one", "first"}, {"a/two", libbag::unit_string_type(3000, '2')}},
+        {{"b/three", "third"}},
+        {{"c/four", ""}, {"c/five", libbag::unit_string_type(2000, '5')}},
+    };
+
+    {
+        std::vector<libbag::mapped_bag_t> shards;
+        for (libbag::size_type shard = 0; shard < shard_inputs.size(); ++shard)
+        {
+            const auto shard_path = libbag::get_shard_path(manifest_path, shard);
+            {
+                libbag::file_sink_t file(shard_path);
+                libbag::buffered_sink_t sink(file);
+                libbag::pack(shard_inputs[shard].begin(), shard_inputs[shard].end(), sink, {.codec = libbag::lz_codec_t()});
+            }
+            shards.emplace_back(shard_path);
+        }
+
+        const std::vector<libbag::bag_type> shard_bags(shards.begin(), shards.end());
+        libbag::file_sink_t file(manifest_path);
+        libbag::buffered_sink_t sink(file);
+        libbag::pack_manifest(shard_bags, sink);
+    }
+
+    const libbag::multi_bag_t bag(manifest_path);
+    REQUIRE(bag.get_shard_count() == shard_inputs.size());
+
+    // Locating an item touches no shard.
+    const auto location = bag.locate("b/three");
+    REQUIRE(location.has_value());
+    REQUIRE(location->shard == 1);
+    REQUIRE(location->ordinal == 0);
+    REQUIRE_FALSE(bag.locate("missing").has_value());
+
+    libbag::unpack_context_t context;
+    for (const auto &shard_input : shard_inputs)
+        for (const auto &[key, content] : shard_input)
+        {
+            const auto found = bag.find(key, &context);
+            REQUIRE(found.has_value());
+            REQUIRE(libbag::unit_string_type(found->begin(), found->end()) == content);
+        }
+    REQUIRE_FALSE(bag.find("missing", &context).has_value());
+
+    // The manifest holds no contents of its own.
+    REQUIRE(libbag::is_manifest(bag.get_manifest()));
+    REQUIRE_FALSE(libbag::is_manifest(bag.get_shard(0)));
+    REQUIRE_THROWS_AS(libbag::extract(bag.get_manifest(), directory_path / "out"), std::runtime_error);
+
+    // A shard packed again after the manifest is caught.
+    {
+        const collection_type replaced{{"b/three", "third, replaced"}, {"b/zero", "0"}};
+        libbag::file_sink_t file(libbag::get_shard_path(manifest_path, 1));
+        libbag::buffered_sink_t sink(file);
+        libbag::pack(replaced.begin(), replaced.end(), sink);
+    }
+    const libbag::multi_bag_t replaced_bag(manifest_path);
+    REQUIRE_THROWS_AS(replaced_bag.find("b/three"), std::runtime_error);
+
+    std::filesystem::remove_all(directory_path);
+}
+
+namespace
+{
+    constexpr char embedded_units[] = "key\0value";
+    constexpr std::array<libbag::size_type, 1> embedded_seeds{0};
+    constexpr std::array<libbag::embedded_entry_t, 1> embedded_entries{libbag::embedded_entry_t(libbag::slice_t(0, 3), libbag::slice_t(4, 5))};
+    constexpr libbag::embedded_bag_t embedded_bag(libbag::bag_type(embedded_units, sizeof(embedded_units) - 1), embedded_seeds, embedded_entries);
+
+    static_assert(embedded_bag.find("key").has_value());
+    static_assert(embedded_bag.find("key")->size() == 5);
+    static_assert(!embedded_bag.find("other").has_value());
+}
+
+TEST_CASE("Embed a bag with a perfect hash", "[libbag]")
+{
+    collection_type input;
+    for (int i = 0; i < 1000; ++i)
+        input.emplace("resource/" + std::to_string(i * 7919 % 1000) + ".txt", "content " + std::to_string(i));
+    input.emplace("", "empty key");
+
+    libbag::unit_stringstream_type stream;
+    libbag::pack(input, stream);
+    const libbag::unit_string_type packed = stream.str();
+    const auto bag = libbag::bag_type(packed.data(), packed.size());
+
+    // Every key has a slot of its own.
+    std::vector<libbag::key_type> keys;
+    for (const auto &[key, content] : input)
+        keys.push_back(key);
+    const auto hash = libbag::build_perfect_hash(keys);
+    REQUIRE(hash.ordinals.size() == keys.size());
+    REQUIRE(std::set<libbag::size_type>(hash.ordinals.begin(), hash.ordinals.end()).size() == keys.size());
+
+    // Keys of the same hash are refused at once, rather than searched for a seed that cannot exist.
+    std::vector<libbag::key_type> repeated_keys = keys;
+    repeated_keys.push_back(keys.front());
+    REQUIRE_THROWS_AS(libbag::build_perfect_hash(repeated_keys), std::runtime_error);
+
+    // Find through the table as the generated header does.
+    const auto layout = libbag::get_layout(bag);
+    std::vector<libbag::embedded_entry_t> entries;
+    for (const auto ordinal : hash.ordinals)
+    {
+        const auto [key, content] = libbag::get_item(layout, ordinal);
+        entries.emplace_back(libbag::slice_t(key.data() - bag.data(), key.size()), libbag::slice_t(content.data() - bag.data(), content.size()));
+    }
+    const libbag::embedded_bag_t embedded(bag, hash.seeds, entries);
+    for (const auto &[key, content] : input)
+    {
+        const auto found = embedded.find(key);
+        REQUIRE(found.has_value());
+        REQUIRE(libbag::unit_string_type(found->begin(), found->end()) == content);
+    }
+    REQUIRE_FALSE(embedded.find("resource/1000.txt").has_value());
+
+    libbag::unit_stringstream_type header;
+    libbag::write_embedded_header(bag, "resources", header);
+    REQUIRE(header.str().find("namespace resources") != libbag::unit_string_type::npos);
+    REQUIRE(header.str().find("std::array<libbag::embedded_entry_t, 1001> bag_entries") != libbag::unit_string_type::npos);
+
+    libbag::unit_stringstream_type encoded_stream;
+    libbag::pack(collection_type{{"runs", libbag::unit_string_type(5000, 'r')}}, encoded_stream, {.codec = libbag::lz_codec_t()});
+    const libbag::unit_string_type encoded = encoded_stream.str();
+    libbag::unit_stringstream_type encoded_header;
+    REQUIRE_THROWS_AS(libbag::write_embedded_header(libbag::bag_type(encoded.data(), encoded.size()), "resources", encoded_header), std::runtime_error);
+}
+
+namespace
+{
+    struct recording_observer_t
+    {
+        std::vector<std::pair<libbag::phase_t, bool>> phases;
+        std::map<libbag::phase_t, std::vector<std::pair<libbag::unit_string_type, libbag::size_type>>> entries;
+
+        auto on_phase_begin(libbag::phase_t p_phase) -> void { phases.emplace_back(p_phase, true); }
+
+        auto on_phase_end(libbag::phase_t p_phase) -> void { phases.emplace_back(p_phase, false); }
+
+        auto on_entry(libbag::phase_t p_phase, libbag::key_type p_key, libbag::size_type p_byte_count) -> void
+        {
+            entries[p_phase].emplace_back(p_key, p_byte_count);
+        }
+    };
+}
+
+TEST_CASE("Observe packing and unpacking", "[libbag]")
+{
+    const collection_type input{
+        {"empty", ""},
+        {"runs", libbag::unit_string_type(5000, 'r')},
+        {"small", "abc"},
+    };
+
+    recording_observer_t pack_observer;
+    libbag::unit_stringstream_type stream;
+    libbag::ostream_sink_t sink(stream);
+    libbag::pack(input.begin(), input.end(), sink, {.lookup_index = true, .codec = libbag::lz_codec_t()}, pack_observer);
+    const libbag::unit_string_type packed = stream.str();
+    const auto bag = libbag::bag_type(packed.data(), packed.size());
+
+    // Phases are balanced, and each item is told once with its stored byte count.
+    std::map<libbag::phase_t, int> depths;
+    for (const auto &[phase, is_begin] : pack_observer.phases)
+    {
+        depths[phase] += is_begin ? 1 : -1;
+        REQUIRE(depths[phase] >= 0);
+        REQUIRE(depths[phase] <= 1);
+    }
+    for (const auto &[phase, depth] : depths)
+        REQUIRE(depth == 0);
+    REQUIRE(depths.contains(libbag::phase_t::read_inputs));
+    REQUIRE(depths.contains(libbag::phase_t::encode_contents));
+    REQUIRE(depths.contains(libbag::phase_t::build_pages));
+    REQUIRE(depths.contains(libbag::phase_t::write_pages));
+
+    const auto &written = pack_observer.entries.at(libbag::phase_t::write_items);
+    REQUIRE(written.size() == input.size());
+    REQUIRE(written[0] == std::pair<libbag::unit_string_type, libbag::size_type>("empty", 0));
+    REQUIRE(written[1].second < 5000);
+    REQUIRE(written[2] == std::pair<libbag::unit_string_type, libbag::size_type>("small", 3));
+
+    // Unpacking tells the attributes listed and the decoded byte counts.
+    recording_observer_t unpack_observer;
+    unpack_result_container_type unpacked;
+    libbag::unpack_context_t context;
+    libbag::unpack_all(bag, std::inserter(unpacked, unpacked.end()), &context, unpack_observer);
+    REQUIRE(unpack_observer.entries.at(libbag::phase_t::list_attributes).size() == input.size());
+    REQUIRE(unpack_observer.entries.at(libbag::phase_t::unpack_items)[1] == std::pair<libbag::unit_string_type, libbag::size_type>("runs", 5000));
+
+    // The stats observer reports the same.
+    libbag::stats_observer_t stats;
+    unpacked.clear();
+    context.clear();
+    libbag::unpack_all(bag, std::inserter(unpacked, unpacked.end()), &context, stats);
+    const auto phases = stats.get_phases();
+    const auto &unpacked_stats = phases.at(libbag::phase_t::unpack_items);
+    REQUIRE(unpacked_stats.entry_count == 3);
+    REQUIRE(unpacked_stats.byte_count == 5003);
+    REQUIRE(unpacked_stats.histogram[0] == 1);
+    REQUIRE(unpacked_stats.histogram[2] == 1);
+    REQUIRE(unpacked_stats.histogram[13] == 1);
+
+    std::stringstream json;
+    stats.write_json(json);
+    REQUIRE(json.str().find("\"phase\": \"unpack_items\"") != std::string::npos);
+    REQUIRE(json.str().find("\"bytes\": 5003") != std::string::npos);
+    std::stringstream text;
+    stats.write_text(text);
+    REQUIRE(text.str().find("unpack_items: ") != std::string::npos);
+
+    // Threads in the same phase are timed apart, so a short one does not cut the time of a long one.
+    libbag::stats_observer_t threaded_stats;
+    threaded_stats.on_phase_begin(libbag::phase_t::write_files);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::thread([&]
+                {
+        threaded_stats.on_phase_begin(libbag::phase_t::write_files);
+        threaded_stats.on_phase_end(libbag::phase_t::write_files); })
+        .join();
+    threaded_stats.on_phase_end(libbag::phase_t::write_files);
+    REQUIRE(threaded_stats.get_phases().at(libbag::phase_t::write_files).duration >= std::chrono::milliseconds(20));
+}
+
+TEST_CASE("Validate a bag once", "[libbag]")
+{
+    const collection_type input{
+        {"en/readme", libbag::unit_string_type(5000, 'r')},
+        {"fr/readme", libbag::unit_string_type(5000, 'r')},
+        {"empty", ""},
+        {"small", "abc"}};
+
+    for (const auto &options : {libbag::pack_options_t{}, libbag::pack_options_t{.lookup_index = true, .codec = libbag::lz_codec_t(), .deduplicate = true, .checksum = true}})
+    {
+        libbag::unit_stringstream_type stream;
+        libbag::pack(input, stream, options);
+        const libbag::unit_string_type packed = stream.str();
+        const auto bag = libbag::bag_type(packed.data(), packed.size());
+        const libbag::validated_bag_t validated(bag);
+        REQUIRE(validated.size() == input.size());
+
+        // The validated bag unpacks and finds what the bag does.
+        libbag::unpack_context_t context;
+        unpack_result_container_type unpacked;
+        libbag::unpack_all(validated, std::inserter(unpacked, unpacked.end()), &context);
+        collection_type output;
+        for (const auto &[key, content] : unpacked)
+            output.emplace(key, libbag::unit_string_type(content.begin(), content.end()));
+        REQUIRE(input == output);
+
+        std::vector<libbag::attribute_type> attributes;
+        std::vector<libbag::attribute_type> validated_attributes;
+        libbag::get_attributes(bag, std::inserter(attributes, attributes.end()));
+        libbag::get_attributes(validated, std::inserter(validated_attributes, validated_attributes.end()));
+        REQUIRE(attributes.size() == validated_attributes.size());
+        for (std::size_t i = 0; i < attributes.size(); ++i)
+        {
+            REQUIRE(attributes[i].first == validated_attributes[i].first);
+            REQUIRE(attributes[i].second.byte_offset == validated_attributes[i].second.byte_offset);
+        }
+
+        for (const auto &[key, value] : input)
+        {
+            const auto content = *validated.find(key, &context);
+            REQUIRE(libbag::unit_string_type(content.begin(), content.end()) == value);
+        }
+        REQUIRE(validated.find("missing") == std::nullopt);
+    }
+
+    // Without verifying everything on opening, each item is verified when it is first accessed.
+    libbag::unit_stringstream_type checksummed_stream;
+    libbag::pack(input, checksummed_stream, {.checksum = true});
+    libbag::unit_string_type corrupted = checksummed_stream.str();
+    corrupted[corrupted.find("abc")] ^= 1;
+    const auto corrupted_bag = libbag::bag_type(corrupted.data(), corrupted.size());
+    REQUIRE_THROWS_AS(libbag::validated_bag_t(corrupted_bag), std::runtime_error);
+    {
+        const libbag::validated_bag_t validated(corrupted_bag, libbag::verify_mode_t::on_access);
+        libbag::unpack_context_t context;
+        REQUIRE(validated.find("empty", &context).has_value());
+        REQUIRE_THROWS_AS(validated.find("small", &context), std::runtime_error);
+        unpack_result_container_type unpacked;
+        REQUIRE_THROWS_AS(libbag::unpack_all(validated, std::inserter(unpacked, unpacked.end()), &context), std::runtime_error);
+
+        context.verify_mode = libbag::verify_mode_t::off;
+        REQUIRE(validated.find("small", &context).has_value());
+    }
+
+    libbag::unit_stringstream_type stream;
+    libbag::pack(input, stream);
+    const libbag::unit_string_type packed = stream.str();
+    const auto layout = libbag::get_layout(libbag::bag_type(packed.data(), packed.size()));
+    const auto index_page_byte_offset = layout.metadata->index_page.byte_offset;
+
+    // Broken structures are refused when the bag is opened.
+    REQUIRE_THROWS(libbag::validated_bag_t(libbag::bag_type(packed.data(), 4)));
+
+    libbag::unit_string_type overlapping = packed;
+    const libbag::slice_t overlapping_index(layout.indices[0].byte_offset + 1, layout.indices[0].byte_count);
+    std::memcpy(overlapping.data() + index_page_byte_offset + sizeof(libbag::slice_t), &overlapping_index, sizeof(overlapping_index));
+    REQUIRE_THROWS(libbag::validated_bag_t(libbag::bag_type(overlapping.data(), overlapping.size())));
+
+    libbag::unit_string_type unterminated = packed;
+    const auto key_byte_count = layout.indices[0].byte_count - input.begin()->second.size();
+    unterminated[layout.indices[0].byte_offset + key_byte_count - 1] = 'x';
+    REQUIRE(unterminated.substr(layout.indices[0].byte_offset, layout.indices[0].byte_count).find('\0') == std::string::npos);
+    REQUIRE_THROWS(libbag::validated_bag_t(libbag::bag_type(unterminated.data(), unterminated.size())));
+}
+
+TEST_CASE("Share bags through a cache", "[libbag]")
+{
+    const auto directory = std::filesystem::temp_directory_path() / "libbag_cache_test";
+    std::filesystem::create_directories(directory);
+    std::vector<std::filesystem::path> paths;
+    for (int i = 0; i < 3; ++i)
+    {
+        paths.push_back(directory / ("bag_" + std::to_string(i) + ".bag"));
+        std::basic_ofstream<libbag::unit_type> stream(paths.back(), std::ios::binary);
+        libbag::pack(collection_type{{"name", "bag " + std::to_string(i)}, {"shared", "content"}}, stream, {.lookup_index = true});
+    }
+
+    const auto byte_count = libbag::bag_cache_t(1 << 20).open(paths[0])->get_byte_count();
+    libbag::bag_cache_t cache(byte_count * 2);
+
+    // Opening a bag again gets the same mapping.
+    const auto first = cache.open(paths[0]);
+    REQUIRE(cache.open(directory / "." / "bag_0.bag") == first);
+    const auto second = cache.open(paths[1]);
+    REQUIRE(cache.size() == 2);
+    REQUIRE(cache.get_byte_count() == byte_count * 2);
+
+    // The least recently used bag is evicted, but stays mapped for its handle.
+    REQUIRE(cache.open(paths[0]) == first);
+    const auto third = cache.open(paths[2]);
+    REQUIRE(cache.size() == 2);
+    REQUIRE(cache.contains(paths[0]));
+    REQUIRE_FALSE(cache.contains(paths[1]));
+    REQUIRE(cache.contains(paths[2]));
+    const auto name = *second->find("name");
+    REQUIRE(libbag::unit_string_type(name.begin(), name.end()) == "bag 1");
+
+    REQUIRE(cache.erase(paths[0]));
+    REQUIRE_FALSE(cache.erase(paths[0]));
+    REQUIRE(cache.get_byte_count() == byte_count);
+    REQUIRE(cache.open(paths[0]) != first);
+
+    // Threads opening the same bag at once share one opening of it, and a failed opening throws for each of them.
+    cache.clear();
+    {
+        std::vector<libbag::bag_handle_type> handles(4);
+        std::atomic<int> failure_count = 0;
+        std::vector<std::thread> threads;
+        for (std::size_t t = 0; t < handles.size(); ++t)
+            threads.emplace_back([&, t]
+                                 {
+                handles[t] = cache.open(paths[1]);
+                try
+                {
+                    cache.open(directory / "missing.bag");
+                }
+                catch (const std::exception &)
+                {
+                    ++failure_count;
+                } });
+        for (auto &thread : threads)
+            thread.join();
+        REQUIRE(std::ranges::all_of(handles, [&](const auto &p_handle)
+                                    { return p_handle == handles[0]; }));
+        REQUIRE(failure_count == 4);
+        REQUIRE(cache.size() == 1);
+
+        // A thread sees the changes other threads make once its snapshot is renewed.
+        REQUIRE(cache.contains(paths[1]));
+        std::thread([&]
+                    { cache.erase(paths[1]); })
+            .join();
+        REQUIRE_FALSE(cache.contains(paths[1]));
+        REQUIRE(cache.size() == 0);
+    }
+
+    // Threads share the open bags.
+    cache.clear();
+    std::atomic<int> found_count = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([&, t]
+                             {
+            for (int i = 0; i < 300; ++i)
+            {
+                const auto bag = cache.open(paths[(i + t) % paths.size()]);
+                if (bag->find("shared"))
+                    ++found_count;
+            } });
+    for (auto &thread : threads)
+        thread.join();
+    REQUIRE(found_count == 1200);
+    REQUIRE(cache.get_byte_count() <= byte_count * 2);
+
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("Read and write files in batches", "[libbag]")
+{
+    collection_type input;
+    for (int i = 0; i < 200; ++i)
+        input.emplace("directory_" + std::to_string(i % 5) + "/file_" + std::to_string(i), libbag::unit_string_type(i * 7, 'a' + i % 26));
+    input.emplace("large", libbag::unit_string_type(3000, 'l'));
+
+    std::vector<libbag::io_backend_t> backends{libbag::io_backend_t::threads, libbag::io_backend_t::automatic};
+#if LIBBAG_HAS_URING
+    if (libbag::uring_t::is_available())
+        backends.push_back(libbag::io_backend_t::uring);
+#endif
+
+    libbag::unit_stringstream_type stream;
+    libbag::pack(input, stream, {.codec = libbag::lz_codec_t()});
+    const libbag::unit_string_type packed = stream.str();
+    const auto bag = libbag::bag_type(packed.data(), packed.size());
+
+    const auto destination = std::filesystem::temp_directory_path() / "libbag_batch_test";
+    for (const auto backend : backends)
+    {
+        // Extracting writes every file, with the same content whichever backend writes it.
+        std::filesystem::remove_all(destination);
+        libbag::extract(bag, destination, {.thread_count = 2, .preallocate = true, .io_backend = backend});
+
+        std::vector<std::filesystem::path> paths;
+        for (const auto &[key, value] : input)
+            paths.push_back(destination / key);
+        const auto files = libbag::read_files(paths, 2048, backend);
+        REQUIRE(files.size() == input.size());
+
+        auto it = input.begin();
+        for (std::size_t i = 0; i < files.size(); ++i, ++it)
+        {
+            REQUIRE(files[i].stamp.content_hash.byte_count == it->second.size());
+            REQUIRE(files[i].stamp.modification_time != 0);
+            if (it->second.size() > 2048)
+            {
+                REQUIRE_FALSE(files[i].content.has_value());
+                continue;
+            }
+            REQUIRE(libbag::unit_string_type(files[i].content->begin(), files[i].content->end()) == it->second);
+        }
+
+        const std::filesystem::path missing_path = destination / "missing";
+        REQUIRE_THROWS_AS(libbag::read_files(std::span(&missing_path, 1), 2048, backend), std::system_error);
+    }
+    std::filesystem::remove_all(destination);
+}